@@ -0,0 +1,172 @@
+#include "lune.h"
+#include "clock.h"
+#include "io/file.h"
+#include "util/compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Measures how seekable zstd compression and decompression scale with the number of threads:
+//   compressbench [--size MiB] [--level n] [--frame KiB] [--threads n] [--runs n] [file]
+// Without a file, generated text records are used. Thread counts double from 1 up to --threads, which
+// defaults to the number of cores, and each count runs on a pool of exactly that many threads
+
+void lune::CustomLuaSetup(lua_State *L) {}
+
+namespace {
+int Usage()
+{
+	fprintf(stderr, "usage: compressbench [--size MiB] [--level n] [--frame KiB] [--threads n] [--runs n] [file]\n");
+	return 1;
+}
+
+// Log-like lines with some repetition, so the ratio and speed are in the range of real game data
+lune::BlobPtr Generate(size_t size)
+{
+	lune::BlobPtr b = new lune::OwnedMemoryBlob(size);
+	auto p = (char *)b->GetData();
+	uint32_t x = 1;
+	std::string line;
+	for(size_t done = 0, i = 0; done < size; i++) {
+		x = x * 1103515245 + 12345;
+		line = "record " + std::to_string(x % 1000003) + " value " + std::to_string(i) + "\n";
+		size_t k = std::min(line.size(), size - done);
+		memcpy(p + done, line.data(), k);
+		done += k;
+	}
+	b->Resolved(false);
+	return b;
+}
+
+double MBps(uint64_t bytes, uint64_t us)
+{
+	return us ? bytes / (double)us : 0.0;
+}
+
+// The fastest of runs, in microseconds
+template<typename Fn>
+uint64_t Best(int runs, Fn fn)
+{
+	uint64_t best = UINT64_MAX;
+	for(int i = 0; i < runs; i++) {
+		uint64_t start = lune::ClkUpdateRealtime();
+		if(!fn())
+			return 0;
+		best = std::min(best, lune::ClkUpdateRealtime() - start);
+	}
+	return best;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+	using namespace lune;
+	details::InitMainThread();
+
+	size_t size = 256 << 20;
+	int level = 3;
+	size_t frame = 1 << 20;
+	uint32_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+	int runs = 3;
+	const char *path = nullptr;
+	for(int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if(arg == "--size" && has_value)
+			size = (size_t)atoll(argv[++i]) << 20;
+		else if(arg == "--level" && has_value)
+			level = atoi(argv[++i]);
+		else if(arg == "--frame" && has_value)
+			frame = (size_t)atoll(argv[++i]) << 10;
+		else if(arg == "--threads" && has_value)
+			max_threads = (uint32_t)atoi(argv[++i]);
+		else if(arg == "--runs" && has_value)
+			runs = atoi(argv[++i]);
+		else if(arg.starts_with("--") || path)
+			return Usage();
+		else
+			path = argv[i];
+	}
+	if(!size || !frame || !max_threads || runs < 1)
+		return Usage();
+
+	BlobPtr input;
+	if(path) {
+		File f(VFSImpl::GetOsVfs()->OpenFile(path, file_flags::kReadOnly, OpenMode::OpenExisting));
+		if(!f) {
+			fprintf(stderr, "could not open %s\n", path);
+			return 1;
+		}
+		input = f.ReadToImmediateBlob();
+		if(input->errored() || !(size = input->GetSize())) {
+			fprintf(stderr, "could not read %s\n", path);
+			return 1;
+		}
+	} else {
+		input = Generate(size);
+	}
+
+	auto zstd = CompressionAlgorithm::Get(CompressionAlgorithmType::zstd);
+	printf("%.1f MiB, level %d, %zu KiB frames, %u cores\n", size / (1024.0 * 1024.0), level, frame >> 10,
+	    std::thread::hardware_concurrency());
+
+	// One frame from one context, for what splitting into frames costs in ratio and speed
+	auto cctx = zstd->CreateCompressor(nullptr, level);
+	BlobPtr single;
+	uint64_t single_us = Best(runs, [&]() {
+		single = cctx->Compress(input.get());
+		single->wait();
+		return !single->errored();
+	});
+	auto dctx = zstd->CreateDecompressor();
+	uint64_t single_dus = Best(runs, [&]() {
+		auto b = dctx->Decompress(single.get());
+		b->wait();
+		return !b->errored() && b->GetSize() == size;
+	});
+	printf("single frame: %zu bytes, compress %.0f MB/s, decompress %.0f MB/s\n", (size_t)single->GetSize(),
+	    MBps(size, single_us), MBps(size, single_dus));
+
+	printf("%8s %12s %10s %8s %14s %8s\n", "threads", "bytes", "comp MB/s", "speedup", "decomp MB/s", "speedup");
+	std::vector<uint8_t> out(size);
+	uint64_t base_us = 0, base_dus = 0;
+	for(uint32_t threads = 1;; threads = std::min(threads * 2, max_threads)) {
+		auto pool = CreateWorkerPool("BenchPool", threads);
+		BlobPtr seekable;
+		uint64_t us = Best(runs, [&]() {
+			seekable = zstd->CompressSeekable(input.get(), frame, level, pool.get());
+			seekable->wait();
+			return !seekable->errored();
+		});
+		auto reader = us ? zstd->OpenSeekable(seekable.get(), pool.get()) : nullptr;
+		// Read is called from this thread, which works alongside threads - 1 of the pool's
+		uint64_t dus = reader ? Best(runs, [&]() { return reader->Read(0, out.data(), size); }) : 0;
+		if(!dus || memcmp(out.data(), input->GetData(), size)) {
+			fprintf(stderr, "round trip failed with %u threads\n", threads);
+			return 1;
+		}
+		if(threads == 1) {
+			base_us = us;
+			base_dus = dus;
+		}
+		printf("%8u %12zu %10.0f %7.2fx %14.0f %7.2fx\n", threads, (size_t)seekable->GetSize(), MBps(size, us),
+		    (double)base_us / us, MBps(size, dus), (double)base_dus / dus);
+		if(threads == max_threads)
+			break;
+	}
+	return 0;
+}
+
+#ifdef _WIN32
+void lune::EarlyFatalError(const char *err)
+{
+	fprintf(stderr, "%s\n", err);
+	exit(1);
+}
+#endif
@@ -0,0 +1,593 @@
+#include "lune.h"
+#include "clock.h"
+#include "io/buffered_file.h"
+#include "io/direct_io.h"
+#include "io/file.h"
+#include "sys/sync.h"
+#include "sys/thread.h"
+
+#if IS_LINUX
+#include "io/uring_linux.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#elif IS_WIN
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Benchmarks for the file backends:
+//   iobench random [--size MiB] [--block KiB] [--threads n] [--depth n] [--seconds n] [file]
+//     Random reads from a file in the page cache. Each of --threads threads keeps --depth reads in
+//     flight and reissues them as they complete. Prints IOPS and completion latency. On Linux the
+//     io_uring backend and the preadv pool each run in a child process, as a process picks its backend
+//     when it opens its first file
+//   iobench stream [--size MiB] [--depth n] [file]
+//     Reads the file front to back with --depth 1MB reads in flight, once through the page cache and
+//     once with file_flags::kDirectIo. The file's cached pages are dropped before each pass. Prints
+//     throughput, the process's peak resident set and, on Linux, how much the page cache grew
+//   iobench records [--size MiB] [--window KiB] [file]
+//     Parses the file as small length-prefixed records, 4 to 64 bytes each, first with a File::Read per
+//     field and then through BufferedFile at several window sizes, or just --window. Prints MB/s and
+//     records/s for each. --size defaults to 16 here, as the File::Read pass is slow
+// Without a file, a scratch file of --size is written to the working directory and removed afterwards
+
+void lune::CustomLuaSetup(lua_State *L) {}
+
+namespace {
+using namespace lune;
+
+#if IS_LINUX
+using SubmitBatch = IoUring::Batch;
+#else
+struct SubmitBatch
+{
+};
+#endif
+
+struct Options
+{
+	// Defaults to 256 MiB, or 16 for records
+	uint64_t size = 0;
+	uint32_t block = 4096;
+	uint32_t threads = 4;
+	// Defaults to 16 for random and 4 for stream
+	uint32_t depth = 0;
+	uint32_t seconds = 5;
+	// 0 sweeps several sizes
+	uint32_t window = 0;
+};
+
+int Usage()
+{
+	fprintf(stderr, "usage: iobench random [--size MiB] [--block KiB] [--threads n] [--depth n] [--seconds n] [file]\n"
+	                "       iobench stream [--size MiB] [--depth n] [file]\n"
+	                "       iobench records [--size MiB] [--window KiB] [file]\n");
+	return 1;
+}
+
+const char *BackendName()
+{
+#if IS_LINUX
+	return IoUring::Get() ? "io_uring" : "preadv pool";
+#else
+	return "iocp";
+#endif
+}
+
+// Writes size bytes of noise with stdio, so the parent process never starts an I/O backend of its own
+bool WriteScratch(const char *path, uint64_t size)
+{
+	FILE *f = fopen(path, "wb");
+	if(!f)
+		return false;
+	std::vector<uint32_t> buf(1 << 18);
+	uint32_t x = 1;
+	bool ok = true;
+	for(uint64_t done = 0; ok && done < size;) {
+		for(auto &v : buf) v = x = x * 1103515245 + 12345;
+		size_t n = (size_t)std::min<uint64_t>(buf.size() * sizeof(uint32_t), size - done);
+		ok = fwrite(buf.data(), 1, n, f) == n;
+		done += n;
+	}
+	return fclose(f) == 0 && ok;
+}
+
+// Reads the whole file once, so the timed passes measure the backend rather than the disk
+bool Warm(File &f, uint64_t size)
+{
+	std::vector<uint8_t> buf(1 << 20);
+	for(uint64_t pos = 0; pos < size;) {
+		size_t n = f.ReadAbs(buf.data(), buf.size(), pos);
+		if(!n)
+			return false;
+		pos += n;
+	}
+	return true;
+}
+
+// One submitting thread's ops. Completions hand each op's slot back to the thread, which reissues it
+class RandomReader
+{
+public:
+	RandomReader(IoFile *f, const Options &opt, uint32_t seed)
+	    : file_(f), block_(opt.block), depth_(opt.depth), blocks_(opt.size / opt.block), x_(seed),
+	      mem_(new uint8_t[(size_t)opt.block * opt.depth]), started_(opt.depth)
+	{
+	}
+
+	void Run(uint64_t deadline)
+	{
+		{
+			SubmitBatch batch;
+			for(uint32_t slot = 0; slot < depth_; slot++) Issue(slot);
+		}
+		uint32_t outstanding = depth_;
+		std::vector<Done> got;
+		while(outstanding) {
+			{
+				std::unique_lock<CriticalSection> l(lock_);
+				while(done_.empty()) cv_.wait(l);
+				got.swap(done_);
+			}
+			bool more = ClkUpdateRealtime() < deadline;
+			SubmitBatch batch;
+			for(auto &d : got) {
+				if(d.err)
+					errors++;
+				else
+					latency.push_back(d.us);
+				if(more)
+					Issue(d.slot);
+				else
+					outstanding--;
+			}
+			got.clear();
+		}
+	}
+
+	std::vector<uint32_t> latency;
+	uint64_t errors = 0;
+
+private:
+	struct Done
+	{
+		uint32_t slot;
+		uint32_t us;
+		bool err;
+	};
+
+	void Issue(uint32_t slot)
+	{
+		x_ = x_ * 6364136223846793005ull + 1442695040888963407ull;
+		auto op = AsyncOp::OpInto(mem_.get() + (size_t)slot * block_, block_);
+		op->offset = ((x_ >> 16) % blocks_) * block_;
+		op->SetCompletion(&OnDone, this);
+		op->completion_context2 = (void *)(uintptr_t)slot;
+		started_[slot] = ClkUpdateRealtime();
+		file_->BeginRead(op);
+	}
+
+	static void OnDone(void *ctx, AsyncOp *op)
+	{
+		auto self = (RandomReader *)ctx;
+		auto slot = (uint32_t)(uintptr_t)op->completion_context2;
+		Done d{slot, (uint32_t)(ClkUpdateRealtime() - self->started_[slot]), op->err || op->transferred != self->block_};
+		op->Release();
+		{
+			std::unique_lock<CriticalSection> l(self->lock_);
+			self->done_.push_back(d);
+		}
+		self->cv_.notify_one();
+	}
+
+	IoFile *file_;
+	uint32_t block_;
+	uint32_t depth_;
+	uint64_t blocks_;
+	uint64_t x_;
+	std::unique_ptr<uint8_t[]> mem_;
+	std::vector<uint64_t> started_;
+
+	CriticalSection lock_;
+	CondVar cv_;
+	std::vector<Done> done_;
+};
+
+uint32_t Percentile(const std::vector<uint32_t> &sorted, double p)
+{
+	return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+}
+
+bool RunRandom(const Options &opt, const char *path)
+{
+	File f(VFSImpl::GetOsVfs()->OpenFile(path, file_flags::kReadOnly | file_flags::kRandomAccess, OpenMode::OpenExisting));
+	if(!f || !Warm(f, opt.size)) {
+		fprintf(stderr, "could not read %s\n", path);
+		return false;
+	}
+
+	std::vector<std::unique_ptr<RandomReader>> readers;
+	std::vector<std::shared_ptr<OsThread>> threads;
+	uint64_t start = ClkUpdateRealtime();
+	uint64_t deadline = start + opt.seconds * 1000000ull;
+	for(uint32_t t = 0; t < opt.threads; t++) {
+		readers.emplace_back(new RandomReader(f.file(), opt, t * 2654435761u + 1));
+		threads.push_back(OsThread::CreateRawThread(
+		    std::bind(&RandomReader::Run, readers.back().get(), deadline), "IoBench", ThreadType::POOL));
+	}
+	for(auto &t : threads) t->Join();
+	uint64_t us = ClkUpdateRealtime() - start;
+
+	std::vector<uint32_t> latency;
+	uint64_t errors = 0;
+	for(auto &r : readers) {
+		latency.insert(latency.end(), r->latency.begin(), r->latency.end());
+		errors += r->errors;
+	}
+	std::sort(latency.begin(), latency.end());
+	printf("%-12s %10.0f %9.0f %7u %7u %7u %7u\n", BackendName(), latency.size() * 1e6 / us,
+	    latency.size() * (double)opt.block / us, Percentile(latency, 0.5), Percentile(latency, 0.99),
+	    Percentile(latency, 0.999), latency.empty() ? 0 : latency.back());
+	if(errors) {
+		fprintf(stderr, "%llu reads failed\n", (unsigned long long)errors);
+		return false;
+	}
+	return true;
+}
+
+bool RandomAll(const Options &opt, const char *path)
+{
+	printf("%.1f MiB, %u byte reads, %u threads x %u deep, %u s, hot page cache\n", opt.size / (1024.0 * 1024.0),
+	    opt.block, opt.threads, opt.depth, opt.seconds);
+	printf("%-12s %10s %9s %7s %7s %7s %7s\n", "backend", "IOPS", "MB/s", "p50 us", "p99 us", "p999 us", "max us");
+	bool ok = true;
+#if IS_LINUX
+	for(bool uring : {true, false}) {
+		fflush(stdout);
+		pid_t pid = fork();
+		if(pid == 0) {
+			if(uring)
+				setenv("LUNE_IO_URING", "1", 1);
+			else
+				unsetenv("LUNE_IO_URING");
+			bool child_ok = RunRandom(opt, path);
+			fflush(stdout);
+			_exit(child_ok ? 0 : 1);
+		}
+		int status = 0;
+		ok = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status) && ok;
+	}
+#else
+	ok = RunRandom(opt, path);
+#endif
+	return ok;
+}
+
+// Bytes of this process currently resident
+uint64_t ResidentBytes()
+{
+#if IS_LINUX
+	FILE *f = fopen("/proc/self/statm", "r");
+	unsigned long long pages = 0, resident = 0;
+	if(f) {
+		if(fscanf(f, "%llu %llu", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+#elif IS_WIN
+	PROCESS_MEMORY_COUNTERS pmc;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.WorkingSetSize : 0;
+#else
+	return 0;
+#endif
+}
+
+// Bytes in the system page cache, or 0 where that isn't known
+uint64_t PageCacheBytes()
+{
+#if IS_LINUX
+	FILE *f = fopen("/proc/meminfo", "r");
+	if(!f)
+		return 0;
+	char line[256];
+	unsigned long long kb = 0;
+	while(fgets(line, sizeof(line), f) && sscanf(line, "Cached: %llu kB", &kb) != 1)
+		;
+	fclose(f);
+	return kb << 10;
+#else
+	return 0;
+#endif
+}
+
+// Evicts the file from the page cache, so the cached pass reads from the disk too
+void DropCachedPages(const char *path)
+{
+#if IS_LINUX
+	int fd = open(path, O_RDONLY);
+	if(fd >= 0) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#endif
+}
+
+// Streams a file through pool buffers with a fixed number of reads in flight
+class StreamReader
+{
+public:
+	StreamReader(IoFile *f, uint64_t size, uint32_t depth) : file_(f), size_(size), depth_(depth) {}
+
+	bool Run()
+	{
+		uint32_t outstanding = 0;
+		while(outstanding < depth_ && next_ < size_) {
+			Issue();
+			outstanding++;
+		}
+		bool ok = true;
+		std::vector<bool> got;
+		while(outstanding) {
+			{
+				std::unique_lock<CriticalSection> l(lock_);
+				while(done_.empty()) cv_.wait(l);
+				got.swap(done_);
+			}
+			peak_rss = std::max(peak_rss, ResidentBytes());
+			for(bool d : got) {
+				ok = ok && d;
+				if(ok && next_ < size_)
+					Issue();
+				else
+					outstanding--;
+			}
+			got.clear();
+		}
+		return ok;
+	}
+
+	uint64_t peak_rss = 0;
+
+private:
+	void Issue()
+	{
+		auto op = AsyncOp::AllocForMaxWrite(AlignedBufferPool::Get()->Alloc());
+		op->offset = next_;
+		op->SetCompletion(&OnDone, this);
+		next_ += op->sg[0].len;
+		file_->BeginRead(op);
+	}
+
+	static void OnDone(void *ctx, AsyncOp *op)
+	{
+		auto self = (StreamReader *)ctx;
+		// The last read may come back short, or at EOF if the size is a multiple of the block
+		bool ok = !op->err || (op->err == io_err::kEOF && op->offset >= self->size_);
+		ok = ok && (op->transferred == op->sg[0].len || op->offset + op->transferred >= self->size_);
+		op->Release();
+		{
+			std::unique_lock<CriticalSection> l(self->lock_);
+			self->done_.push_back(ok);
+		}
+		self->cv_.notify_one();
+	}
+
+	IoFile *file_;
+	uint64_t size_;
+	uint32_t depth_;
+	uint64_t next_ = 0;
+
+	CriticalSection lock_;
+	CondVar cv_;
+	std::vector<bool> done_;
+};
+
+bool RunStream(const Options &opt, const char *path, bool direct)
+{
+	DropCachedPages(path);
+	uint32_t flags = file_flags::kReadOnly | file_flags::kSequential | (direct ? file_flags::kDirectIo : 0);
+	File f(VFSImpl::GetOsVfs()->OpenFile(path, flags, OpenMode::OpenExisting));
+	if(!f) {
+		fprintf(stderr, "could not open %s\n", path);
+		return false;
+	}
+	uint64_t cached = PageCacheBytes();
+	uint64_t start = ClkUpdateRealtime();
+	StreamReader reader(f.file(), opt.size, opt.depth);
+	bool ok = reader.Run();
+	uint64_t us = ClkUpdateRealtime() - start;
+	if(!ok) {
+		fprintf(stderr, "%s read of %s failed\n", direct ? "direct" : "cached", path);
+		return false;
+	}
+	uint64_t grown = PageCacheBytes();
+	grown = grown > cached ? grown - cached : 0;
+	printf("%-8s %10.0f %10.1f %14.1f\n", direct ? "direct" : "cached", us ? opt.size / (double)us : 0.0,
+	    reader.peak_rss / (1024.0 * 1024.0), grown / (1024.0 * 1024.0));
+	return true;
+}
+
+bool StreamAll(const Options &opt, const char *path)
+{
+	printf("%.1f MiB, %u x %u KiB reads in flight\n", opt.size / (1024.0 * 1024.0), opt.depth,
+	    AlignedBufferPool::Get()->block_size() >> 10);
+	printf("%-8s %10s %10s %14s\n", "mode", "MB/s", "peak RSS MiB", "page cache MiB");
+	return RunStream(opt, path, false) && RunStream(opt, path, true);
+}
+// Parses records of a 4 byte header and a payload of header % 61 bytes, so any file parses, until limit
+// bytes have been consumed. Returns false if the reader came up short
+template<typename Reader>
+bool ParseRecords(Reader &r, uint64_t limit, uint64_t *records, uint64_t *checksum)
+{
+	uint8_t payload[64];
+	uint64_t sum = 0;
+	uint64_t n_records = 0;
+	for(uint64_t pos = 0; pos + 4 <= limit;) {
+		uint32_t header;
+		if(r.Read(&header, 4) != 4)
+			return false;
+		auto n = (uint32_t)std::min<uint64_t>(header % 61, limit - pos - 4);
+		if(n && r.Read(payload, n) != n)
+			return false;
+		sum = sum * 31 + header;
+		for(uint32_t i = 0; i < n; i++) sum = sum * 31 + payload[i];
+		pos += 4 + n;
+		n_records++;
+	}
+	*records = n_records;
+	*checksum = sum;
+	return true;
+}
+
+bool RecordsAll(const Options &opt, const char *path)
+{
+	auto open = [&]() {
+		return VFSImpl::GetOsVfs()->OpenFile(
+		    path, file_flags::kReadOnly | file_flags::kSequential, OpenMode::OpenExisting);
+	};
+	{
+		File f(open());
+		if(!f || !Warm(f, opt.size)) {
+			fprintf(stderr, "could not read %s\n", path);
+			return false;
+		}
+	}
+	printf("%.1f MiB of 4-64 byte records, hot page cache\n", opt.size / (1024.0 * 1024.0));
+	printf("%-20s %10s %12s %8s\n", "reader", "MB/s", "records/s", "speedup");
+
+	uint64_t base_records = 0, base_sum = 0, base_us = 0;
+	auto report = [&](const char *name, uint64_t us, uint64_t records, uint64_t sum) {
+		if(!base_us) {
+			base_us = std::max<uint64_t>(us, 1);
+			base_records = records;
+			base_sum = sum;
+		} else if(records != base_records || sum != base_sum) {
+			fprintf(stderr, "%s parsed different records\n", name);
+			return false;
+		}
+		us = std::max<uint64_t>(us, 1);
+		printf("%-20s %10.1f %12.0f %7.2fx\n", name, opt.size / (double)us, records * 1e6 / us, (double)base_us / us);
+		return true;
+	};
+
+	uint64_t records = 0, sum = 0;
+	{
+		File f(open());
+		uint64_t start = ClkUpdateRealtime();
+		if(!ParseRecords(f, opt.size, &records, &sum)) {
+			fprintf(stderr, "File::Read came up short\n");
+			return false;
+		}
+		if(!report("File::Read", ClkUpdateRealtime() - start, records, sum))
+			return false;
+	}
+
+	std::vector<uint32_t> windows = {4 << 10, 16 << 10, BufferedFile::kDefaultWindowSize, 256 << 10};
+	if(opt.window)
+		windows = {opt.window};
+	for(uint32_t window : windows) {
+		BufferedFile f(open(), window);
+		uint64_t start = ClkUpdateRealtime();
+		if(!ParseRecords(f, opt.size, &records, &sum)) {
+			fprintf(stderr, "BufferedFile came up short with a %u KiB window\n", window >> 10);
+			return false;
+		}
+		std::string name = "BufferedFile " + std::to_string(window >> 10) + "K";
+		if(!report(name.c_str(), ClkUpdateRealtime() - start, records, sum))
+			return false;
+	}
+	return true;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+	details::InitMainThread();
+
+	if(argc < 2)
+		return Usage();
+	std::string_view mode = argv[1];
+	Options opt;
+	const char *path = nullptr;
+	for(int i = 2; i < argc; i++) {
+		std::string_view arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if(arg == "--size" && has_value)
+			opt.size = (uint64_t)atoll(argv[++i]) << 20;
+		else if(arg == "--block" && has_value)
+			opt.block = (uint32_t)atoi(argv[++i]) << 10;
+		else if(arg == "--threads" && has_value)
+			opt.threads = (uint32_t)atoi(argv[++i]);
+		else if(arg == "--depth" && has_value)
+			opt.depth = (uint32_t)atoi(argv[++i]);
+		else if(arg == "--seconds" && has_value)
+			opt.seconds = (uint32_t)atoi(argv[++i]);
+		else if(arg == "--window" && has_value)
+			opt.window = (uint32_t)atoi(argv[++i]) << 10;
+		else if(arg.starts_with("--") || path)
+			return Usage();
+		else
+			path = argv[i];
+	}
+	if(!opt.depth)
+		opt.depth = mode == "stream" ? 4 : 16;
+	if(!opt.size)
+		opt.size = (uint64_t)(mode == "records" ? 16 : 256) << 20;
+	if((mode != "random" && mode != "stream" && mode != "records") || !opt.block || !opt.threads || !opt.seconds)
+		return Usage();
+
+	const char *scratch = nullptr;
+	if(!path) {
+		path = scratch = "iobench.dat";
+		if(!WriteScratch(scratch, opt.size)) {
+			fprintf(stderr, "could not write %s\n", scratch);
+			return 1;
+		}
+	} else {
+		FILE *f = fopen(path, "rb");
+		if(!f) {
+			fprintf(stderr, "could not open %s\n", path);
+			return 1;
+		}
+		fseek(f, 0, SEEK_END);
+		auto file_size = (uint64_t)ftell(f);
+		fclose(f);
+		// Records parses at most --size of the file, the others all of it
+		opt.size = mode == "records" ? std::min(opt.size, file_size) : file_size;
+	}
+	if(opt.size < opt.block)
+		return Usage();
+
+	bool ok;
+	if(mode == "random")
+		ok = RandomAll(opt, path);
+	else if(mode == "stream")
+		ok = StreamAll(opt, path);
+	else
+		ok = RecordsAll(opt, path);
+	if(scratch)
+		remove(scratch);
+	return ok ? 0 : 1;
+}
+
+#ifdef _WIN32
+void lune::EarlyFatalError(const char *err)
+{
+	fprintf(stderr, "%s\n", err);
+	exit(1);
+}
+#endif
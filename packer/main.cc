@@ -0,0 +1,109 @@
+#include "lune.h"
+#include "io/pack_writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Builds a pack from a data directory:
+//   packer [--trace file] [--level n] [--align n] [--min-saving f] [--no-dict] <data dir> <output pack>
+// The trace lists paths relative to the data directory, one per line, in the order the game reads them
+
+void lune::CustomLuaSetup(lua_State *L) {}
+
+namespace {
+int Usage()
+{
+	fprintf(stderr,
+	    "usage: packer [--trace file] [--level n] [--align n] [--min-saving f] [--no-dict] <data dir> "
+	    "<output pack>\n");
+	return 1;
+}
+
+double Mib(uint64_t n)
+{
+	return n / (1024.0 * 1024.0);
+}
+
+double Ratio(uint64_t stored, uint64_t size)
+{
+	return size ? (double)stored / size : 1.0;
+}
+
+void PrintReport(const lune::PackWriter::Report &r)
+{
+	printf("%u files (%u duplicates), %u directories\n", r.files, r.duplicates, r.dirs);
+	printf("%u compressed, %u with the dictionary (%llu bytes)\n", r.compressed, r.dictionary,
+	    (unsigned long long)r.dict_size);
+	printf("%-10s %8s %12s %12s %7s\n", "type", "files", "MiB", "stored MiB", "ratio");
+	for(auto &t : r.types) {
+		printf("%-10s %8u %12.2f %12.2f %7.3f\n", t.ext.empty() ? "(none)" : t.ext.c_str(), t.files, Mib(t.size),
+		    Mib(t.stored_size), Ratio(t.stored_size, t.size));
+	}
+	printf("%-10s %8u %12.2f %12.2f %7.3f\n", "total", r.files, Mib(r.size), Mib(r.stored_size),
+	    Ratio(r.stored_size, r.size));
+	printf("pack size %.2f MiB\n", Mib(r.pack_size));
+	printf("estimated load time %.3fs loose, %.3fs packed (%.1f%% saved)\n", r.loose_seconds, r.pack_seconds,
+	    r.loose_seconds > 0 ? 100.0 * (1 - r.pack_seconds / r.loose_seconds) : 0.0);
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+	using namespace lune;
+	details::InitMainThread();
+
+	PackWriter::Options options;
+	const char *trace = nullptr;
+	std::vector<const char *> paths;
+	for(int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if(arg == "--trace" && has_value)
+			trace = argv[++i];
+		else if(arg == "--level" && has_value)
+			options.level = atoi(argv[++i]);
+		else if(arg == "--align" && has_value)
+			options.alignment = (uint32_t)atoi(argv[++i]);
+		else if(arg == "--min-saving" && has_value)
+			options.min_saving = atof(argv[++i]);
+		else if(arg == "--no-dict")
+			options.dict_max_file = 0;
+		else if(arg.starts_with("--"))
+			return Usage();
+		else
+			paths.push_back(argv[i]);
+	}
+	if(paths.size() != 2 || !options.alignment || (options.alignment & (options.alignment - 1)))
+		return Usage();
+
+	PackWriter writer(options);
+	if(!writer.AddTree(VFSImpl::GetOsVfs(), paths[0])) {
+		fprintf(stderr, "could not read all of %s\n", paths[0]);
+		return 1;
+	}
+	if(trace) {
+		File f = sys_vfs.OpenFile(trace, file_flags::kReadOnly);
+		if(!f) {
+			fprintf(stderr, "could not open %s\n", trace);
+			return 1;
+		}
+		writer.SetAccessOrder(f.ReadToImmediateBlob()->AsString());
+	}
+
+	auto out = VFSImpl::GetOsVfs()->OpenFile(paths[1], 0, OpenMode::CreateOrTruncate);
+	PackWriter::Report report;
+	if(!out || !writer.Write(std::move(out), &report)) {
+		fprintf(stderr, "could not write %s\n", paths[1]);
+		return 1;
+	}
+	PrintReport(report);
+	return 0;
+}
+
+#ifdef _WIN32
+void lune::EarlyFatalError(const char *err)
+{
+	fprintf(stderr, "%s\n", err);
+	exit(1);
+}
+#endif
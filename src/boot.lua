@@ -26,6 +26,8 @@ const struct LuneEventList* lune_popEvents();
 void lune_pushEvent(uint32_t id, double a0, double a1, double a2, double a3, double a4, double a5);
 
 void lune_sysUpdate(double dt);
+int lune_takeChangedFiles();
+const char *lune_changedFile(int i);
 ]]
 
 io = nil
@@ -70,8 +72,8 @@ local confFn = globalGetConfig or globalLuneLoadFile(config_file)
 parseOpts(args)
 lune.options = getConfig(confFn, lune.options)
 
--- This preps everything (or throws an error)
-globalLuneInit(lune.options)
+-- This preps everything (or throws an error), and hands back what dispatches Lua callbacks
+local run_callback = globalLuneInit(lune.options)
 globalLuneInit = nil
 
 
@@ -111,14 +113,28 @@ local function lune_main()
 	local nullfn = function() end
 
 	-- If something needs to access or modify the Lua context, normally that is impossible, so
-	-- queueing callback 0 lets C do whatever it wants
-	cb_lookup[0] = globalLuaToCEv
+	-- queueing callback 0 lets C do whatever it wants. Callbacks registered from Lua run first
+	cb_lookup[0] = function(id, ...)
+		if not (run_callback and run_callback(id, ...)) then globalLuaToCEv(id, ...) end
+	end
 	cb_lookup[1] = function(dt) C.lune_sysUpdate(dt) end
 	cb_lookup[2] = function() C.lune_endFrame() end
 	cb_lookup[3] = function() C.lune_newFrame() end
 	for k,v in pairs(globalLuneEventMap) do
 		cb_lookup[v] = fns[k] or nullfn
 	end
+	-- Modules loaded from changed files are reloaded by the next require, and the game gets the paths to
+	-- reload anything else it made from them
+	local files_changed = cb_lookup[globalLuneEventMap.FilesChanged]
+	cb_lookup[globalLuneEventMap.FilesChanged] = function()
+		local paths = {}
+		for i=0,C.lune_takeChangedFiles() - 1 do
+			paths[i + 1] = ffi.string(C.lune_changedFile(i))
+		end
+		if #paths == 0 then return end
+		unloadChangedModules(paths)
+		files_changed(paths)
+	end
 	lune_exec(cb_lookup)
 end
 
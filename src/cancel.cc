@@ -0,0 +1,84 @@
+#include "cancel.h"
+#include "logging.h"
+
+namespace lune {
+
+void CancellationToken::Cancel()
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	if(cancelled_.exchange(true, std::memory_order_acq_rel))
+		return;
+	for(auto &e : hooks_) e.second();
+	hooks_.clear();
+}
+
+uint64_t CancellationToken::OnCancel(std::function<void()> fn)
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	if(cancelled_.load(std::memory_order_relaxed)) {
+		fn();
+		return 0;
+	}
+	uint64_t id = next_id_++;
+	hooks_.emplace_back(id, std::move(fn));
+	return id;
+}
+
+void CancellationToken::Unregister(uint64_t id)
+{
+	if(!id)
+		return;
+	std::unique_lock<CriticalSection> l(lock_);
+	for(auto it = hooks_.begin(); it != hooks_.end(); ++it) {
+		if(it->first == id) {
+			*it = std::move(hooks_.back());
+			hooks_.pop_back();
+			return;
+		}
+	}
+}
+
+namespace cancel_stats {
+namespace {
+std::atomic<uint64_t> avoided;
+std::atomic<uint64_t> aborted;
+std::atomic<uint64_t> wasted;
+std::atomic<uint64_t> wasted_bytes;
+
+void Emit()
+{
+	static const char *const series[4] = {"avoided", "aborted", "wasted", "wasted_bytes"};
+	int64_t values[4] = {(int64_t)avoided.load(std::memory_order_relaxed),
+	    (int64_t)aborted.load(std::memory_order_relaxed), (int64_t)wasted.load(std::memory_order_relaxed),
+	    (int64_t)wasted_bytes.load(std::memory_order_relaxed)};
+	TRACE_COUNTER("cancel", "Cancellation", 0, 4, series, values);
+}
+} // namespace
+
+void Avoided()
+{
+	avoided.fetch_add(1, std::memory_order_relaxed);
+	Emit();
+}
+
+void Aborted()
+{
+	aborted.fetch_add(1, std::memory_order_relaxed);
+	Emit();
+}
+
+void Wasted(uint64_t bytes)
+{
+	wasted.fetch_add(1, std::memory_order_relaxed);
+	wasted_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	Emit();
+}
+
+Snapshot Get()
+{
+	return Snapshot{avoided.load(std::memory_order_relaxed), aborted.load(std::memory_order_relaxed),
+	    wasted.load(std::memory_order_relaxed), wasted_bytes.load(std::memory_order_relaxed)};
+}
+} // namespace cancel_stats
+
+} // namespace lune
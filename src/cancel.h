@@ -0,0 +1,112 @@
+#pragma once
+
+#include "future.h"
+#include "refptr.h"
+#include "sys/sync.h"
+#include "sys/thread.h"
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+namespace lune {
+
+// A cancellation token is handed to an asynchronous API by whoever requested the work. Cancelling it
+// asks that the work be abandoned: work that has not started yet is dropped, in-flight I/O is aborted
+// where the backend can do so, and the result resolves as an error/null.
+// Cancellation is advisory - work that is too far along simply completes and is counted as wasted.
+class CancellationToken : public Refcounted
+{
+public:
+	CancellationToken() = default;
+
+	bool IsCancelled() const
+	{
+		return cancelled_.load(std::memory_order_acquire);
+	}
+
+	void Cancel();
+
+	// Registers a hook to run when the token is cancelled, or immediately if it already has been.
+	// Hooks are run with the token's lock held, so they must be short, must not touch this token and
+	// must not synchronously complete the work they are cancelling - they should only request an abort.
+	// Returns an id for Unregister, or 0 if the hook ran immediately.
+	uint64_t OnCancel(std::function<void()> fn);
+	// After this returns the hook is guaranteed not to be running and will never run
+	void Unregister(uint64_t id);
+
+private:
+	std::atomic<bool> cancelled_ = false;
+	CriticalSection lock_;
+	uint64_t next_id_ = 1;
+	std::vector<std::pair<uint64_t, std::function<void()>>> hooks_;
+};
+typedef RefPtr<CancellationToken> CancellationTokenPtr;
+
+// Process-wide accounting of what cancellation saved and what it did not
+namespace cancel_stats {
+// Work that was dropped before it started
+void Avoided();
+// Work that was aborted part way through
+void Aborted();
+// Work that ran to completion after it was cancelled and was thrown away
+void Wasted(uint64_t bytes = 0);
+
+struct Snapshot
+{
+	uint64_t avoided;
+	uint64_t aborted;
+	uint64_t wasted;
+	uint64_t wasted_bytes;
+};
+Snapshot Get();
+} // namespace cancel_stats
+
+namespace details {
+template<typename T>
+struct CancelRace : public Refcounted
+{
+	std::atomic<bool> settled = false;
+	Promise<T> *promise;
+	CancellationTokenPtr token;
+	uint64_t hook = 0;
+};
+} // namespace details
+
+// Returns a future that resolves as the input does, or resolves null as soon as the token is
+// cancelled, whichever comes first. A value that arrives after cancellation is discarded and counted
+// as wasted work. The null is resolved from the user pool rather than the cancel hook, so continuations
+// never run under the token's lock and may use the token themselves.
+template<typename F, typename T = typename F::value_type>
+requires std::is_same_v<F, Future<T>>
+Future<T> WithCancellation(F future, CancellationToken *token)
+{
+	if(!token)
+		return future;
+	auto p = Promise<T>::Make();
+	auto ret = p->MakeFuture();
+	RefPtr<details::CancelRace<T>> race = new details::CancelRace<T>();
+	race->promise = p;
+	race->token = token;
+	auto id = token->OnCancel([race]() {
+		if(!race->settled.exchange(true, std::memory_order_acq_rel))
+			GetPoolUser()->PostTask([race]() { race->promise->ResolveNull(); });
+	});
+	race->hook = id;
+	future.Then([race](T &v, bool ok) {
+		if(race->hook)
+			race->token->Unregister(race->hook);
+		if(race->settled.exchange(true, std::memory_order_acq_rel)) {
+			if(ok)
+				cancel_stats::Wasted();
+			return;
+		}
+		if(ok)
+			race->promise->Resolve(std::move(v));
+		else
+			race->promise->ResolveNull();
+	});
+	return ret;
+}
+
+} // namespace lune
@@ -51,4 +51,6 @@
 #if IS_WIN
 // Decls without no_tls_guard try dynamic initialization
 #define TLS_DECL(t) [[msvc::no_tls_guard]] thread_local t
+#else
+#define TLS_DECL(t) thread_local t
 #endif
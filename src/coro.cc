@@ -0,0 +1,71 @@
+#include "coro.h"
+#include "io/file.h"
+#include "sys/slab.h"
+
+namespace lune {
+namespace details {
+namespace {
+// Frame size classes. Larger frames go to the global heap
+constexpr size_t kFrameClasses[] = {128, 256, 512, 1024, 2048};
+constexpr int kNumFrameClasses = sizeof(kFrameClasses) / sizeof(kFrameClasses[0]);
+
+int FrameClass(size_t size)
+{
+	for(int i = 0; i < kNumFrameClasses; i++) {
+		if(size <= kFrameClasses[i])
+			return i;
+	}
+	return -1;
+}
+
+SlabPool *FramePool(int cls)
+{
+	static SlabPool pools[kNumFrameClasses] = {{"CoroFrame128", kFrameClasses[0]},
+	    {"CoroFrame256", kFrameClasses[1]}, {"CoroFrame512", kFrameClasses[2]}, {"CoroFrame1024", kFrameClasses[3]},
+	    {"CoroFrame2048", kFrameClasses[4]}};
+	return &pools[cls];
+}
+} // namespace
+
+void *CoroFrameAlloc(size_t size)
+{
+	int cls = FrameClass(size);
+	if(cls < 0)
+		return ::operator new(size);
+	return FramePool(cls)->Alloc();
+}
+
+void CoroFrameFree(void *p, size_t size)
+{
+	int cls = FrameClass(size);
+	if(cls < 0)
+		return ::operator delete(p);
+	FramePool(cls)->Free(p);
+}
+
+bool AsyncOpAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+	handle_ = h;
+	op_->SetCompletion(&OnComplete, this, runner_);
+	// With a runner the completion is always posted, so it can never run before we return
+	bool posted = runner_ != nullptr;
+	if(write_)
+		file_->BeginWrite(op_);
+	else
+		file_->BeginRead(op_);
+	if(posted)
+		return true;
+	return !flag_.Arrive();
+}
+
+void AsyncOpAwaiter::OnComplete(void *ctx, AsyncOp *)
+{
+	auto self = static_cast<AsyncOpAwaiter *>(ctx);
+	if(!self->runner_) {
+		if(!self->flag_.Arrive())
+			return;
+	}
+	self->handle_.resume();
+}
+} // namespace details
+} // namespace lune
@@ -0,0 +1,253 @@
+#pragma once
+
+#include "future.h"
+#include "io/aio.h"
+#include "refptr.h"
+#include "sys/thread.h"
+
+#include <atomic>
+#include <coroutine>
+#include <optional>
+#include <type_traits>
+
+// C++20 coroutine support.
+// AsyncTask<T> is a coroutine return type which is itself a Future<T>, so it can be Then'd, Taken or
+// co_awaited like any other future. Inside a coroutine the following can be awaited:
+// - Future<T>: co_await std::move(f) yields std::optional<T>, empty if the future resolved null
+// - Promisable objects (Blob, Shader): co_await blob yields the RefPtr; check errored()
+// - AsyncOps: co_await AwaitRead(file, op) yields the completed op, which the caller releases
+// By default the coroutine resumes on whichever thread completed the awaited thing. Wrap with
+// Await(x, runner) to resume on a specific TaskRunner instead.
+// Coroutine frames are allocated from pooled size classes, so a short chain of awaits costs fewer
+// heap allocations than the equivalent chain of Then callbacks.
+
+namespace lune {
+
+class IoFile;
+
+namespace details {
+void *CoroFrameAlloc(size_t size);
+void CoroFrameFree(void *p, size_t size);
+
+// Resolves the race between an awaited thing completing synchronously inside await_suspend and
+// completing on another thread. Whichever side arrives second is responsible for continuing.
+struct ResumeFlag
+{
+	std::atomic<bool> arrived = false;
+
+	bool Arrive()
+	{
+		return arrived.exchange(true, std::memory_order_acq_rel);
+	}
+};
+
+template<typename T>
+class FutureAwaiter
+{
+public:
+	FutureAwaiter(Future<T> &&f, TaskRunner *runner) : future_(std::move(f)), runner_(runner) {}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		handle_ = h;
+		// Resolution may resume the coroutine and destroy this awaiter before Then returns, so the
+		// future must not live in the frame while Then is running
+		Future<T> f = std::move(future_);
+		if(runner_) {
+			f.Then(runner_, [this](T &v, bool ok) {
+				if(ok)
+					value_.emplace(std::move(v));
+				handle_.resume();
+			});
+			return true;
+		}
+		f.Then([this](T &v, bool ok) {
+			if(ok)
+				value_.emplace(std::move(v));
+			if(flag_.Arrive())
+				handle_.resume();
+		});
+		return !flag_.Arrive();
+	}
+
+	std::optional<T> await_resume()
+	{
+		return std::move(value_);
+	}
+
+private:
+	Future<T> future_;
+	TaskRunner *runner_;
+	std::coroutine_handle<> handle_;
+	std::optional<T> value_;
+	ResumeFlag flag_;
+};
+
+template<typename T>
+class PromisableAwaiter
+{
+public:
+	PromisableAwaiter(RefPtr<T> obj, TaskRunner *runner) : obj_(std::move(obj)), runner_(runner) {}
+
+	bool await_ready() const noexcept
+	{
+		return !runner_ && obj_->resolved();
+	}
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		handle_ = h;
+		if(runner_) {
+			obj_->Then(runner_, [this](RefPtr<T>, bool) { handle_.resume(); });
+			return true;
+		}
+		// A synchronous callback runs with the object's lock held, so never resume from inside it
+		RefPtr<T> obj = obj_;
+		obj->Then([this](RefPtr<T>, bool) {
+			if(flag_.Arrive())
+				handle_.resume();
+		});
+		return !flag_.Arrive();
+	}
+
+	RefPtr<T> await_resume()
+	{
+		return std::move(obj_);
+	}
+
+private:
+	RefPtr<T> obj_;
+	TaskRunner *runner_;
+	std::coroutine_handle<> handle_;
+	ResumeFlag flag_;
+};
+
+class AsyncOpAwaiter
+{
+public:
+	AsyncOpAwaiter(IoFile *file, AsyncOp *op, bool write, TaskRunner *runner)
+	    : file_(file), op_(op), write_(write), runner_(runner)
+	{
+	}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> h);
+
+	AsyncOp *await_resume() const noexcept
+	{
+		return op_;
+	}
+
+private:
+	static void OnComplete(void *ctx, AsyncOp *op);
+
+	IoFile *file_;
+	AsyncOp *op_;
+	bool write_;
+	TaskRunner *runner_;
+	std::coroutine_handle<> handle_;
+	ResumeFlag flag_;
+};
+} // namespace details
+
+// The coroutine return type. It is a Future<T>: the coroutine's co_return value resolves it, and an
+// exception escaping the coroutine resolves it null. Coroutines start eagerly, on the calling thread.
+template<typename T>
+class AsyncTask : public Future<T>
+{
+public:
+	explicit AsyncTask(Future<T> &&f) : Future<T>(std::move(f)) {}
+
+	class promise_type
+	{
+	public:
+		promise_type() : promise_(Promise<T>::Make()) {}
+
+		AsyncTask get_return_object()
+		{
+			return AsyncTask(promise_->MakeFuture());
+		}
+
+		std::suspend_never initial_suspend() noexcept
+		{
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+
+		template<typename U>
+		void return_value(U &&v)
+		{
+			promise_->Resolve(std::forward<U>(v));
+		}
+
+		void unhandled_exception()
+		{
+			promise_->ResolveNull();
+		}
+
+		static void *operator new(size_t sz)
+		{
+			return details::CoroFrameAlloc(sz);
+		}
+		static void operator delete(void *p, size_t sz)
+		{
+			details::CoroFrameFree(p, sz);
+		}
+
+	private:
+		Promise<T> *promise_;
+	};
+};
+
+// Resume on a specific task runner once the awaited thing completes
+template<typename F, typename T = typename F::value_type>
+requires std::is_base_of_v<Future<T>, F>
+details::FutureAwaiter<T> Await(F &&f, TaskRunner *runner = nullptr)
+{
+	return details::FutureAwaiter<T>(std::move(f), runner);
+}
+
+template<typename T>
+requires std::is_base_of_v<Promisable<RefPtr<T>>, T>
+details::PromisableAwaiter<T> Await(RefPtr<T> obj, TaskRunner *runner = nullptr)
+{
+	return details::PromisableAwaiter<T>(std::move(obj), runner);
+}
+
+// Issue an op on a file and resume when it completes. The op's completion is overwritten
+inline details::AsyncOpAwaiter AwaitRead(IoFile *file, AsyncOp *op, TaskRunner *runner = nullptr)
+{
+	return details::AsyncOpAwaiter(file, op, false, runner);
+}
+inline details::AsyncOpAwaiter AwaitWrite(IoFile *file, AsyncOp *op, TaskRunner *runner = nullptr)
+{
+	return details::AsyncOpAwaiter(file, op, true, runner);
+}
+
+template<typename F, typename T = typename F::value_type>
+requires std::is_base_of_v<Future<T>, F>
+details::FutureAwaiter<T> operator co_await(F &&f)
+{
+	return details::FutureAwaiter<T>(std::move(f), nullptr);
+}
+
+template<typename T>
+requires std::is_base_of_v<Promisable<RefPtr<T>>, T>
+details::PromisableAwaiter<T> operator co_await(RefPtr<T> obj)
+{
+	return details::PromisableAwaiter<T>(std::move(obj), nullptr);
+}
+
+} // namespace lune
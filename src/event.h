@@ -29,6 +29,8 @@ enum class LuneToLuaEv : uint32_t
 	UserUpdate,
 	LateUserUpdate,
 	EndFrame,
+	// Files under a watched directory changed; lune_takeChangedFiles has the paths
+	FilesChanged,
 };
 
 struct LuaEvent
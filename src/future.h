@@ -3,8 +3,11 @@
 #include <atomic>
 #include <functional>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "logging.h"
+#include "sys/slab.h"
 #include "sys/sync.h"
 #include "sys/thread.h"
 #include "refptr.h"
@@ -44,6 +47,8 @@ class Promise
 	    "Promise type must be fundamental or move-assignable");
 
 public:
+	LUNE_SLAB_ALLOCATED(Promise)
+
 	void ResolveNull()
 	{
 		lock_.lock();
@@ -69,6 +74,8 @@ public:
 	class Ref
 	{
 	public:
+		typedef T value_type;
+
 		Ref() : p(nullptr) {}
 		explicit Ref(Promise *p) : p(p) {}
 		~Ref() { LUNE_ASSERT_MSG(!p, "Future destroyed without being used! Call ThenNothing()"); }
@@ -115,12 +122,39 @@ public:
 			p->then_ = std::move(fn);
 			p->runner_ = runner;
 			if(p->resolved_) {
-				runner_->PostTask(&Run, this);
+				runner->PostTask(&Run, p);
 			}
 			p->lock_.unlock();
 			p = nullptr;
 		}
 
+		// Value-transforming Then. Callable is invoked as R(T&) and its result resolves the returned
+		// future. A null value skips the callable and resolves the returned future as null.
+		template<typename Callable>
+		requires(!std::is_invocable_v<Callable, T &, bool> && std::is_invocable_v<Callable, T &>)
+		auto Then(Callable &&fn)
+		{
+			using R = std::invoke_result_t<Callable, T &>;
+			static_assert(!std::is_void_v<R>, "Transforming Then must return a value");
+			auto next = Promise<R>::Make();
+			auto ret = next->MakeFuture();
+			Then([next, fn = std::forward<Callable>(fn)](T &v, bool ok) mutable { Forward(next, fn, v, ok); });
+			return ret;
+		}
+
+		// As above, but the callable runs on a specific task runner
+		template<typename Callable>
+		requires(!std::is_invocable_v<Callable, T &, bool> && std::is_invocable_v<Callable, T &>)
+		auto Then(TaskRunner *runner, Callable &&fn)
+		{
+			using R = std::invoke_result_t<Callable, T &>;
+			static_assert(!std::is_void_v<R>, "Transforming Then must return a value");
+			auto next = Promise<R>::Make();
+			auto ret = next->MakeFuture();
+			Then(runner, [next, fn = std::forward<Callable>(fn)](T &v, bool ok) mutable { Forward(next, fn, v, ok); });
+			return ret;
+		}
+
 		// Synchronously acquire the value, as with std::future.
 		// Be careful, as this will always deadlock if this thread is expected to *produce*
 		// the eventual value. It is always better to Then() to a task runner than to
@@ -143,7 +177,8 @@ public:
 				return false;
 			}
 			*out = std::move(p->value_);
-			assert(*out);
+			if constexpr(std::is_constructible_v<bool, T>)
+				assert(*out);
 			delete p;
 			p = nullptr;
 			return true;
@@ -158,6 +193,15 @@ public:
 		}
 
 	private:
+		template<typename R, typename Callable>
+		static void Forward(Promise<R> *next, Callable &fn, T &v, bool ok)
+		{
+			if(ok)
+				next->Resolve(fn(v));
+			else
+				next->ResolveNull();
+		}
+
 		Promise *p;
 	};
 
@@ -385,4 +429,123 @@ inline Promise<T> *MakePromise()
 template<typename T>
 using Future = typename Promise<T>::Ref;
 
+namespace details {
+// Shared state for the combinators below. Each input gets one continuation which touches only its
+// own slot and then decrements a single atomic counter; whichever continuation arrives last
+// resolves the output promise and frees the state. No lock is taken beyond the one inside each
+// input's own resolution, and the output is resolved (and any waiter woken) exactly once.
+template<typename V>
+struct JoinState
+{
+	JoinState(uint32_t n, Promise<std::vector<V>> *p) : remaining(n), values(n), promise(p) {}
+
+	void Arrive(uint32_t i, V v, bool ok)
+	{
+		if(ok)
+			values[i] = std::move(v);
+		else
+			failed.store(true, std::memory_order_relaxed);
+		if(remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+		if(failed.load(std::memory_order_relaxed))
+			promise->ResolveNull();
+		else
+			promise->Resolve(std::move(values));
+		delete this;
+	}
+
+	std::atomic<uint32_t> remaining;
+	std::atomic<bool> failed = false;
+	std::vector<V> values;
+	Promise<std::vector<V>> *promise;
+};
+
+template<typename V>
+struct AnyState
+{
+	AnyState(uint32_t n, Promise<std::pair<size_t, V>> *p) : remaining(n), promise(p) {}
+
+	void Arrive(size_t i, V v, bool ok)
+	{
+		if(ok && !won.exchange(true, std::memory_order_acq_rel))
+			promise->Resolve(std::make_pair(i, std::move(v)));
+		if(remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+		if(!won.load(std::memory_order_acquire))
+			promise->ResolveNull();
+		delete this;
+	}
+
+	std::atomic<uint32_t> remaining;
+	std::atomic<bool> won = false;
+	Promise<std::pair<size_t, V>> *promise;
+};
+} // namespace details
+
+// Resolves with every value, in input order, once all inputs have resolved. If any input resolves
+// null the result is null - but only after all inputs have resolved, so nothing is left dangling.
+template<typename F, typename T = typename F::value_type>
+requires std::is_same_v<F, Future<T>>
+Future<std::vector<T>> WhenAll(std::vector<F> futures)
+{
+	if(futures.empty())
+		return Promise<std::vector<T>>::MakeResolved(std::vector<T>())->MakeFuture();
+	auto p = Promise<std::vector<T>>::Make();
+	auto ret = p->MakeFuture();
+	auto state = new details::JoinState<T>((uint32_t)futures.size(), p);
+	for(uint32_t i = 0; i < (uint32_t)futures.size(); i++)
+		futures[i].Then([state, i](T &v, bool ok) { state->Arrive(i, std::move(v), ok); });
+	return ret;
+}
+
+// Join over Promisable objects, eg Blobs or Shaders. Resolves with the objects themselves once all
+// have resolved, or null if any of them errored.
+template<typename T>
+requires std::is_base_of_v<Promisable<RefPtr<T>>, T>
+Future<std::vector<RefPtr<T>>> WhenAll(const std::vector<RefPtr<T>> &objs)
+{
+	if(objs.empty())
+		return Promise<std::vector<RefPtr<T>>>::MakeResolved(std::vector<RefPtr<T>>())->MakeFuture();
+	auto p = Promise<std::vector<RefPtr<T>>>::Make();
+	auto ret = p->MakeFuture();
+	auto state = new details::JoinState<RefPtr<T>>((uint32_t)objs.size(), p);
+	for(uint32_t i = 0; i < (uint32_t)objs.size(); i++)
+		objs[i]->Then([state, i](RefPtr<T> o, bool ok) { state->Arrive(i, std::move(o), ok); });
+	return ret;
+}
+
+// Resolves with the index and value of the first input to resolve with a value. Resolves null only
+// if every input resolves null. Later values are discarded.
+template<typename F, typename T = typename F::value_type>
+requires std::is_same_v<F, Future<T>>
+Future<std::pair<size_t, T>> WhenAny(std::vector<F> futures)
+{
+	auto p = Promise<std::pair<size_t, T>>::Make();
+	auto ret = p->MakeFuture();
+	if(futures.empty()) {
+		p->ResolveNull();
+		return ret;
+	}
+	auto state = new details::AnyState<T>((uint32_t)futures.size(), p);
+	for(size_t i = 0; i < futures.size(); i++)
+		futures[i].Then([state, i](T &v, bool ok) { state->Arrive(i, std::move(v), ok); });
+	return ret;
+}
+
+template<typename T>
+requires std::is_base_of_v<Promisable<RefPtr<T>>, T>
+Future<std::pair<size_t, RefPtr<T>>> WhenAny(const std::vector<RefPtr<T>> &objs)
+{
+	auto p = Promise<std::pair<size_t, RefPtr<T>>>::Make();
+	auto ret = p->MakeFuture();
+	if(objs.empty()) {
+		p->ResolveNull();
+		return ret;
+	}
+	auto state = new details::AnyState<RefPtr<T>>((uint32_t)objs.size(), p);
+	for(size_t i = 0; i < objs.size(); i++)
+		objs[i]->Then([state, i](RefPtr<T> o, bool ok) { state->Arrive(i, std::move(o), ok); });
+	return ret;
+}
+
 } // namespace lune
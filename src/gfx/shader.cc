@@ -56,7 +56,7 @@ ShaderSource::ShaderSource(Device *dev, ShaderType type, BlobPtr source, const c
 {
 }
 
-RefPtr<ShaderSPIRV> ShaderSource::GetSPIRV(CompilerPipeline *pipeline, const CompileOptions *ctx)
+RefPtr<ShaderSPIRV> ShaderSource::GetSPIRV(CompilerPipeline *pipeline, const CompileOptions *ctx, CancellationToken *cancel)
 {
 	if(!spirv_) {
 		auto b = new DynamicBlob();
@@ -66,8 +66,9 @@ RefPtr<ShaderSPIRV> ShaderSource::GetSPIRV(CompilerPipeline *pipeline, const Com
 		text_->AddRef();
 		ctx->AddRef();
 
-		text_->Then([type = type_, dst = b, src = text_.get(), pipeline, ctx, file = std::move(filename_)](Blob*, bool) {
-			pipeline->AsyncCompile(type, src, dst, ctx, std::move(file));
+		text_->Then([type = type_, dst = b, src = text_.get(), pipeline, ctx, file = std::move(filename_),
+		                cancel = CancellationTokenPtr(cancel)](Blob *, bool) {
+			pipeline->AsyncCompile(type, src, dst, ctx, std::move(file), cancel);
 			src->Release();
 			dst->Release();
 			ctx->Release();
@@ -76,9 +77,9 @@ RefPtr<ShaderSPIRV> ShaderSource::GetSPIRV(CompilerPipeline *pipeline, const Com
 	return spirv_;
 }
 
-ShaderPtr ShaderSource::Compile(CompilerPipeline *pipeline, const CompileOptions *ctx)
+ShaderPtr ShaderSource::Compile(CompilerPipeline *pipeline, const CompileOptions *ctx, CancellationToken *cancel)
 {
-	return GetSPIRV(pipeline, ctx)->GetShader();
+	return GetSPIRV(pipeline, ctx, cancel)->GetShader();
 }
 
 
@@ -163,15 +164,26 @@ RefPtr<CompileOptions> CompileOptions::Copy() const
 CompilerPipeline::CompilerPipeline(TaskRunner *runner) : compile_runner_(runner) {}
 CompilerPipeline::~CompilerPipeline() = default;
 
-void CompilerPipeline::AsyncCompile(
-    ShaderType type, Blob *src, DynamicBlob *dest, const CompileOptions *ctx, std::string filename)
+void CompilerPipeline::AsyncCompile(ShaderType type, Blob *src, DynamicBlob *dest, const CompileOptions *ctx,
+    std::string filename, CancellationToken *cancel)
 {
-	compile_runner_->PostTask(std::bind(&CompilerPipeline::CompileOnThread, this, type, src, dest, ctx, std::move(filename)));
+	if(cancel && cancel->IsCancelled()) {
+		cancel_stats::Avoided();
+		dest->Set("Cancelled", true);
+		return;
+	}
+	compile_runner_->PostTask(std::bind(&CompilerPipeline::CompileOnThread, this, type, src, dest, ctx,
+	    std::move(filename), CancellationTokenPtr(cancel)));
 }
 
-void CompilerPipeline::CompileOnThread(
-    ShaderType type, Blob *src, DynamicBlob *dest, const CompileOptions *ctx, const std::string& filename)
+void CompilerPipeline::CompileOnThread(ShaderType type, Blob *src, DynamicBlob *dest, const CompileOptions *ctx,
+    const std::string &filename, const CancellationTokenPtr &cancel)
 {
+	if(cancel && cancel->IsCancelled()) {
+		cancel_stats::Avoided();
+		dest->Set("Cancelled", true);
+		return;
+	}
 #if LUNE_SHADER_COMPILER
 	auto s = cache_->Get();
 
@@ -233,6 +245,8 @@ void CompilerPipeline::CompileOnThread(
 	} else if(shaderc_result_get_compilation_status(result) != shaderc_compilation_status_success) {
 		dest->Set(shaderc_result_get_error_message(result), true);
 	} else {
+		if(cancel && cancel->IsCancelled())
+			cancel_stats::Wasted(shaderc_result_get_length(result));
 		dest->Copy(shaderc_result_get_bytes(result), shaderc_result_get_length(result));
 	}
 	if(result)
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "cancel.h"
 #include "io/file.h"
 #include "types.h"
 #include "sys/thread.h"
@@ -81,8 +82,10 @@ class ShaderSource
 public:
 	ShaderSource(Device *dev, ShaderType type, BlobPtr source, const char *filename);
 
-	RefPtr<ShaderSPIRV> GetSPIRV(CompilerPipeline *pipeline, const CompileOptions *ctx);
-	ShaderPtr Compile(CompilerPipeline *pipeline, const CompileOptions *ctx);
+	// If cancel is cancelled before compilation starts the compile is skipped and the result errors
+	RefPtr<ShaderSPIRV> GetSPIRV(
+	    CompilerPipeline *pipeline, const CompileOptions *ctx, CancellationToken *cancel = nullptr);
+	ShaderPtr Compile(CompilerPipeline *pipeline, const CompileOptions *ctx, CancellationToken *cancel = nullptr);
 
 private:
 	Device *dev_;
@@ -100,11 +103,14 @@ public:
 	CompilerPipeline(TaskRunner *runner);
 	~CompilerPipeline();
 
-	void AsyncCompile(ShaderType type, Blob *src, DynamicBlob *dest, const CompileOptions *ctx, std::string filename);
+	// Queued compiles whose token is cancelled before they reach the compile thread are dropped and
+	// dest resolves as errored
+	void AsyncCompile(ShaderType type, Blob *src, DynamicBlob *dest, const CompileOptions *ctx, std::string filename,
+	    CancellationToken *cancel = nullptr);
 
 private:
-	void CompileOnThread(
-	    ShaderType type, Blob *src, DynamicBlob *dest, const CompileOptions *ctx, const std::string& filename);
+	void CompileOnThread(ShaderType type, Blob *src, DynamicBlob *dest, const CompileOptions *ctx,
+	    const std::string &filename, const CancellationTokenPtr &cancel);
 
 	TaskRunner *compile_runner_ = nullptr;
 	std::unique_ptr<CompilerCache> cache_;
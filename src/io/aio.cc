@@ -1,12 +1,19 @@
 #include "aio.h"
 
+#include "chain.h"
+#include "stats.h"
+
+#include <algorithm>
 #include <memory>
+#include <vector>
 
 namespace lune {
 namespace {
 class OwnedStringIoBuffer : public IoBuffer
 {
 public:
+	LUNE_SLAB_ALLOCATED(OwnedStringIoBuffer)
+
 	OwnedStringIoBuffer(std::string *s) : IoBuffer(s->data(), 0, (uint32_t)s->size(), (uint32_t)s->size()), str_(s) {}
 
 private:
@@ -16,6 +23,8 @@ private:
 class OwnedMallocBuffer : public IoBuffer
 {
 public:
+	LUNE_SLAB_ALLOCATED(OwnedMallocBuffer)
+
 	OwnedMallocBuffer(void *buf, uint32_t rd, uint32_t wr, uint32_t size) : IoBuffer(buf, rd, wr, size) {}
 	~OwnedMallocBuffer() { free(ptr); }
 
@@ -28,6 +37,8 @@ private:
 class BlobBuffer : public IoBuffer
 {
 public:
+	LUNE_SLAB_ALLOCATED(BlobBuffer)
+
 	BlobBuffer(Blob *b, uint32_t rd, uint32_t wr) : IoBuffer(b->GetData(), rd, wr, (uint32_t)b->GetSize()), blob(b) {}
 
 private:
@@ -35,6 +46,15 @@ private:
 };
 } // namespace
 
+namespace details {
+struct SgStorage
+{
+	std::vector<SGBuf> sg;
+	std::vector<RefPtr<IoBuffer>> buffers;
+	IoChain chain;
+};
+} // namespace details
+
 IoBuffer *IoBuffer::AllocEmptyForFill(size_t max_size)
 {
 	return new OwnedMallocBuffer(malloc(max_size), 0, 0, (uint32_t)max_size);
@@ -58,6 +78,10 @@ IoBuffer *IoBuffer::WrapEmptyBlob(Blob *b)
 {
 	return new BlobBuffer(b, 0, 0);
 }
+IoBuffer *IoBuffer::WrapBlob(Blob *b)
+{
+	return new BlobBuffer(b, 0, (uint32_t)b->GetSize());
+}
 
 AsyncOp *AsyncOp::Alloc()
 {
@@ -68,15 +92,71 @@ AsyncOp *AsyncOp::Alloc()
 	op->runner = nullptr;
 	op->completion = nullptr;
 	op->unref = nullptr;
+	op->sg_storage = nullptr;
+	op->priority = io_priority::kFrameCritical;
+	op->deadline = 0;
+	op->stats = nullptr;
+	op->issue_time = 0;
 	TRACE_ASYNC_START("io.verbose", "AsyncOp", op);
 	return op;
 }
 void AsyncOp::Release()
 {
 	TRACE_ASYNC_END("io.verbose", "AsyncOp", this);
+	delete sg_storage;
 	delete this;
 }
 
+void AsyncOp::CopyToSg(uint64_t pos, const void *src, uint64_t n)
+{
+	auto p = (const uint8_t *)src;
+	for(int i = 0; i < nsg && n; i++) {
+		uint64_t len = sg[i].len;
+		if(pos >= len) {
+			pos -= len;
+			continue;
+		}
+		uint64_t k = std::min(len - pos, n);
+		memcpy((uint8_t *)sg[i].buf + pos, p, k);
+		p += k;
+		n -= k;
+		pos = 0;
+	}
+}
+
+bool AsyncOp::CompleteIfCancelled()
+{
+	if(!cancel || !cancel->IsCancelled())
+		return false;
+	cancel_stats::Avoided();
+	cancel = nullptr;
+	CompleteErr(io_err::kCancelled);
+	return true;
+}
+
+void AsyncOp::SetCancelHook(std::function<void()> fn)
+{
+	if(cancel)
+		cancel_hook = cancel->OnCancel(std::move(fn));
+}
+
+void AsyncOp::OnCancellableComplete()
+{
+	cancel->Unregister(cancel_hook);
+	cancel_hook = 0;
+	if(err == io_err::kCancelled)
+		cancel_stats::Aborted();
+	else if(cancel->IsCancelled())
+		cancel_stats::Wasted(transferred);
+	cancel = nullptr;
+}
+
+void AsyncOp::RecordStats()
+{
+	IoStats::OnComplete(this);
+	stats = nullptr;
+}
+
 AsyncOp *AsyncOp::AllocForMaxRead(IoBuffer *buffer)
 {
 	auto op = Alloc();
@@ -113,6 +193,57 @@ AsyncOp *AsyncOp::AllocForMaxWrite(IoBuffer *buffer)
 	return op;
 }
 
+namespace {
+AsyncOp *AllocForBuffers(IoBuffer *const *buffers, int n, bool (IoBuffer::*area)(void **, uint32_t, BufLen *))
+{
+	if(n == 1)
+		return area == &IoBuffer::AllocRead ? AsyncOp::AllocForMaxRead(buffers[0]) : AsyncOp::AllocForMaxWrite(buffers[0]);
+	auto op = AsyncOp::Alloc();
+	auto st = new details::SgStorage();
+	st->sg.reserve(n);
+	st->buffers.reserve(n);
+	for(int i = 0; i < n; i++) {
+		st->buffers.emplace_back(buffers[i]);
+		SGBuf sg;
+		if((buffers[i]->*area)(&sg.buf, 0xFFFFFFFF, &sg.len) && sg.len)
+			st->sg.push_back(sg);
+	}
+	op->sg_storage = st;
+	if(st->sg.empty()) {
+		op->Release();
+		return nullptr;
+	}
+	op->sg = st->sg.data();
+	op->nsg = (int)st->sg.size();
+	return op;
+}
+} // namespace
+
+AsyncOp *AsyncOp::AllocForMaxReadV(IoBuffer *const *buffers, int n)
+{
+	return AllocForBuffers(buffers, n, &IoBuffer::AllocRead);
+}
+
+AsyncOp *AsyncOp::AllocForMaxWriteV(IoBuffer *const *buffers, int n)
+{
+	return AllocForBuffers(buffers, n, &IoBuffer::AllocWrite);
+}
+
+AsyncOp *AsyncOp::AllocForChain(const IoChain &chain)
+{
+	LUNE_ASSERT(chain.size() <= IoChain::kMaxOpBytes);
+	if(chain.empty())
+		return nullptr;
+	auto op = Alloc();
+	auto st = new details::SgStorage();
+	st->chain = chain;
+	chain.ToSG(&st->sg);
+	op->sg_storage = st;
+	op->sg = st->sg.data();
+	op->nsg = (int)st->sg.size();
+	return op;
+}
+
 AsyncOp *AsyncOp::AllocForSyncIo(OneShotEvent *event)
 {
 	auto op = Alloc();
@@ -2,6 +2,8 @@
 
 #include "config.h"
 #include "blob.h"
+#include "cancel.h"
+#include "sys/slab.h"
 #include "sys/thread.h"
 #include "sys/sync.h"
 #include "refptr.h"
@@ -15,6 +17,8 @@ typedef unsigned long BufLen;
 class IoBuffer : public Refcounted
 {
 public:
+	LUNE_SLAB_ALLOCATED(IoBuffer)
+
 	virtual ~IoBuffer() = default;
 
 	bool AllocRead(void **data, uint32_t req, BufLen *bytes)
@@ -65,6 +69,8 @@ public:
 	static IoBuffer *WrapOwnedMallocForEmpty(void *buf, uint32_t offset, uint32_t size);
 	static IoBuffer *WrapUnownedMemory(void *buf, uint32_t rd, uint32_t wr, uint32_t size);
 	static IoBuffer *WrapEmptyBlob(Blob *b);
+	// The whole blob is valid data, for writing it out
+	static IoBuffer *WrapBlob(Blob *b);
 
 protected:
 	IoBuffer(void *ptr, uint32_t rd, uint32_t wr, uint32_t end) : ptr(static_cast<uint8_t*>(ptr)), rd(rd), wr(wr), end(end) {}
@@ -77,6 +83,25 @@ static constexpr uint64_t kAppendOffset = UINT64_MAX;
 
 namespace io_err {
 static constexpr int32_t kEOF = 1;
+static constexpr int32_t kCancelled = 2;
+// The op does not meet the alignment rules of a direct I/O file
+static constexpr int32_t kUnaligned = 3;
+// The op covers more bytes than transferred can report
+static constexpr int32_t kTooLarge = 4;
+// A write moved fewer bytes than it was given, without the OS reporting why
+static constexpr int32_t kShortWrite = 5;
+// Any other error is the OS's own code, negated so it can't be mistaken for one of the above
+inline constexpr int32_t FromOs(uint32_t err) { return -(int32_t)err; }
+}
+
+// Scheduling classes for IoScheduler, most urgent first
+namespace io_priority {
+// Needed to finish the current frame
+static constexpr uint8_t kFrameCritical = 0;
+// Speculative loads of data that will probably be needed soon
+static constexpr uint8_t kPrefetch = 1;
+static constexpr uint8_t kBackground = 2;
+static constexpr uint8_t kCount = 3;
 }
 
 struct SGBuf
@@ -85,9 +110,20 @@ struct SGBuf
 	// Must match the definition of WSABUF
 	BufLen len;
 	void *buf;
+#else
+	// Must match the definition of iovec
+	void *buf;
+	BufLen len;
 #endif
 };
 
+class IoChain;
+class IoStats;
+
+namespace details {
+struct SgStorage;
+}
+
 struct AsyncOp
 {
 	// OS-specific data
@@ -101,12 +137,30 @@ struct AsyncOp
 	// Used to hold a ref to any other needed resources.
 	Refcounted *unref;
 
+	// Optional. If cancelled, backends skip the op if not yet issued or abort it if they can
+	RefPtr<CancellationToken> cancel;
+	uint64_t cancel_hook;
+
 	// The actual buffer pointer, logical I/O offset (eg file start byte) & byte count
 	SGBuf *sg;
 	int nsg;
 	uint64_t offset;
 
 	SGBuf default_sg[2];
+	// Owns sg and the buffers behind it for ops built over several IoBuffers
+	details::SgStorage *sg_storage;
+
+	// Scheduling hints, honoured by IoScheduler. deadline is a ClkGetRealtime() timestamp by which the
+	// op should complete, or 0 for none
+	uint8_t priority;
+	uint64_t deadline;
+
+	// Set while an IoStats tracks the op. Times are ClkGetRealtime() values; issue_time is filled in by
+	// IoScheduler as the op leaves its queue and stays 0 for ops that never queued
+	IoStats *stats;
+	bool stats_write;
+	uint64_t submit_time;
+	uint64_t issue_time;
 
 	// Filled in by the I/O layer as the ultimate result of the operation
 	int32_t err;
@@ -145,6 +199,10 @@ struct AsyncOp
 	}
 	void Complete()
 	{
+		if(stats)
+			RecordStats();
+		if(cancel)
+			OnCancellableComplete();
 		if(!completion)
 			return Release();
 		if(runner)
@@ -159,24 +217,46 @@ struct AsyncOp
 			unref->Release();
 	}
 
+	// Backends call this before issuing the op. If the op's token is already cancelled the op is
+	// completed with io_err::kCancelled, true is returned and the op must not be issued.
+	bool CompleteIfCancelled();
+	// Backends that can abort in-flight I/O register how to do so before issuing. The hook is
+	// unregistered when the op completes.
+	void SetCancelHook(std::function<void()> fn);
+
 	static AsyncOp *Alloc();
 	void Release();
 
 	static AsyncOp *AllocForMaxRead(IoBuffer *buffer);
 	static AsyncOp *AllocForMaxWrite(IoBuffer *buffer);
+	// One op spanning several buffers, eg. a header and a payload written with a single system call.
+	// Every buffer is kept alive until the op is released. Empty buffers are skipped
+	static AsyncOp *AllocForMaxReadV(IoBuffer *const *buffers, int n);
+	static AsyncOp *AllocForMaxWriteV(IoBuffer *const *buffers, int n);
+	// One op over the bytes of a chain, to write them out or to read into the segments. The op shares the
+	// segments until it is released. Chains beyond IoChain::kMaxOpBytes must be issued in pieces
+	static AsyncOp *AllocForChain(const IoChain &chain);
 
 	static AsyncOp *OpInto(const void *buf, size_t len);
 
 	static AsyncOp *AllocForSyncIo(OneShotEvent *event);
 
+	// Copies n bytes into the segments, starting at byte pos of the request
+	void CopyToSg(uint64_t pos, const void *src, uint64_t n);
+
 	void SetCompleteOneshot(OneShotEvent *event);
 
 	AsyncOp(const AsyncOp &) = delete;
 	void operator=(const AsyncOp &) = delete;
 
+	LUNE_SLAB_ALLOCATED(AsyncOp)
+
 private:
 	AsyncOp() = default;
 	~AsyncOp() = default;
+
+	void OnCancellableComplete();
+	void RecordStats();
 };
 static_assert(std::is_standard_layout<AsyncOp>::value, "AsyncOp must be standard-layout");
 
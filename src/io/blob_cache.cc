@@ -0,0 +1,140 @@
+#include "blob_cache.h"
+
+#include <mutex>
+
+namespace lune {
+
+BlobCache blob_cache(64 << 20);
+
+class BlobCache::CachedBlob : public OwnedMemoryBlob
+{
+public:
+	using OwnedMemoryBlob::OwnedMemoryBlob;
+
+	// The cache holds one reference, so any more mean someone is using the blob. Reads in flight hold
+	// one too
+	bool pinned() const { return refs_.load(std::memory_order_acquire) > 1; }
+};
+
+BlobCache::BlobCache(uint64_t budget) : budget_(budget) {}
+
+BlobCache::~BlobCache() = default;
+
+RefPtr<Blob> BlobCache::Read(VFSImpl *vfs, const Path &path)
+{
+	StatBuf st;
+	if(!vfs->Stat(path, &st) || !(st.flags & file_flags::kIsFile))
+		return nullptr;
+	Key key{vfs, std::string(path)};
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		// Blobs unpinned since the last read may now be evictable
+		Trim();
+		if(auto b = Find(key, st))
+			return b;
+		misses_++;
+	}
+
+	auto f = vfs->OpenFile(path, file_flags::kReadOnly | file_flags::kSequential, OpenMode::OpenExisting);
+	if(!f)
+		return nullptr;
+	RefPtr<CachedBlob> b = new CachedBlob((size_t)f->GetFileSize());
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		// Someone else may have started the same read while the file was being opened
+		if(auto other = Find(key, st))
+			return other;
+		lru_.push_front(Entry{key, st.size, st.mtime, b});
+		map_.emplace(std::move(key), lru_.begin());
+		bytes_ += b->GetSize();
+		Trim();
+	}
+	File(std::move(f)).ReadIntoBlob(b.get());
+	return b;
+}
+
+RefPtr<Blob> BlobCache::Find(const Key &key, const StatBuf &st)
+{
+	auto it = map_.find(key);
+	if(it == map_.end())
+		return nullptr;
+	Entry &e = *it->second;
+	// A read that failed is retried rather than handing out the error again
+	bool failed = e.blob->resolved() && e.blob->errored();
+	if(e.size != st.size || e.mtime != st.mtime || failed) {
+		stale_ += !failed;
+		Erase(it->second);
+		return nullptr;
+	}
+	lru_.splice(lru_.begin(), lru_, it->second);
+	hits_++;
+	joined_ += !e.blob->resolved();
+	return e.blob;
+}
+
+void BlobCache::Erase(Lru::iterator it)
+{
+	bytes_ -= it->blob->GetSize();
+	map_.erase(it->key);
+	lru_.erase(it);
+}
+
+void BlobCache::Trim()
+{
+	for(auto it = lru_.end(); bytes_ > budget_ && it != lru_.begin();) {
+		--it;
+		if(it->blob->pinned())
+			continue;
+		evictions_++;
+		Erase(it++);
+	}
+}
+
+void BlobCache::Invalidate(VFSImpl *vfs, const Path &path)
+{
+	Path p = path;
+	while(p.size() > 1 && p.back() == '/') p.remove_suffix(1);
+	auto beneath = [p](std::string_view k) {
+		return k.starts_with(p) && (k.size() == p.size() || p.empty() || k[p.size()] == '/' || p.back() == '/');
+	};
+	std::unique_lock<CriticalSection> l(lock_);
+	for(auto it = lru_.begin(); it != lru_.end();) {
+		if(it->key.vfs == vfs && beneath(it->key.path))
+			Erase(it++);
+		else
+			++it;
+	}
+}
+
+void BlobCache::Clear()
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	map_.clear();
+	lru_.clear();
+	bytes_ = 0;
+}
+
+void BlobCache::SetBudget(uint64_t budget)
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	budget_ = budget;
+	Trim();
+}
+
+void BlobCache::Get(Counters *out) const
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	out->hits = hits_;
+	out->joined = joined_;
+	out->misses = misses_;
+	out->stale = stale_;
+	out->evictions = evictions_;
+	out->entries = map_.size();
+	out->bytes = bytes_;
+	out->pinned_bytes = 0;
+	for(auto &e : lru_)
+		if(e.blob->pinned())
+			out->pinned_bytes += e.blob->GetSize();
+}
+
+} // namespace lune
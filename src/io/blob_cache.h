@@ -0,0 +1,100 @@
+#pragma once
+
+#include "file.h"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace lune {
+
+// Shares whole-file reads: asking for a file that is already read, or being read, returns the same blob
+// rather than reading it again. Files are told apart by VFS and path, and an entry is only reused while
+// the file's size and mtime are unchanged.
+// Blobs are kept up to a byte budget and evicted least recently used first. A blob anything outside the
+// cache still references is pinned and not evicted, though it counts towards the budget
+class BlobCache
+{
+public:
+	struct Counters
+	{
+		uint64_t hits;
+		// Hits on a read still in progress
+		uint64_t joined;
+		uint64_t misses;
+		// Entries dropped because the file changed
+		uint64_t stale;
+		uint64_t evictions;
+		uint64_t entries;
+		uint64_t bytes;
+		uint64_t pinned_bytes;
+	};
+
+	explicit BlobCache(uint64_t budget);
+	~BlobCache();
+
+	BlobCache(const BlobCache &) = delete;
+	void operator=(const BlobCache &) = delete;
+
+	// Returns a future blob with the contents of path, or null if it can't be opened. Don't write to the
+	// blob, as others may share it
+	RefPtr<Blob> Read(VFSImpl *vfs, const Path &path);
+
+	// Forgets path and everything beneath it in vfs. Blobs already handed out are unaffected
+	void Invalidate(VFSImpl *vfs, const Path &path);
+	void Clear();
+
+	// Evicts down to the new budget at once
+	void SetBudget(uint64_t budget);
+
+	void Get(Counters *out) const;
+
+private:
+	class CachedBlob;
+	struct Key
+	{
+		VFSImpl *vfs;
+		std::string path;
+
+		bool operator==(const Key &o) const { return vfs == o.vfs && path == o.path; }
+	};
+	struct KeyHash
+	{
+		size_t operator()(const Key &k) const
+		{
+			return std::hash<std::string>()(k.path) ^ (std::hash<VFSImpl *>()(k.vfs) * 31);
+		}
+	};
+	struct Entry
+	{
+		Key key;
+		uint64_t size;
+		uint64_t mtime;
+		RefPtr<CachedBlob> blob;
+	};
+	using Lru = std::list<Entry>;
+
+	// Callers hold lock_. Returns the cached blob if it is current, dropping it if not
+	RefPtr<Blob> Find(const Key &key, const StatBuf &st);
+	// Callers hold lock_
+	void Erase(Lru::iterator it);
+	void Trim();
+
+	mutable CriticalSection lock_;
+	// Most recently used first
+	Lru lru_;
+	std::unordered_map<Key, Lru::iterator, KeyHash> map_;
+	uint64_t budget_;
+	uint64_t bytes_ = 0;
+
+	uint64_t hits_ = 0;
+	uint64_t joined_ = 0;
+	uint64_t misses_ = 0;
+	uint64_t stale_ = 0;
+	uint64_t evictions_ = 0;
+};
+
+// Shared by everything that loads assets
+extern BlobCache blob_cache;
+
+} // namespace lune
@@ -0,0 +1,175 @@
+#include "buffered_file.h"
+
+#include <algorithm>
+
+namespace lune {
+
+BufferedFile::BufferedFile(IoFilePtr f, uint32_t window_size)
+    : file_(std::move(f)), window_size_(std::max(window_size, 1u))
+{
+}
+
+BufferedFile::~BufferedFile()
+{
+	if(file_)
+		Flush();
+	DropWindows();
+}
+
+void BufferedFile::SetWindowSize(uint32_t n)
+{
+	window_size_ = std::max(n, 1u);
+}
+
+void BufferedFile::Seek(uint64_t position)
+{
+	Flush();
+	position_ = position;
+	eof_ = false;
+}
+
+void BufferedFile::StartFill(Window &w, uint64_t offset, bool prefetch)
+{
+	if(w.op)
+		WaitFill(w);
+	if(w.capacity != window_size_) {
+		w.data = std::make_unique<uint8_t[]>(window_size_);
+		w.capacity = window_size_;
+	}
+	w.offset = offset;
+	w.requested = w.capacity;
+	w.size = 0;
+	w.eof = false;
+	w.done = std::make_unique<OneShotEvent>();
+	w.op = AsyncOp::AllocForSyncIo(w.done.get());
+	w.op->sg = w.op->default_sg;
+	w.op->nsg = 1;
+	w.op->default_sg[0].buf = w.data.get();
+	w.op->default_sg[0].len = (BufLen)w.requested;
+	w.op->offset = offset;
+	if(prefetch)
+		w.op->priority = io_priority::kPrefetch;
+	file_.file()->BeginRead(w.op);
+}
+
+void BufferedFile::WaitFill(Window &w)
+{
+	w.done->wait();
+	w.size = w.op->transferred;
+	// Errors end the stream the same way the end of the file does
+	w.eof = w.op->err || w.size < w.requested;
+	w.op->Release();
+	w.op = nullptr;
+	w.done = nullptr;
+}
+
+void BufferedFile::DropWindows()
+{
+	for(auto &w : windows_) {
+		if(w.op)
+			WaitFill(w);
+		w.size = 0;
+		w.eof = false;
+	}
+}
+
+BufferedFile::Window *BufferedFile::Lookup(uint64_t position)
+{
+	for(int i : {cur_, cur_ ^ 1}) {
+		Window &w = windows_[i];
+		if(w.op && position >= w.offset && position < w.offset + w.requested)
+			WaitFill(w);
+		if(!w.op && position >= w.offset && position < w.offset + w.size) {
+			cur_ = i;
+			return &w;
+		}
+	}
+	return nullptr;
+}
+
+size_t BufferedFile::Read(void *p, size_t n)
+{
+	Flush();
+	bool sequential = position_ == last_read_end_;
+	auto out = static_cast<uint8_t *>(p);
+	size_t done = 0;
+	while(done < n) {
+		Window *w = Lookup(position_);
+		if(!w) {
+			size_t want = n - done;
+			if(want >= window_size_) {
+				size_t got = file_.ReadAbs(out + done, want, position_);
+				position_ += got;
+				done += got;
+				if(got < want)
+					eof_ = true;
+				break;
+			}
+			w = &windows_[cur_];
+			StartFill(*w, position_, false);
+			WaitFill(*w);
+			if(!w->size) {
+				eof_ = true;
+				break;
+			}
+		}
+
+		size_t k = std::min(n - done, (size_t)(w->offset + w->size - position_));
+		memcpy(out + done, w->data.get() + (position_ - w->offset), k);
+		position_ += k;
+		done += k;
+
+		// Keep the next window in flight while this one is consumed
+		Window &next = windows_[cur_ ^ 1];
+		uint64_t next_offset = w->offset + w->size;
+		bool have_next = next.offset == next_offset && (next.op || next.size);
+		if(sequential && !w->eof && !have_next)
+			StartFill(next, next_offset, true);
+
+		if(done < n && w->eof && position_ == next_offset) {
+			eof_ = true;
+			break;
+		}
+	}
+	last_read_end_ = position_;
+	return done;
+}
+
+size_t BufferedFile::Write(const void *p, size_t n)
+{
+	// Buffered reads may be stale after this
+	DropWindows();
+	if(wbuf_size_ && position_ != wbuf_offset_ + wbuf_size_)
+		Flush();
+
+	if(wbuf_size_ + n > wbuf_capacity_) {
+		if(!Flush())
+			return 0;
+		if(n >= window_size_) {
+			size_t ret = file_.WriteAbs(p, n, position_);
+			position_ += ret;
+			return ret;
+		}
+		if(wbuf_capacity_ != window_size_) {
+			wbuf_ = std::make_unique<uint8_t[]>(window_size_);
+			wbuf_capacity_ = window_size_;
+		}
+	}
+	if(!wbuf_size_)
+		wbuf_offset_ = position_;
+	memcpy(wbuf_.get() + wbuf_size_, p, n);
+	wbuf_size_ += (uint32_t)n;
+	position_ += n;
+	return n;
+}
+
+bool BufferedFile::Flush()
+{
+	if(!wbuf_size_)
+		return true;
+	uint32_t n = wbuf_size_;
+	wbuf_size_ = 0;
+	return file_.WriteAbs(wbuf_.get(), n, wbuf_offset_) == n;
+}
+
+} // namespace lune
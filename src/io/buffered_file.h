@@ -0,0 +1,81 @@
+#pragma once
+
+#include "file.h"
+#include "sys/sync.h"
+
+#include <memory>
+
+namespace lune {
+
+// Buffers small reads and writes to a file, for parsers that consume a few bytes at a time and would
+// otherwise pay for an AsyncOp and a wakeup on every call.
+// Reads are served from a window of the file. Once reads are seen to run sequentially, the next window
+// is read at prefetch priority while the caller consumes the current one. Reads and writes at least a
+// window in size go straight to the file. Not thread-safe.
+class BufferedFile
+{
+public:
+	static constexpr uint32_t kDefaultWindowSize = 64 * 1024;
+
+	explicit BufferedFile(IoFilePtr f, uint32_t window_size = kDefaultWindowSize);
+	~BufferedFile();
+
+	BufferedFile(const BufferedFile &) = delete;
+	void operator=(const BufferedFile &) = delete;
+
+	operator bool() const { return !!file_; }
+
+	IoFile *file() { return file_.file(); }
+
+	size_t Read(void *p, size_t n);
+	size_t Write(const void *p, size_t n);
+	// Writes out anything buffered. Returns false if the file accepted less than that
+	bool Flush();
+
+	// Buffered data remains valid across seeks
+	void Seek(uint64_t position);
+	uint64_t Tell() const { return position_; }
+	bool eof() const { return eof_; }
+
+	// Takes effect from the next window read
+	void SetWindowSize(uint32_t n);
+	uint32_t window_size() const { return window_size_; }
+
+private:
+	struct Window
+	{
+		std::unique_ptr<uint8_t[]> data;
+		uint32_t capacity = 0;
+		uint64_t offset = 0;
+		uint32_t requested = 0;
+		// Valid bytes, once the fill has completed
+		uint32_t size = 0;
+		bool eof = false;
+
+		AsyncOp *op = nullptr;
+		std::unique_ptr<OneShotEvent> done;
+	};
+
+	Window *Lookup(uint64_t position);
+	void StartFill(Window &w, uint64_t offset, bool prefetch);
+	void WaitFill(Window &w);
+	void DropWindows();
+
+	File file_;
+	uint32_t window_size_;
+	// windows_[cur_] is the one last read from, the other the readahead
+	Window windows_[2];
+	int cur_ = 0;
+
+	uint64_t position_ = 0;
+	// Where the previous read ended. A read starting there continues a sequential run
+	uint64_t last_read_end_ = UINT64_MAX;
+	bool eof_ = false;
+
+	std::unique_ptr<uint8_t[]> wbuf_;
+	uint64_t wbuf_offset_ = 0;
+	uint32_t wbuf_size_ = 0;
+	uint32_t wbuf_capacity_ = 0;
+};
+
+} // namespace lune
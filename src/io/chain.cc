@@ -0,0 +1,204 @@
+#include "chain.h"
+
+#include <algorithm>
+#include <memory>
+
+namespace lune {
+
+namespace {
+class MallocSegment : public Refcounted
+{
+public:
+	explicit MallocSegment(void *mem) : mem_(mem) {}
+	~MallocSegment() { free(mem_); }
+
+private:
+	void *mem_;
+};
+
+class StringSegment : public Refcounted
+{
+public:
+	explicit StringSegment(std::string *s) : s_(s) {}
+
+private:
+	std::unique_ptr<std::string> s_;
+};
+
+// A view of one segment as a resolved blob
+class SegmentBlob : public Blob
+{
+public:
+	SegmentBlob(const IoChain::Segment &s) : owner_(s.owner), data_(s.data), len_(s.len) { Resolved(false); }
+
+	std::pair<void *, size_t> GetContents() override { return std::make_pair((void *)data_, (size_t)len_); }
+
+private:
+	RefPtr<Refcounted> owner_;
+	uint8_t *data_;
+	uint64_t len_;
+};
+} // namespace
+
+void IoChain::Append(Refcounted *owner, const void *data, uint64_t len)
+{
+	if(!len)
+		return;
+	segments_.push_back(Segment{owner, (uint8_t *)data, len});
+	size_ += len;
+}
+
+void IoChain::Append(IoBuffer *buffer)
+{
+	BufLen n;
+	void *p = buffer->GetValidArea(&n);
+	Append(buffer, p, n);
+}
+
+void IoChain::Append(Blob *blob)
+{
+	auto c = blob->GetContents();
+	Append(blob, c.first, c.second);
+}
+
+void IoChain::Append(IoChain &&chain)
+{
+	if(segments_.empty()) {
+		*this = std::move(chain);
+		return;
+	}
+	segments_.insert(segments_.end(), std::make_move_iterator(chain.segments_.begin()),
+	    std::make_move_iterator(chain.segments_.end()));
+	size_ += chain.size_;
+	chain.Clear();
+}
+
+void IoChain::Append(std::string *s)
+{
+	if(s->empty()) {
+		delete s;
+		return;
+	}
+	Append(new StringSegment(s), s->data(), s->size());
+}
+
+void IoChain::AppendMalloc(void *mem, uint64_t len)
+{
+	if(!len) {
+		free(mem);
+		return;
+	}
+	Append(new MallocSegment(mem), mem, len);
+}
+
+size_t IoChain::SplitAt(uint64_t pos)
+{
+	size_t i = 0;
+	for(; i < segments_.size() && pos; i++) {
+		Segment &s = segments_[i];
+		if(pos < s.len) {
+			Segment tail{s.owner, s.data + pos, s.len - pos};
+			s.len = pos;
+			segments_.insert(segments_.begin() + i + 1, std::move(tail));
+			return i + 1;
+		}
+		pos -= s.len;
+	}
+	return i;
+}
+
+void IoChain::Splice(uint64_t pos, IoChain &&chain)
+{
+	if(pos >= size_) {
+		Append(std::move(chain));
+		return;
+	}
+	size_t i = SplitAt(pos);
+	segments_.insert(segments_.begin() + i, std::make_move_iterator(chain.segments_.begin()),
+	    std::make_move_iterator(chain.segments_.end()));
+	size_ += chain.size_;
+	chain.Clear();
+}
+
+IoChain IoChain::Split(uint64_t n)
+{
+	IoChain front;
+	if(n >= size_) {
+		std::swap(front, *this);
+		return front;
+	}
+	size_t i = SplitAt(n);
+	front.segments_.assign(
+	    std::make_move_iterator(segments_.begin()), std::make_move_iterator(segments_.begin() + i));
+	segments_.erase(segments_.begin(), segments_.begin() + i);
+	front.size_ = n;
+	size_ -= n;
+	return front;
+}
+
+void IoChain::Consume(uint64_t n)
+{
+	Split(n);
+}
+
+void IoChain::Clear()
+{
+	segments_.clear();
+	size_ = 0;
+}
+
+size_t IoChain::CopyOut(uint64_t pos, void *dst, size_t n) const
+{
+	auto out = static_cast<uint8_t *>(dst);
+	size_t done = 0;
+	for(auto &s : segments_) {
+		if(done == n)
+			break;
+		if(pos >= s.len) {
+			pos -= s.len;
+			continue;
+		}
+		size_t k = (size_t)std::min<uint64_t>(s.len - pos, n - done);
+		memcpy(out + done, s.data + pos, k);
+		done += k;
+		pos = 0;
+	}
+	return done;
+}
+
+void IoChain::ToSG(std::vector<SGBuf> *sg) const
+{
+	for(auto &s : segments_) {
+		for(uint64_t pos = 0; pos < s.len; pos += kMaxOpBytes) {
+			SGBuf b;
+			b.buf = s.data + pos;
+			b.len = (BufLen)std::min(s.len - pos, kMaxOpBytes);
+			sg->push_back(b);
+		}
+	}
+}
+
+RefPtr<Blob> IoChain::Flatten() const
+{
+	if(segments_.size() == 1)
+		return new SegmentBlob(segments_[0]);
+	RefPtr<DynamicBlob> b = new DynamicBlob();
+	void *p = malloc(size_ ? size_ : 1);
+	CopyOut(0, p, size_);
+	b->Set(p, size_);
+	return b;
+}
+
+const uint8_t *IoChain::Coalesce()
+{
+	if(segments_.size() > 1) {
+		void *p = malloc(size_);
+		CopyOut(0, p, size_);
+		uint64_t n = size_;
+		Clear();
+		AppendMalloc(p, n);
+	}
+	return segments_.empty() ? nullptr : segments_[0].data;
+}
+
+} // namespace lune
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "aio.h"
+
+#include <string>
+#include <vector>
+
+namespace lune {
+
+// A byte sequence made of refcounted memory segments with 64-bit lengths, for payloads that are built
+// from parts or are too large for one IoBuffer. Appending, splicing and splitting only move segment
+// references; the bytes themselves are never copied. Copies of a chain share its segments, which
+// must not be written to while shared.
+class IoChain
+{
+public:
+	struct Segment
+	{
+		RefPtr<Refcounted> owner;
+		uint8_t *data;
+		uint64_t len;
+	};
+
+	IoChain() = default;
+
+	uint64_t size() const { return size_; }
+	bool empty() const { return !size_; }
+	const std::vector<Segment> &segments() const { return segments_; }
+
+	// owner keeps [data, data + len) alive
+	void Append(Refcounted *owner, const void *data, uint64_t len);
+	// The buffer's valid area
+	void Append(IoBuffer *buffer);
+	// The whole of a resolved blob
+	void Append(Blob *blob);
+	void Append(IoChain &&chain);
+	// Takes ownership of a string or a malloc()ed block
+	void Append(std::string *s);
+	void AppendMalloc(void *mem, uint64_t len);
+
+	// Inserts chain so that it starts at byte pos, splitting a segment if need be
+	void Splice(uint64_t pos, IoChain &&chain);
+	// Removes the first n bytes and returns them as a chain of their own
+	IoChain Split(uint64_t n);
+	void Consume(uint64_t n);
+	void Clear();
+
+	// Copies up to n bytes starting at pos. Returns the number copied
+	size_t CopyOut(uint64_t pos, void *dst, size_t n) const;
+	// Describes the chain for vectored I/O. Segments longer than an SGBuf can hold are split
+	void ToSG(std::vector<SGBuf> *sg) const;
+	// The chain as one resolved blob. A single-segment chain is shared rather than copied
+	RefPtr<Blob> Flatten() const;
+	// Gathers the chain into a single segment in place, so that it can be handed to APIs that need
+	// contiguous memory. Returns that memory
+	const uint8_t *Coalesce();
+
+	// The largest segment handed to a single I/O op; ops report their transfer in 32 bits
+	static constexpr uint64_t kMaxOpBytes = 1ULL << 30;
+
+private:
+	// Returns the index of the segment that starts at pos, splitting one if pos falls inside it
+	size_t SplitAt(uint64_t pos);
+
+	std::vector<Segment> segments_;
+	uint64_t size_ = 0;
+};
+
+} // namespace lune
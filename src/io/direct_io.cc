@@ -0,0 +1,253 @@
+#include "direct_io.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <stdlib.h>
+#if IS_WIN
+#include <malloc.h>
+#endif
+
+namespace lune {
+
+class PooledIoBuffer : public IoBuffer
+{
+public:
+	LUNE_SLAB_ALLOCATED(PooledIoBuffer)
+
+	PooledIoBuffer(AlignedBufferPool *pool, void *mem) : IoBuffer(mem, 0, 0, pool->block_size()), pool_(pool) {}
+	~PooledIoBuffer() { pool_->Recycle(ptr); }
+
+private:
+	AlignedBufferPool *pool_;
+};
+
+namespace {
+void *AlignedAlloc(size_t size)
+{
+#if IS_WIN
+	return _aligned_malloc(size, kDirectIoAlignment);
+#else
+	return aligned_alloc(kDirectIoAlignment, size);
+#endif
+}
+
+void AlignedFree(void *p)
+{
+#if IS_WIN
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+} // namespace
+
+AlignedBufferPool::AlignedBufferPool(uint32_t block_size, uint32_t max_free)
+    : block_size_((block_size + kDirectIoAlignment - 1) & ~(kDirectIoAlignment - 1)), max_free_(max_free)
+{
+}
+
+AlignedBufferPool::~AlignedBufferPool()
+{
+	for(auto p : free_) AlignedFree(p);
+}
+
+AlignedBufferPool *AlignedBufferPool::Get()
+{
+	static AlignedBufferPool pool(1 << 20, 16);
+	return &pool;
+}
+
+IoBuffer *AlignedBufferPool::Alloc()
+{
+	void *mem = nullptr;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		if(!free_.empty()) {
+			mem = free_.back();
+			free_.pop_back();
+		}
+	}
+	if(!mem)
+		mem = AlignedAlloc(block_size_);
+	LUNE_ASSERT(mem);
+	return new PooledIoBuffer(this, mem);
+}
+
+void AlignedBufferPool::Recycle(void *mem)
+{
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		if(free_.size() < max_free_) {
+			free_.push_back(mem);
+			return;
+		}
+	}
+	AlignedFree(mem);
+}
+
+namespace details {
+namespace {
+bool IsAligned(uint64_t v)
+{
+	return (v & (kDirectIoAlignment - 1)) == 0;
+}
+
+bool IsAligned(const AsyncOp *op)
+{
+	if(op->offset == kAppendOffset || !IsAligned(op->offset))
+		return false;
+	for(int i = 0; i < op->nsg; i++) {
+		if(!IsAligned((uintptr_t)op->sg[i].buf) || !IsAligned(op->sg[i].len))
+			return false;
+	}
+	return true;
+}
+
+// Chunks a bounced read keeps in flight. Well under the shared pool's free list, so streaming reuses
+// the same buffers instead of allocating one per chunk
+static constexpr uint32_t kBounceWindow = 4;
+
+struct BounceRead
+{
+	AsyncOp *op;
+	IoFilePtr file;
+	uint64_t total;
+	uint64_t end;
+
+	CriticalSection lock;
+	// Start of the next chunk to issue
+	uint64_t next;
+	uint32_t in_flight = 0;
+	// Set while a thread is in IssueBounceChunks
+	bool issuing = false;
+	int32_t err = 0;
+	// File offset at which the data ran out, if a chunk came back short
+	uint64_t data_end = UINT64_MAX;
+};
+
+void FinishBounce(BounceRead *st)
+{
+	AsyncOp *op = st->op;
+	uint64_t end = std::min(st->data_end, op->offset + st->total);
+	// BeginRead rejects totals that don't fit, so this can't truncate
+	uint32_t n = end > op->offset ? (uint32_t)(end - op->offset) : 0;
+	int32_t err = st->err;
+	uint64_t total = st->total;
+	delete st;
+	if(err)
+		op->CompleteErr(err);
+	else if(!n && total)
+		op->CompleteErr(io_err::kEOF);
+	else
+		op->Complete(n);
+}
+
+void OnBounceChunk(void *ctx, AsyncOp *chunk);
+
+// Issues chunks until the window is full or none are left, and finishes the read once the last one has
+// landed. Called with st->lock held by the thread that set st->issuing. Chunks may complete inline or on
+// other threads; those completions find issuing set and leave the next chunk to this loop
+void IssueBounceChunks(BounceRead *st, std::unique_lock<CriticalSection> &l)
+{
+	auto pool = AlignedBufferPool::Get();
+	uint64_t block = pool->block_size();
+	while(!st->err && st->next < std::min(st->end, st->data_end) && st->in_flight < kBounceWindow) {
+		uint64_t pos = st->next;
+		st->next += block;
+		st->in_flight++;
+		l.unlock();
+
+		auto chunk = AsyncOp::AllocForMaxWrite(pool->Alloc());
+		chunk->default_sg[0].len = (BufLen)std::min(block, st->end - pos);
+		chunk->offset = pos;
+		chunk->cancel = st->op->cancel;
+		chunk->SetCompletion(&OnBounceChunk, st);
+		chunk->completion_context2 = (void *)(uintptr_t)pos;
+		st->file->BeginRead(chunk);
+
+		l.lock();
+	}
+	st->issuing = false;
+	bool done = !st->in_flight;
+	l.unlock();
+	if(done)
+		FinishBounce(st);
+}
+
+void OnBounceChunk(void *ctx, AsyncOp *chunk)
+{
+	auto st = (BounceRead *)ctx;
+	AsyncOp *op = st->op;
+	uint64_t pos = (uint64_t)(uintptr_t)chunk->completion_context2;
+	uint64_t n = chunk->transferred;
+	int32_t err = chunk->err;
+	bool short_read = n < chunk->sg[0].len;
+
+	uint64_t lo = std::max(pos, op->offset);
+	uint64_t hi = std::min(pos + n, op->offset + st->total);
+	if(lo < hi)
+		op->CopyToSg(lo - op->offset, (const uint8_t *)chunk->sg[0].buf + (lo - pos), hi - lo);
+	chunk->Release();
+
+	std::unique_lock<CriticalSection> l(st->lock);
+	if(err && err != io_err::kEOF) {
+		if(!st->err)
+			st->err = err;
+	} else if(short_read) {
+		st->data_end = std::min(st->data_end, pos + n);
+	}
+	st->in_flight--;
+	if(st->issuing)
+		return;
+	st->issuing = true;
+	IssueBounceChunks(st, l);
+}
+} // namespace
+
+void DirectIoFile::BeginRead(AsyncOp *op)
+{
+	if(op->CompleteIfCancelled())
+		return;
+	if(IsAligned(op)) {
+		f_->BeginRead(op);
+		return;
+	}
+	if(op->offset == kAppendOffset) {
+		op->CompleteErr(io_err::kUnaligned);
+		return;
+	}
+
+	uint64_t total = 0;
+	for(int i = 0; i < op->nsg; i++) total += op->sg[i].len;
+	if(!total) {
+		op->Complete(0);
+		return;
+	}
+	if(total > UINT32_MAX) {
+		op->CompleteErr(io_err::kTooLarge);
+		return;
+	}
+
+	auto st = new BounceRead();
+	st->op = op;
+	st->file = f_;
+	st->total = total;
+	st->next = op->offset & ~(uint64_t)(kDirectIoAlignment - 1);
+	st->end = (op->offset + total + kDirectIoAlignment - 1) & ~(uint64_t)(kDirectIoAlignment - 1);
+	std::unique_lock<CriticalSection> l(st->lock);
+	st->issuing = true;
+	IssueBounceChunks(st, l);
+}
+
+void DirectIoFile::BeginWrite(AsyncOp *op)
+{
+	if(!IsAligned(op)) {
+		op->CompleteErr(io_err::kUnaligned);
+		return;
+	}
+	f_->BeginWrite(op);
+}
+} // namespace details
+
+} // namespace lune
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "file.h"
+#include "sys/sync.h"
+
+#include <vector>
+
+namespace lune {
+
+// Direct I/O requires the file offset, the length and the memory address of every segment to be a
+// multiple of the device's logical block size. 4K covers every device we care about
+static constexpr uint32_t kDirectIoAlignment = 4096;
+
+// Recycles fixed-size, kDirectIoAlignment-aligned IoBuffers. A buffer returns itself to its pool when
+// its last reference is dropped
+class AlignedBufferPool
+{
+public:
+	AlignedBufferPool(uint32_t block_size, uint32_t max_free);
+	~AlignedBufferPool();
+
+	AlignedBufferPool(const AlignedBufferPool &) = delete;
+	void operator=(const AlignedBufferPool &) = delete;
+
+	// The shared pool of 1MB blocks used for streaming
+	static AlignedBufferPool *Get();
+
+	// Returns an empty buffer of block_size() bytes
+	IoBuffer *Alloc();
+
+	uint32_t block_size() const { return block_size_; }
+
+private:
+	friend class PooledIoBuffer;
+	void Recycle(void *mem);
+
+	uint32_t block_size_;
+	uint32_t max_free_;
+
+	CriticalSection lock_;
+	std::vector<void *> free_;
+};
+
+namespace details {
+// Wraps a file opened with file_flags::kDirectIo.
+// Reads that meet the alignment rules go straight to the device. Others are split into aligned,
+// block-sized chunks that are read into pool buffers and copied out, so callers need not care about
+// alignment. Only a few chunks are in flight at once, so a large read holds a bounded number of pool
+// buffers. Unaligned writes would need a read-modify-write cycle, so they fail with io_err::kUnaligned
+// instead. Bounced reads of 4GB or more can't report their size, so they fail with io_err::kTooLarge
+class DirectIoFile : public IoFile
+{
+public:
+	explicit DirectIoFile(IoFilePtr f) : f_(std::move(f)) {}
+
+	void BeginRead(AsyncOp *op) override;
+	void BeginWrite(AsyncOp *op) override;
+
+	void Flush() override { f_->Flush(); }
+	bool Sync() override { return f_->Sync(); }
+	bool AllowWrites() const override { return f_->AllowWrites(); }
+	uint64_t GetFileSize() const override { return f_->GetFileSize(); }
+	uint64_t GetDeviceId() const override { return f_->GetDeviceId(); }
+	void Truncate(uint64_t bytes) override { f_->Truncate(bytes); }
+
+	std::unique_ptr<ShmRegion> MapRegion(void *addr, uint64_t offset, uint64_t size, bool ro) override
+	{
+		return f_->MapRegion(addr, offset, size, ro);
+	}
+
+private:
+	IoFilePtr f_;
+};
+} // namespace details
+
+} // namespace lune
@@ -1,5 +1,15 @@
 #include "file.h"
 
+#include "blob_cache.h"
+#include "chain.h"
+#include "clock.h"
+#include "pack.h"
+#include "ram_vfs.h"
+#include "scheduler.h"
+#include "stats.h"
+
+#include <algorithm>
+
 namespace lune {
 
 VFS sys_vfs(VFSImpl::GetOsVfs());
@@ -19,6 +29,65 @@ std::vector<std::string> IoDir::EnumerateFiles()
 	return ret;
 }
 
+namespace {
+bool MatchQuery(const char *q, const char *s)
+{
+	while(*q) {
+		if(*q == '*') {
+			for(const char *t = s;; t++) {
+				if(MatchQuery(q + 1, t))
+					return true;
+				if(!*t)
+					return false;
+			}
+		}
+		if(!*s || (*q != '?' && *q != *s))
+			return false;
+		q++;
+		s++;
+	}
+	return !*s;
+}
+
+struct BlobRegion : ShmRegion
+{
+	RefPtr<Blob> blob;
+};
+} // namespace
+
+bool MatchFileQuery(const char *query, const char *name)
+{
+	return !query || !*query || MatchQuery(query, name);
+}
+
+void IoBlobFile::BeginRead(AsyncOp *op)
+{
+	auto c = blob_->GetContents();
+	if(op->offset >= c.second) {
+		op->CompleteErr(io_err::kEOF);
+		return;
+	}
+	uint64_t n = 0;
+	for(int i = 0; i < op->nsg; i++) n += op->sg[i].len;
+	n = std::min<uint64_t>(n, c.second - op->offset);
+	op->CopyToSg(0, (const uint8_t *)c.first + op->offset, n);
+	op->Complete((uint32_t)n);
+}
+
+std::unique_ptr<ShmRegion> IoBlobFile::MapRegion(void *addr, uint64_t offset, uint64_t size, bool ro)
+{
+	auto c = blob_->GetContents();
+	// The contents can't be moved to a caller's address, nor written through
+	if(addr || !ro || offset > c.second)
+		return nullptr;
+	auto r = std::make_unique<BlobRegion>();
+	r->offset = offset;
+	r->ptr = (uint8_t *)c.first + offset;
+	r->size = size ? (size_t)std::min<uint64_t>(size, c.second - offset) : (size_t)(c.second - offset);
+	r->blob = blob_;
+	return r;
+}
+
 File::File(IoFile *f) : file_(f) {}
 File::File(IoFilePtr f) : file_(std::move(f)) {}
 File::~File() = default;
@@ -55,6 +124,37 @@ size_t File::WriteAbs(const void *p, size_t n, uint64_t offset)
 	return ret;
 }
 
+size_t File::ReadAbsV(const SGBuf *sg, int nsg, uint64_t offset)
+{
+	OneShotEvent wrev;
+	auto op = AsyncOp::AllocForSyncIo(&wrev);
+	// The caller's segments outlive the op, but backends may clamp them, so copy
+	std::vector<SGBuf> segs(sg, sg + nsg);
+	op->sg = segs.data();
+	op->nsg = nsg;
+	op->offset = offset;
+	file_->BeginRead(op);
+	wrev.wait();
+	auto ret = op->transferred;
+	op->Release();
+	return ret;
+}
+
+size_t File::WriteAbsV(const SGBuf *sg, int nsg, uint64_t offset)
+{
+	OneShotEvent wrev;
+	auto op = AsyncOp::AllocForSyncIo(&wrev);
+	std::vector<SGBuf> segs(sg, sg + nsg);
+	op->sg = segs.data();
+	op->nsg = nsg;
+	op->offset = offset;
+	file_->BeginWrite(op);
+	wrev.wait();
+	auto ret = op->transferred;
+	op->Release();
+	return ret;
+}
+
 size_t File::Read(void *p, size_t n)
 {
 	OneShotEvent wrev;
@@ -96,22 +196,20 @@ std::unique_ptr<OutputStream> File::CreateOutputStream()
 	return std::make_unique<FileOutputStream>(file_.get());
 }
 
-RefPtr<Blob> File::AllocForBlobRead(AsyncOp **op_out, uint64_t size)
+AsyncOp *File::AllocForBlobRead(Blob *b)
 {
-	RefPtr<Blob> b = new OwnedMemoryBlob(size);
-
 	auto buf = IoBuffer::WrapEmptyBlob(b);
 	auto op = AsyncOp::AllocForMaxWrite(buf);
 	op->completion = [](void *ctx, AsyncOp *op) {
 		Blob *b = (Blob *)ctx;
 		b->Resolved(!!op->err);
+		op->Release();
 	};
 	op->completion_context = b;
-	*op_out = op;
-	return b;
+	return op;
 }
 
-RefPtr<Blob> File::ReadToFutureBlob(uint64_t offset, uint64_t size)
+RefPtr<Blob> File::ReadToFutureBlob(uint64_t offset, uint64_t size, CancellationToken *cancel)
 {
 	uint64_t filesz = file_->GetFileSize();
 	if(filesz == 0) {
@@ -121,13 +219,22 @@ RefPtr<Blob> File::ReadToFutureBlob(uint64_t offset, uint64_t size)
 	}
 	if(size == 0)
 		size = filesz;
-	AsyncOp *op;
-	RefPtr<Blob> b = AllocForBlobRead(&op, size);
+	RefPtr<Blob> b = new OwnedMemoryBlob(size);
+	ReadIntoBlob(b.get(), offset, cancel);
+	return b;
+}
+
+void File::ReadIntoBlob(Blob *b, uint64_t offset, CancellationToken *cancel)
+{
+	if(!b->GetSize()) {
+		b->Resolved(false);
+		return;
+	}
+	AsyncOp *op = AllocForBlobRead(b);
 	op->offset = offset;
+	op->cancel = cancel;
 
 	file_->BeginRead(op);
-
-	return b;
 }
 
 RefPtr<Blob> File::ReadToImmediateBlob(uint64_t offset, uint64_t size)
@@ -197,33 +304,386 @@ bool VFS::CheckAccess(const Path &path, uint32_t flags)
 	return impl_->CheckAccess(path, flags);
 }
 
-FileOutputStream::FileOutputStream(IoFile *f) : file_(f) {}
-FileOutputStream ::~FileOutputStream() {}
+namespace {
+// Runs fn(T *) on the I/O pool. The future resolves with what fn stored, or null if fn returned false
+template<typename T, typename Fn>
+Future<T> PostToIoPool(Fn fn)
+{
+	auto p = Promise<T>::Make();
+	auto ret = p->MakeFuture();
+	GetPoolIo()->PostTask([p, fn = std::move(fn)]() {
+		T v{};
+		if(fn(&v))
+			p->Resolve(std::move(v));
+		else
+			p->ResolveNull();
+	});
+	return ret;
+}
+} // namespace
 
-void FileOutputStream::WriteAsync(IoBuffer *buffer)
+Future<IoFilePtr> VFS::OpenFileAsync(const Path &path, uint32_t flags, OpenMode mode)
 {
-	auto op = AsyncOp::AllocForMaxRead(buffer);
-	op->offset = kAppendOffset;
-	file_->BeginWrite(op);
+	return PostToIoPool<IoFilePtr>([impl = impl_, path = std::string(path), flags, mode](IoFilePtr *out) {
+		*out = impl->OpenFile(path, flags, mode);
+		return !!*out;
+	});
 }
 
-void FileOutputStream::Write(const void *data, uint32_t size)
+Future<StatBuf> VFS::StatAsync(const Path &path)
 {
-	OneShotEvent wrev;
-	auto op = AsyncOp::AllocForSyncIo(&wrev);
-	op->sg = op->default_sg;
-	op->nsg = 1;
-	op->default_sg[0].len = size;
-	op->default_sg[0].buf = const_cast<void *>(data);
+	return PostToIoPool<StatBuf>(
+	    [impl = impl_, path = std::string(path)](StatBuf *out) { return impl->Stat(path, out); });
+}
+
+Future<bool> VFS::CheckAccessAsync(const Path &path, uint32_t flags)
+{
+	return PostToIoPool<bool>([impl = impl_, path = std::string(path), flags](bool *out) {
+		// Denied access is an answer, not a failure
+		*out = impl->CheckAccess(path, flags);
+		return true;
+	});
+}
+
+Future<std::vector<StatResult>> VFS::StatManyAsync(std::vector<std::string> paths)
+{
+	return PostToIoPool<std::vector<StatResult>>(
+	    [impl = impl_, paths = std::move(paths)](std::vector<StatResult> *out) {
+		    out->resize(paths.size());
+		    for(size_t i = 0; i < paths.size(); i++) (*out)[i].ok = impl->Stat(paths[i], &(*out)[i].stat);
+		    return true;
+	    });
+}
+
+Future<IoDirPtr> VFS::OpenDirAsync(const Path &path)
+{
+	return PostToIoPool<IoDirPtr>([impl = impl_, path = std::string(path)](IoDirPtr *out) {
+		*out = impl->OpenDir(path);
+		return !!*out;
+	});
+}
+
+Future<std::vector<DirEntry>> VFS::EnumerateAsync(const Path &path, std::string query)
+{
+	return PostToIoPool<std::vector<DirEntry>>(
+	    [impl = impl_, path = std::string(path), query = std::move(query)](std::vector<DirEntry> *out) {
+		    auto dir = impl->OpenDir(path);
+		    if(!dir)
+			    return false;
+		    return dir->EnumerateFiles(query.c_str(), [out](const FileInfo &fi) {
+			    out->push_back(DirEntry{fi.filename, fi.size, fi.flags});
+			    return true;
+		    });
+	    });
+}
+
+void OutputStream::WriteChain(const IoChain &chain)
+{
+	for(auto &s : chain.segments()) {
+		for(uint64_t pos = 0; pos < s.len; pos += IoChain::kMaxOpBytes)
+			Write(s.data + pos, (uint32_t)std::min(s.len - pos, IoChain::kMaxOpBytes));
+	}
+}
+
+void ChainOutputStream::WriteChain(const IoChain &chain)
+{
+	for(auto &s : chain.segments()) chain_->Append(s.owner.get(), s.data, s.len);
+}
+
+void ChainOutputStream::Write(const void *data, uint32_t size)
+{
+	void *p = malloc(size ? size : 1);
+	memcpy(p, data, size);
+	chain_->AppendMalloc(p, size);
+}
+
+namespace {
+// Sends stale staged data for every FileOutputStream. Sleeps until the oldest staged data goes stale, and
+// blocks outright while nothing is staged
+class WriteBehindFlusher
+{
+public:
+	static WriteBehindFlusher *Get()
+	{
+		static WriteBehindFlusher *flusher = new WriteBehindFlusher();
+		return flusher;
+	}
+
+	void Add(FileOutputStream *s)
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		streams_.push_back(s);
+	}
+	void Remove(FileOutputStream *s)
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		streams_.erase(std::find(streams_.begin(), streams_.end(), s));
+	}
+
+	// Called when a stream starts staging data, which the flusher may not know to wait for. Must not be
+	// called with the stream's lock held, as the flusher takes that under its own
+	void Wake()
+	{
+		// A write made while the flusher sends, such as a log line, runs with lock_ already held
+		if(on_flusher_) {
+			woken_ = true;
+			return;
+		}
+		{
+			std::unique_lock<CriticalSection> l(lock_);
+			woken_ = true;
+		}
+		cv_.notify_one();
+	}
+
+private:
+	WriteBehindFlusher()
+	{
+		thread_ = OsThread::CreateRawThread(std::bind(&WriteBehindFlusher::ThreadMain, this), "WriteBehind", ThreadType::IO);
+	}
+
+	void ThreadMain()
+	{
+		on_flusher_ = true;
+		std::unique_lock<CriticalSection> l(lock_);
+		while(true) {
+			// Cleared before the scan, so data staged after a stream was looked at always wakes the wait
+			woken_ = false;
+			uint64_t now = ClkUpdateRealtime();
+			uint64_t next = UINT64_MAX;
+			for(auto s : streams_) next = std::min(next, s->FlushIfStale(now));
+			if(next != UINT64_MAX)
+				TimedWait(cv_, l, next > now ? next - now : 0);
+			else
+				while(!woken_) cv_.wait(l);
+		}
+	}
+
+	CriticalSection lock_;
+	CondVar cv_;
+	bool woken_ = false;
+	std::vector<FileOutputStream *> streams_;
+	std::shared_ptr<OsThread> thread_;
+
+	static thread_local bool on_flusher_;
+};
+thread_local bool WriteBehindFlusher::on_flusher_ = false;
+} // namespace
+
+FileOutputStream::FileOutputStream(IoFile *f, uint32_t staging_size, uint32_t max_pending, uint64_t max_delay)
+    : file_(f), staging_size_(staging_size), max_pending_(max_pending), max_delay_(max_delay)
+{
+	WriteBehindFlusher::Get()->Add(this);
+}
+
+FileOutputStream::~FileOutputStream()
+{
+	WriteBehindFlusher::Get()->Remove(this);
+	Drain();
+}
+
+void FileOutputStream::SealLocked()
+{
+	if(!staging_)
+		return;
+	queued_.Append(staging_.get());
+	staging_ = nullptr;
+}
+
+AsyncOp *FileOutputStream::NextOpLocked()
+{
+	if(writing_ || err_ || queued_.empty())
+		return nullptr;
+	writing_ = true;
+	IoChain piece = queued_.Split(IoChain::kMaxOpBytes);
+	auto op = AsyncOp::AllocForChain(piece);
 	op->offset = kAppendOffset;
-	file_->BeginWrite(op);
-	wrev.wait();
+	op->SetCompletion(&FileOutputStream::OnWritten, this);
+	op->completion_context2 = (void *)(uintptr_t)piece.size();
+	return op;
+}
+
+void FileOutputStream::OnWritten(void *ctx, AsyncOp *op)
+{
+	auto s = (FileOutputStream *)ctx;
+	uint64_t n = (uintptr_t)op->completion_context2;
+	int32_t err = op->err ? op->err : op->transferred < n ? io_err::kShortWrite : 0;
 	op->Release();
+	AsyncOp *next;
+	{
+		std::unique_lock<CriticalSection> l(s->lock_);
+		s->pending_ -= n;
+		s->writing_ = false;
+		if(err && !s->err_) {
+			// Appends after a gap would land in the wrong place, so nothing more is written
+			s->err_ = err;
+			s->staging_ = nullptr;
+			s->queued_.Clear();
+			s->pending_ = 0;
+		}
+		next = s->NextOpLocked();
+		// The stream may be destroyed as soon as the lock is dropped, unless another op is in flight
+		s->cv_.notify_all();
+	}
+	if(next)
+		s->file_->BeginWrite(next);
+}
+
+void FileOutputStream::WaitForRoom(std::unique_lock<CriticalSection> &l, uint64_t n)
+{
+	while(!err_ && pending_ && pending_ + n > max_pending_) {
+		SealLocked();
+		if(auto op = NextOpLocked()) {
+			l.unlock();
+			file_->BeginWrite(op);
+			l.lock();
+			continue;
+		}
+		cv_.wait(l);
+	}
+}
+
+void FileOutputStream::Enqueue(const IoChain &chain)
+{
+	if(chain.empty())
+		return;
+	AsyncOp *op;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		WaitForRoom(l, chain.size());
+		if(err_)
+			return;
+		SealLocked();
+		IoChain c = chain;
+		queued_.Append(std::move(c));
+		pending_ += chain.size();
+		op = NextOpLocked();
+	}
+	if(op)
+		file_->BeginWrite(op);
+}
+
+void FileOutputStream::WriteAsync(IoBuffer *buffer)
+{
+	IoChain c;
+	c.Append(buffer);
+	Enqueue(c);
+}
+
+void FileOutputStream::WriteAsyncV(IoBuffer *const *buffers, int n)
+{
+	IoChain c;
+	for(int i = 0; i < n; i++) c.Append(buffers[i]);
+	Enqueue(c);
+}
+
+void FileOutputStream::WriteChain(const IoChain &chain)
+{
+	Enqueue(chain);
+}
+
+void FileOutputStream::Write(const void *data, uint32_t size)
+{
+	auto p = static_cast<const uint8_t *>(data);
+	AsyncOp *op;
+	bool started = false;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		WaitForRoom(l, size);
+		if(err_)
+			return;
+		pending_ += size;
+		while(size) {
+			if(!staging_) {
+				staging_ = IoBuffer::AllocEmptyForFill(staging_size_);
+				staged_since_ = ClkUpdateRealtime();
+				started = true;
+			}
+			void *dst;
+			BufLen n;
+			if(!staging_->AllocWrite(&dst, size, &n)) {
+				SealLocked();
+				continue;
+			}
+			memcpy(dst, p, n);
+			staging_->Write(n);
+			p += n;
+			size -= n;
+		}
+		void *dst;
+		BufLen room;
+		if(staging_ && !staging_->AllocWrite(&dst, 1, &room))
+			SealLocked();
+		op = NextOpLocked();
+	}
+	if(started)
+		WriteBehindFlusher::Get()->Wake();
+	if(op)
+		file_->BeginWrite(op);
+}
+
+uint64_t FileOutputStream::FlushIfStale(uint64_t now)
+{
+	AsyncOp *op = nullptr;
+	uint64_t next = UINT64_MAX;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		if(staging_ && now - staged_since_ >= max_delay_) {
+			SealLocked();
+			op = NextOpLocked();
+		} else if(staging_) {
+			next = staged_since_ + max_delay_;
+		}
+	}
+	if(op)
+		file_->BeginWrite(op);
+	return next;
+}
+
+void FileOutputStream::SendLocked(std::unique_lock<CriticalSection> &l)
+{
+	SealLocked();
+	if(auto op = NextOpLocked()) {
+		l.unlock();
+		file_->BeginWrite(op);
+		l.lock();
+	}
+}
+
+void FileOutputStream::Drain()
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	SendLocked(l);
+	while(pending_) cv_.wait(l);
 }
 
 void FileOutputStream::Flush()
 {
+	Drain();
+	file_->Flush();
+}
+
+bool FileOutputStream::FlushFor(uint64_t timeout_us)
+{
+	uint64_t deadline = ClkUpdateRealtime() + timeout_us;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		SendLocked(l);
+		while(pending_) {
+			uint64_t now = ClkUpdateRealtime();
+			if(now >= deadline)
+				return false;
+			TimedWait(cv_, l, deadline - now);
+		}
+	}
 	file_->Flush();
+	return true;
+}
+
+int32_t FileOutputStream::error()
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	return err_;
 }
 
 StdioOutputStream::StdioOutputStream(FILE *f, bool owned) : f_(f), owned_(owned) {}
@@ -261,7 +721,11 @@ IoFilePtr SafeVFSImpl::OpenFile(const Path &path, uint32_t flags, OpenMode mode)
 		return nullptr;
 	std::string p = root_path_;
 	p.append(path);
-	return real_->OpenFile(p, flags, mode);
+	auto f = real_->OpenFile(p, flags, mode);
+	// Game data is read through the per-device scheduler; files opened for writing gain nothing from it
+	if(flags & file_flags::kReadOnly)
+		f = IoScheduler::Wrap(std::move(f));
+	return f;
 }
 IoDirPtr SafeVFSImpl::OpenDir(const Path &path)
 {
@@ -316,6 +780,15 @@ uint64_t SafeVFSImpl::GetFreeBytesForWriting(const Path& path)
 	return real_->GetFreeBytesForWriting(p);
 }
 
+bool SafeVFSImpl::GetOsPath(const Path &path, std::string *out)
+{
+	if(!CheckPath(path))
+		return false;
+	*out = root_path_;
+	out->append(path);
+	return true;
+}
+
 bool SafeVFSImpl::CheckPath(const Path &p) const
 {
 	int s = 1;
@@ -344,7 +817,8 @@ SafeVFSSplit::SafeVFSSplit(
     VFSImpl *real, const Path &temp_path, const Path &data_path)
     : data_vfs_(std::make_shared<SafeVFSImpl>(real, data_path)),
 	save_vfs_(std::make_shared<NullVFSImpl>()),
-	temp_vfs_(real, temp_path)
+	temp_vfs_(std::make_shared<SafeVFSImpl>(real, temp_path)), data_stats_(new IoStats("/data")), game_stats_(new IoStats("/game")),
+	save_stats_(new IoStats("/save")), temp_stats_(new IoStats("/temp"))
 {
 	game_vfs_ = data_vfs_;
 }
@@ -353,44 +827,137 @@ SafeVFSSplit::~SafeVFSSplit() = default;
 IoFilePtr SafeVFSSplit::OpenFile(const Path &path, uint32_t flags, OpenMode mode)
 {
 	Path p = path;
-	auto vfs = Lookup(p);
-	if(!vfs)
-		return nullptr;
-	return vfs->OpenFile(p, flags, mode);
+	IoStats *stats;
+	uint32_t root;
+	IoFilePtr f;
+	if(mode == OpenMode::OpenExisting) {
+		uint64_t generation;
+		auto vfs = CachedLookup(p, &stats, &root, &generation);
+		if(!vfs)
+			return nullptr;
+		f = vfs->OpenFile(p, flags, mode);
+		Remember(path, root, !!f, vfs, p, generation);
+	} else {
+		// May create the file
+		f = Lookup(p, &stats)->OpenFile(p, flags, mode);
+		path_cache_.Invalidate(path);
+	}
+	// Rewrites can keep the size and land within one mtime tick, so don't rely on the cache noticing
+	if(!(flags & file_flags::kReadOnly))
+		blob_cache.Invalidate(this, path);
+	if(!stats)
+		return f;
+	return IoStats::Wrap(std::move(f), std::string(path), stats);
 }
+namespace {
+// A directory of a SafeVFSSplit root. Files opened through it may be created or rewritten, so they are
+// forgotten by the split's caches just as SafeVFSSplit::OpenFile forgets them
+class SplitDir : public IoDir
+{
+public:
+	SplitDir(SafeVFSSplit *split, std::string path, IoDirPtr dir) : split_(split), path_(std::move(path)), dir_(std::move(dir))
+	{
+		if(path_.empty() || path_.back() != '/')
+			path_.push_back('/');
+	}
+
+	bool EnumerateFiles(const char *query, std::function<bool(const FileInfo &)> fn) override
+	{
+		return dir_->EnumerateFiles(query, std::move(fn));
+	}
+
+	RefPtr<IoDir> OpenSubdir(const Path &path) override
+	{
+		auto d = dir_->OpenSubdir(path);
+		if(!d)
+			return nullptr;
+		return new SplitDir(split_, path_ + std::string(path), std::move(d));
+	}
+
+	RefPtr<IoFile> OpenFile(const Path &path, uint32_t flags, OpenMode mode) override
+	{
+		auto f = dir_->OpenFile(path, flags, mode);
+		std::string full = path_ + std::string(path);
+		if(mode != OpenMode::OpenExisting)
+			split_->InvalidatePath(full);
+		if(!(flags & file_flags::kReadOnly))
+			blob_cache.Invalidate(split_, full);
+		return f;
+	}
+
+private:
+	SafeVFSSplit *split_;
+	// The VFS path, ending in '/'
+	std::string path_;
+	IoDirPtr dir_;
+};
+} // namespace
+
 IoDirPtr SafeVFSSplit::OpenDir(const Path &path)
 {
 	Path p = path;
-	auto vfs = Lookup(p);
+	IoStats *stats;
+	uint32_t root;
+	uint64_t generation;
+	auto vfs = CachedLookup(p, &stats, &root, &generation);
 	if(!vfs)
 		return nullptr;
-	return vfs->OpenDir(p);
+	auto d = vfs->OpenDir(p);
+	Remember(path, root, !!d, vfs, p, generation);
+	if(!d)
+		return nullptr;
+	return new SplitDir(this, std::string(path), std::move(d));
 }
 
 bool SafeVFSSplit::CreateDirectory(const Path &path)
 {
 	Path p = path;
 	auto vfs = Lookup(p);
-	return vfs->CreateDirectory(p);
+	bool ok = vfs->CreateDirectory(p);
+	// Nothing beneath a new directory exists yet, and only empty ones are deleted, so neither of these
+	// changes more than path itself
+	path_cache_.Invalidate(path);
+	blob_cache.Invalidate(this, path);
+	return ok;
 }
 bool SafeVFSSplit::Delete(const Path &path)
 {
 	Path p = path;
 	auto vfs = Lookup(p);
-	return vfs->Delete(p);
+	bool ok = vfs->Delete(p);
+	path_cache_.Invalidate(path);
+	blob_cache.Invalidate(this, path);
+	return ok;
 }
 
 bool SafeVFSSplit::Stat(const Path &path, StatBuf *buf)
 {
 	Path p = path;
-	auto vfs = Lookup(p);
-	return vfs->Stat(p, buf);
+	IoStats *stats;
+	uint32_t root;
+	uint64_t generation;
+	auto vfs = CachedLookup(p, &stats, &root, &generation);
+	if(!vfs)
+		return false;
+	bool ok = vfs->Stat(p, buf);
+	if(ok)
+		path_cache_.Insert(path, root, generation);
+	else if(root != kNoRoot && Watched(path))
+		path_cache_.Insert(path, VFSPathCache::kMissing, generation);
+	return ok;
 }
 bool SafeVFSSplit::CheckAccess(const Path &path, uint32_t flags)
 {
 	Path p = path;
-	auto vfs = Lookup(p);
-	return vfs->CheckAccess(p, flags);
+	IoStats *stats;
+	uint32_t root;
+	uint64_t generation;
+	auto vfs = CachedLookup(p, &stats, &root, &generation);
+	if(!vfs)
+		return false;
+	bool ok = vfs->CheckAccess(p, flags);
+	Remember(path, root, ok, vfs, p, generation);
+	return ok;
 }
 
 uint64_t SafeVFSSplit::GetFreeBytesForWriting(const Path &path)
@@ -400,32 +967,195 @@ uint64_t SafeVFSSplit::GetFreeBytesForWriting(const Path &path)
 	return vfs->GetFreeBytesForWriting(p);
 }
 
-VFSImpl *SafeVFSSplit::Lookup(Path &p)
+bool SafeVFSSplit::GetOsPath(const Path &path, std::string *out)
 {
-	if(p.starts_with("/game/")) {
+	Path p = path;
+	auto vfs = Lookup(p);
+	return vfs->GetOsPath(p, out);
+}
+
+VFSImpl *SafeVFSSplit::Lookup(Path &p, IoStats **stats, uint32_t *root)
+{
+	IoStats *unused;
+	if(!stats)
+		stats = &unused;
+	uint32_t r = kNoRoot;
+	for(uint32_t i = 0; i < 4 + custom_.size() && r == kNoRoot; i++) {
+		if(p.starts_with(RootPrefix(i)))
+			r = i;
+	}
+	if(root)
+		*root = r;
+	return Root(r, p, stats);
+}
+
+VFSImpl *SafeVFSSplit::Root(uint32_t root, Path &p, IoStats **stats)
+{
+	switch(root) {
+	case 0:
 		p = p.substr(6);
+		*stats = game_stats_.get();
 		return game_vfs_.get();
-	}
-	if(p.starts_with("/data/")) {
+	case 1:
 		p = p.substr(6);
+		*stats = data_stats_.get();
 		return data_vfs_.get();
-	}
-	if(p.starts_with("/save/")) {
+	case 2:
 		p = p.substr(6);
+		*stats = save_stats_.get();
 		return save_vfs_.get();
-	}
-	if(p.starts_with("/temp/")) {
+	case 3:
 		p = p.substr(6);
-		return &temp_vfs_;
+		*stats = temp_stats_.get();
+		return temp_vfs_.get();
+	}
+	if(root - 4 < custom_.size()) {
+		auto &e = custom_[root - 4];
+		p = p.substr(e.len);
+		*stats = e.stats.get();
+		return e.vfs.get();
+	}
+	*stats = nullptr;
+	return null_vfs.get();
+}
+
+Path SafeVFSSplit::RootPrefix(uint32_t root) const
+{
+	static const char *const builtin[4] = {"/game/", "/data/", "/save/", "/temp/"};
+	if(root < 4)
+		return builtin[root];
+	return Path(custom_[root - 4].prefix, custom_[root - 4].len);
+}
+
+std::vector<std::string> SafeVFSSplit::Aliases(const Path &path)
+{
+	Path rel = path;
+	IoStats *stats;
+	uint32_t root;
+	VFSImpl *vfs = Lookup(rel, &stats, &root);
+	std::vector<std::string> out;
+	if(root == kNoRoot) {
+		out.emplace_back(path);
+		return out;
+	}
+	for(uint32_t i = 0; i < 4 + custom_.size(); i++) {
+		Path prefix = RootPrefix(i), p = prefix;
+		if(Root(i, p, &stats) != vfs)
+			continue;
+		std::string alias(prefix);
+		// Custom prefixes may leave the slash on the relative path
+		if(!alias.empty() && alias.back() == '/' && rel.starts_with('/'))
+			alias.pop_back();
+		alias.append(rel);
+		out.push_back(std::move(alias));
+	}
+	return out;
+}
+
+VFSImpl *SafeVFSSplit::CachedLookup(Path &p, IoStats **stats, uint32_t *root, uint64_t *generation)
+{
+	*generation = path_cache_.generation(p);
+	if(path_cache_.Find(p, root)) {
+		if(*root == VFSPathCache::kMissing)
+			return nullptr;
+		return Root(*root, p, stats);
+	}
+	return Lookup(p, stats, root);
+}
+
+void SafeVFSSplit::Remember(const Path &path, uint32_t root, bool found, VFSImpl *vfs, const Path &p, uint64_t generation)
+{
+	StatBuf st;
+	if(found)
+		path_cache_.Insert(path, root, generation);
+	else if(root != kNoRoot && Watched(path) && !vfs->Stat(p, &st))
+		path_cache_.Insert(path, VFSPathCache::kMissing, generation);
+}
+
+bool SafeVFSSplit::Watched(const Path &path)
+{
+	std::unique_lock<CriticalSection> l(watched_lock_);
+	for(auto &dir : watched_) {
+		if(path.starts_with(dir))
+			return true;
+	}
+	return false;
+}
+
+void SafeVFSSplit::AddWatchedDir(const Path &dir)
+{
+	auto aliases = Aliases(dir);
+	{
+		std::unique_lock<CriticalSection> l(watched_lock_);
+		for(auto &a : aliases) {
+			watched_.push_back(a);
+			if(watched_.back().empty() || watched_.back().back() != '/')
+				watched_.back().push_back('/');
+		}
 	}
+	// Lookups begun before the watch may have missed a file the watcher will never report
+	for(auto &a : aliases) path_cache_.InvalidateTree(a);
+}
 
-	for(auto &e : custom_) {
-		if(p.starts_with(std::string_view(e.prefix, e.len))) {
-			p = p.substr(e.len);
-			return e.vfs.get();
+void SafeVFSSplit::RemoveWatchedDir(const Path &dir)
+{
+	auto aliases = Aliases(dir);
+	{
+		std::unique_lock<CriticalSection> l(watched_lock_);
+		for(auto &a : aliases) {
+			if(a.empty() || a.back() != '/')
+				a.push_back('/');
+			auto it = std::find(watched_.begin(), watched_.end(), a);
+			if(it != watched_.end())
+				watched_.erase(it);
 		}
 	}
-	return null_vfs.get();
+	// What was cached as missing is no longer kept up to date
+	for(auto &a : aliases) path_cache_.InvalidateTree(a);
+}
+
+// The blob cache is keyed on this VFS and the full path rather than the root's VFS, so blobs read from
+// the old root would otherwise be served for the new one whenever size and mtime happen to match
+void SafeVFSSplit::SetData(std::shared_ptr<VFSImpl> vfs)
+{
+	data_vfs_ = vfs;
+	path_cache_.Clear();
+	blob_cache.Invalidate(this, "/data/");
+}
+void SafeVFSSplit::SetGame(std::shared_ptr<VFSImpl> vfs)
+{
+	game_vfs_ = vfs;
+	path_cache_.Clear();
+	blob_cache.Invalidate(this, "/game/");
+}
+void SafeVFSSplit::SetSave(std::shared_ptr<VFSImpl> vfs)
+{
+	save_vfs_ = vfs;
+	path_cache_.Clear();
+	blob_cache.Invalidate(this, "/save/");
+}
+void SafeVFSSplit::SetTemp(std::shared_ptr<VFSImpl> vfs)
+{
+	temp_vfs_ = vfs;
+	path_cache_.Clear();
+	blob_cache.Invalidate(this, "/temp/");
+}
+
+bool SafeVFSSplit::MountGamePack(const Path &name)
+{
+	auto f = data_vfs_->OpenFile(name, file_flags::kReadOnly | file_flags::kRandomAccess, OpenMode::OpenExisting);
+	if(!f)
+		return false;
+	auto pack = PackVFS::Mount(std::move(f));
+	if(!pack)
+		return false;
+	SetGame(std::move(pack));
+	return true;
+}
+
+void SafeVFSSplit::UseRamTemp(uint64_t budget)
+{
+	SetTemp(std::make_shared<RamVFS>(budget, temp_vfs_));
 }
 
 void SafeVFSSplit::Add(const char *prefix, std::shared_ptr<VFSImpl> vfs)
@@ -438,22 +1168,57 @@ void SafeVFSSplit::Add(const char *prefix, std::shared_ptr<VFSImpl> vfs)
 	strncpy_s(e.prefix, prefix, sizeof(e.prefix));
 	e.prefix[sizeof(e.prefix) - 1] = '\0';
 	e.vfs = std::move(vfs);
+	// Named like the built-in roots, without the trailing slash
+	std::string_view name(e.prefix, e.len);
+	if(name.size() > 1 && name.back() == '/')
+		name.remove_suffix(1);
+	e.stats = new IoStats(std::string(name));
+	path_cache_.Clear();
+	blob_cache.Invalidate(this, Path(e.prefix, e.len));
 }
 
 IoFilePtr VFSOverlay::OpenFile(const Path &path, uint32_t flags, OpenMode mode)
 {
-	for(auto &e : entries_) {
+	// Opens that may create a file take the first layer that lets them, as before, and aren't cached. Nor
+	// are writable opens, which may pass over a layer that has the file read-only
+	uint32_t where = VFSPathCache::kMissing;
+	if(mode == OpenMode::OpenExisting && cache_.Find(path, &where)) {
+		if(where == VFSPathCache::kMissing)
+			return nullptr;
+		if(where < entries_.size()) {
+			auto &e = entries_[where];
+			std::string s = e.root;
+			s.append(path);
+			if(auto f = e.impl->OpenFile(s, flags, mode))
+				return f;
+		}
+	}
+	uint64_t generation = cache_.generation(path);
+	for(uint32_t i = 0; i < entries_.size(); i++) {
+		auto &e = entries_[i];
 		std::string s = e.root;
 		s.append(path);
 		auto f = e.impl->OpenFile(s, flags, mode);
-		if(f)
+		if(f) {
+			if(mode != OpenMode::OpenExisting)
+				cache_.Invalidate(path);
+			else if(flags & file_flags::kReadOnly)
+				cache_.Insert(path, i, generation);
 			return f;
+		}
 	}
+	// Only a path no layer can stat is recorded as missing
+	StatBuf st;
+	if(mode == OpenMode::OpenExisting)
+		Stat(path, &st);
 	return nullptr;
 }
 
 IoDirPtr VFSOverlay::OpenDir(const Path &path)
 {
+	uint32_t where;
+	if(cache_.Find(path, &where) && where == VFSPathCache::kMissing)
+		return nullptr;
 	for(auto &e : entries_) {
 		std::string s = e.root;
 		s.append(path);
@@ -475,16 +1240,36 @@ bool VFSOverlay::Delete(const Path &path)
 
 bool VFSOverlay::Stat(const Path &path, StatBuf *buf)
 {
-	for(auto &e : entries_) {
+	uint32_t where = VFSPathCache::kMissing;
+	if(cache_.Find(path, &where)) {
+		if(where == VFSPathCache::kMissing)
+			return false;
+		if(where < entries_.size()) {
+			auto &e = entries_[where];
+			std::string s = e.root;
+			s.append(path);
+			if(e.impl->Stat(s, buf))
+				return true;
+		}
+	}
+	uint64_t generation = cache_.generation(path);
+	for(uint32_t i = 0; i < entries_.size(); i++) {
+		auto &e = entries_[i];
 		std::string s = e.root;
 		s.append(path);
-		if(e.impl->Stat(s, buf))
+		if(e.impl->Stat(s, buf)) {
+			cache_.Insert(path, i, generation);
 			return true;
+		}
 	}
+	cache_.Insert(path, VFSPathCache::kMissing, generation);
 	return false;
 }
 bool VFSOverlay::CheckAccess(const Path &path, uint32_t flags)
 {
+	uint32_t where;
+	if(cache_.Find(path, &where) && where == VFSPathCache::kMissing)
+		return false;
 	for(auto &e : entries_) {
 		std::string s = e.root;
 		s.append(path);
@@ -497,6 +1282,7 @@ bool VFSOverlay::CheckAccess(const Path &path, uint32_t flags)
 void VFSOverlay::Add(VFSImpl *impl, std::string root)
 {
 	entries_.emplace_back(Entry{impl, std::move(root)});
+	cache_.Clear();
 }
 
 } // namespace lune
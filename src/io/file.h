@@ -2,7 +2,9 @@
 
 #include "aio.h"
 #include "blob.h"
+#include "chain.h"
 #include "future.h"
+#include "path_cache.h"
 #include "refptr.h"
 #include "memory.h"
 
@@ -35,8 +37,22 @@ public:
 	virtual ~OutputStream() = default;
 
 	virtual void WriteAsync(IoBuffer *buffer) = 0;
+	// Writes the buffers back to back. Streams that can do so issue them as a single operation
+	virtual void WriteAsyncV(IoBuffer *const *buffers, int n)
+	{
+		for(int i = 0; i < n; i++) WriteAsync(buffers[i]);
+	}
+	// Writes the chain's bytes. Streams that can do so write straight from its segments
+	virtual void WriteChain(const IoChain &chain);
 	virtual void Write(const void *data, uint32_t size) = 0;
 	virtual void Flush() = 0;
+	// Like Flush, but gives up waiting for the data to be written after timeout_us. Returns false if it
+	// did. For callers that must not hang, such as a fatal error on a thread completions need
+	virtual bool FlushFor(uint64_t timeout_us)
+	{
+		Flush();
+		return true;
+	}
 
 	void Write(const std::string &s) { Write(s.data(), (uint32_t)s.size()); }
 	void Write(const std::string_view &s) { Write(s.data(), (uint32_t)s.size()); }
@@ -59,6 +75,20 @@ public:
 	}
 };
 
+// Collects what is written to it at the end of a chain. Chains written to it are shared, not copied
+class ChainOutputStream : public SyncOutputStream
+{
+public:
+	explicit ChainOutputStream(IoChain *chain) : chain_(chain) {}
+
+	void WriteChain(const IoChain &chain) override;
+	void Write(const void *data, uint32_t size) override;
+	void Flush() override {}
+
+private:
+	IoChain *chain_;
+};
+
 class StdioOutputStream : public SyncOutputStream
 {
 public:
@@ -121,6 +151,10 @@ public:
 
 	virtual bool Sync() { return false; }
 
+	// Identifies the volume the file lives on, so that requests to one device can be scheduled together.
+	// 0 if unknown
+	virtual uint64_t GetDeviceId() const { return 0; }
+
 	virtual void Truncate(uint64_t bytes = 0) = 0;
 
 	// Size = 0 means map the entire file.
@@ -155,22 +189,35 @@ public:
 	IoROSubsetFile(IoFile *f, uint64_t start, uint64_t size) : f_(f), start_(start), size_(size) {}
 
 	uint64_t GetFileSize() const { return size_; }
+	uint64_t GetDeviceId() const override { return f_->GetDeviceId(); }
 	void BeginRead(AsyncOp *op)
 	{
-		op->offset += start_;
+		if(op->offset >= size_) {
+			op->CompleteErr(io_err::kEOF);
+			return;
+		}
+		// Clamp the segments to what remains of the subset, dropping any that lie wholly past its end
+		uint64_t avail = size_ - op->offset;
 		uint64_t total = 0;
-		for(int i = 0; i < op->nsg; i++) {
-			if(total + op->sg[i].len > size_) {
-				op->sg[i].len = (BufLen)(size_ - total);
-			}
-			total += op->sg[i].len;
+		int n = 0;
+		while(n < op->nsg && total < avail) {
+			if(op->sg[n].len > avail - total)
+				op->sg[n].len = (BufLen)(avail - total);
+			total += op->sg[n].len;
+			n++;
 		}
+		op->nsg = n;
+		op->offset += start_;
 		f_->BeginRead(op);
 	}
 
 	std::unique_ptr<ShmRegion> MapRegion(void *addr, uint64_t offset, uint64_t size, bool ro) override
 	{
-		return f_->MapRegion(addr, offset + start_, std::min(size, size_), ro);
+		if(offset > size_)
+			return nullptr;
+		// Size 0 maps the rest of the subset, not the rest of the underlying file
+		uint64_t avail = size_ - offset;
+		return f_->MapRegion(addr, offset + start_, size ? std::min(size, avail) : avail, ro);
 	}
 
 private:
@@ -179,6 +226,20 @@ private:
 	uint64_t size_;
 };
 
+// A read-only file over the contents of a resolved blob. Reads complete inline
+class IoBlobFile : public IoROFile
+{
+public:
+	explicit IoBlobFile(Blob *b) : blob_(b) {}
+
+	uint64_t GetFileSize() const override { return blob_->GetSize(); }
+	void BeginRead(AsyncOp *op) override;
+	std::unique_ptr<ShmRegion> MapRegion(void *addr, uint64_t offset, uint64_t size, bool ro) override;
+
+private:
+	RefPtr<Blob> blob_;
+};
+
 struct FileInfo
 {
 	const char *filename;
@@ -186,6 +247,10 @@ struct FileInfo
 	uint32_t flags;
 };
 
+// Matches a name against an IoDir::EnumerateFiles query. Queries follow FindFirstFile: '*' matches any
+// run of characters and '?' any single one. An empty query matches everything
+bool MatchFileQuery(const char *query, const char *name);
+
 class IoDir : public Refcounted
 {
 public:
@@ -255,6 +320,10 @@ public:
 	size_t ReadAbs(void *p, size_t n, uint64_t offset);
 	size_t WriteAbs(const void *p, size_t n, uint64_t offset);
 
+	// Vectored forms. The segments are filled/written back to back starting at offset
+	size_t ReadAbsV(const SGBuf *sg, int nsg, uint64_t offset);
+	size_t WriteAbsV(const SGBuf *sg, int nsg, uint64_t offset);
+
 	bool Append(const void *p, size_t n);
 
 	bool Write(const std::string_view &buf) { return Write(buf.data(), buf.size()) == buf.size(); }
@@ -266,14 +335,17 @@ public:
 	std::unique_ptr<OutputStream> CreateOutputStream();
 
 	// Starts an asynchronous read to a blob. The file object can be destroyed before this read completes.
-	RefPtr<Blob> ReadToFutureBlob(uint64_t offset = 0, uint64_t size = 0);
+	// If cancel is provided and cancelled before the read completes, the blob resolves as errored.
+	RefPtr<Blob> ReadToFutureBlob(uint64_t offset = 0, uint64_t size = 0, CancellationToken *cancel = nullptr);
 	// Functionally equivalent to ReadToFutureBlob and then waiting for the read to finish
 	RefPtr<Blob> ReadToImmediateBlob(uint64_t offset = 0, uint64_t size = 0);
+	// Like ReadToFutureBlob, into an unresolved blob the caller allocated. Reads as many bytes as it holds
+	void ReadIntoBlob(Blob *b, uint64_t offset = 0, CancellationToken *cancel = nullptr);
 
 	RefPtr<Blob> MapToBlob(uint64_t offset = 0, uint64_t size = 0, bool ro = true);
 
 private:
-	RefPtr<Blob> AllocForBlobRead(AsyncOp **op, uint64_t size);
+	static AsyncOp *AllocForBlobRead(Blob *b);
 
 	IoFilePtr file_;
 
@@ -282,23 +354,76 @@ private:
 };
 typedef std::unique_ptr<File> FilePtr;
 
+// Appends to a file behind the caller's back. Write copies into a staging buffer; a full buffer is
+// queued while the next one fills. Queued data goes out as one vectored op at a time, which keeps
+// appends in order and coalesces everything that queued up while the previous op was in flight.
+// Staged data is also sent once it is max_delay microseconds old. Producers block only while more
+// than max_pending bytes are staged, queued or in flight.
+// A write that fails or comes up short stops the stream: what is queued is dropped, later writes are
+// ignored, and error() reports why.
 class FileOutputStream : public OutputStream
 {
 public:
-	FileOutputStream(IoFile *f);
+	static constexpr uint32_t kDefaultStagingSize = 64 * 1024;
+	static constexpr uint32_t kDefaultMaxPending = 1 << 20;
+	static constexpr uint64_t kDefaultMaxDelay = 50000;
+
+	FileOutputStream(IoFile *f, uint32_t staging_size = kDefaultStagingSize,
+	    uint32_t max_pending = kDefaultMaxPending, uint64_t max_delay = kDefaultMaxDelay);
+	// Waits for everything written to reach the file
 	~FileOutputStream();
 
 	void WriteAsync(IoBuffer *buffer) override;
+	void WriteAsyncV(IoBuffer *const *buffers, int n) override;
+	void WriteChain(const IoChain &chain) override;
 	void Write(const void *data, uint32_t size) override;
+	// Sends anything staged, waits for it to be written and flushes the file. Check error() afterwards to
+	// know that it all arrived
 	void Flush() override;
+	bool FlushFor(uint64_t timeout_us) override;
+
+	// The io_err of the first write that failed or came up short, or 0
+	int32_t error();
+
+	// Sends staged data that has waited too long. Returns when what is still staged will have, or
+	// UINT64_MAX if nothing is
+	uint64_t FlushIfStale(uint64_t now);
 
 private:
+	void Enqueue(const IoChain &chain);
+	void WaitForRoom(std::unique_lock<CriticalSection> &l, uint64_t n);
+	void SealLocked();
+	AsyncOp *NextOpLocked();
+	// Seals the staging buffer and starts writing, if nothing is being written
+	void SendLocked(std::unique_lock<CriticalSection> &l);
+	void Drain();
+	static void OnWritten(void *ctx, AsyncOp *op);
+
 	IoFilePtr file_;
+	uint32_t staging_size_;
+	uint32_t max_pending_;
+	uint64_t max_delay_;
+
+	CriticalSection lock_;
+	CondVar cv_;
+	RefPtr<IoBuffer> staging_;
+	uint64_t staged_since_ = 0;
+	IoChain queued_;
+	bool writing_ = false;
+	// Staged, queued and in flight
+	uint64_t pending_ = 0;
+	int32_t err_ = 0;
 };
 
 namespace file_flags {
 static constexpr uint32_t kReadOnly = 1;
 static constexpr uint32_t kAppendOnly = 2;
+// Access pattern hints. Backends pass these on to the OS cache and to mappings of the file
+static constexpr uint32_t kSequential = 4;
+static constexpr uint32_t kRandomAccess = 8;
+// Bypass the OS cache, for streaming large files that would otherwise evict useful data. Reads of any
+// alignment are accepted; writes must be aligned to kDirectIoAlignment (see direct_io.h)
+static constexpr uint32_t kDirectIo = 16;
 
 static constexpr uint32_t kIsFile = 1U << 31;
 static constexpr uint32_t kIsDir = 1U << 30;
@@ -308,6 +433,24 @@ struct StatBuf
 {
 	uint64_t size;
 	uint32_t flags;
+	// Changes whenever the file does. The unit depends on the VFS, so only compare it for equality. 0 if
+	// the VFS doesn't track it
+	uint64_t mtime = 0;
+};
+
+// One entry of a batched stat. ok is false if the path could not be stat'd
+struct StatResult
+{
+	bool ok;
+	StatBuf stat;
+};
+
+// A directory entry that outlives the enumeration that produced it
+struct DirEntry
+{
+	std::string name;
+	uint64_t size;
+	uint32_t flags;
 };
 
 class VFSImpl
@@ -326,6 +469,13 @@ public:
 	virtual bool CheckAccess(const Path &path, uint32_t flags) = 0;
 
 	virtual uint64_t GetFreeBytesForWriting(const Path &path) = 0;
+
+	// The OS path behind path, for things like file watching that have to go to the OS. False if path
+	// isn't backed by a file on disk
+	virtual bool GetOsPath(const Path &path, std::string *out)
+	{
+		return false;
+	}
 };
 
 class NullVFSImpl : public VFSImpl
@@ -381,6 +531,8 @@ public:
 
 	uint64_t GetFreeBytesForWriting(const Path &path) override;
 
+	bool GetOsPath(const Path &path, std::string *out) override;
+
 private:
 	bool CheckPath(const Path &p) const;
 
@@ -388,7 +540,9 @@ private:
 	std::string root_path_;
 };
 
-// An overlay VFS allows multiple possible VFSes to serve a file
+// An overlay VFS allows multiple possible VFSes to serve a file. Which layer served a path, and paths that
+// no layer has, are cached; call InvalidatePath (or InvalidateTree for a directory) if a layer changes
+// behind the overlay's back
 class VFSOverlay : public VFSImpl
 {
 public:
@@ -405,6 +559,10 @@ public:
 
 	void Add(VFSImpl *impl, std::string root);
 
+	void InvalidatePath(const Path &path) { cache_.Invalidate(path); }
+	void InvalidateTree(const Path &path) { cache_.InvalidateTree(path); }
+	const VFSPathCache &path_cache() const { return cache_; }
+
 private:
 	struct Entry
 	{
@@ -412,6 +570,7 @@ private:
 		std::string root;
 	};
 	std::vector<Entry> entries_;
+	VFSPathCache cache_;
 };
 
 class VFS
@@ -428,6 +587,18 @@ public:
 	bool Stat(const Path &path, StatBuf *buf);
 	bool CheckAccess(const Path &path, uint32_t flags);
 
+	// Non-blocking versions of the above, run on the I/O pool so that a slow disk never stalls the caller.
+	// Each resolves null where its blocking counterpart fails, except CheckAccessAsync, which always
+	// resolves to whether access is allowed
+	Future<IoFilePtr> OpenFileAsync(const Path &path, uint32_t flags, OpenMode mode = OpenMode::OpenExisting);
+	Future<StatBuf> StatAsync(const Path &path);
+	Future<bool> CheckAccessAsync(const Path &path, uint32_t flags);
+	// Stats every path in a single task. Results are in the order of paths
+	Future<std::vector<StatResult>> StatManyAsync(std::vector<std::string> paths);
+	Future<IoDirPtr> OpenDirAsync(const Path &path);
+	// Opens and enumerates a directory in a single task
+	Future<std::vector<DirEntry>> EnumerateAsync(const Path &path, std::string query = std::string());
+
 private:
 	VFSImpl *impl_;
 };
@@ -446,6 +617,10 @@ public:
 		std::string data_dir;
 		std::string app_name;
 		bool add_lune_subdir = true;
+		// A pack file in the data directory that, if present, serves /game
+		std::string game_pack = "game.pak";
+		// If set, /temp is held in memory up to this many bytes, spilling to the temp directory beyond it
+		uint64_t temp_ram_budget = 0;
 	};
 	static bool PreInitialize(const Options& options);
 	static bool Initialize(const Options &options);
@@ -456,26 +631,20 @@ public:
 	// This is a writable, persistent location suitable for storing things like save files
 	VFSImpl *SaveDir() { return save_vfs_.get(); }
 	// This is a writable, nonpersistent, temporary location
-	VFSImpl *TempDir() { return &temp_vfs_; }
+	VFSImpl *TempDir() { return temp_vfs_.get(); }
 	// This is a readonly, persistent location containing game data
 	VFSImpl *DataDir() { return data_vfs_.get(); }
 	// This is a readonly, persistent location containing possible baked game data
 	VFSImpl *GameDir() { return game_vfs_.get(); }
 
-	// Dont ever set these to NULL, use null_vfs instead
-	void SetData(std::shared_ptr<VFSImpl> vfs)
-	{
-		data_vfs_ = vfs;
-	}
-	void SetGame(std::shared_ptr<VFSImpl> vfs)
-	{
-		game_vfs_ = vfs;
-	}
+	// Dont ever set these to NULL, use null_vfs instead. Cached paths and blobs under the root are dropped
+	void SetData(std::shared_ptr<VFSImpl> vfs);
+	void SetGame(std::shared_ptr<VFSImpl> vfs);
 
-	void SetSave(std::shared_ptr<VFSImpl> vfs)
-	{
-		save_vfs_ = vfs;
-	}
+	void SetSave(std::shared_ptr<VFSImpl> vfs);
+	void SetTemp(std::shared_ptr<VFSImpl> vfs);
+	// Holds /temp in memory (see RamVFS), spilling to the current temp VFS once over budget
+	void UseRamTemp(uint64_t budget);
 
 	IoFilePtr OpenFile(const Path &path, uint32_t flags, OpenMode mode) override;
 	IoDirPtr OpenDir(const Path &path) override;
@@ -488,23 +657,72 @@ public:
 
 	uint64_t GetFreeBytesForWriting(const Path &path) override;
 
+	bool GetOsPath(const Path &path, std::string *out) override;
+
 	void Add(const char *prefix, std::shared_ptr<VFSImpl> vfs);
 
+	// Serves /game from a pack file in the data directory. Returns false, leaving /game as it was, if there
+	// is no valid pack there
+	bool MountGamePack(const Path &name);
+
+	// Paths known not to exist are cached, and forgotten when they are written through this VFS or the
+	// roots change. Changes made behind its back must be reported here: InvalidatePath for a file, or
+	// InvalidateTree for a directory and everything beneath it
+	void InvalidatePath(const Path &path) { path_cache_.Invalidate(path); }
+	void InvalidateTree(const Path &path) { path_cache_.InvalidateTree(path); }
+	const VFSPathCache &path_cache() const { return path_cache_; }
+
+	// path under every root served by the same VFS as the one it is under, path itself included. By
+	// default /game is /data, so a change to one is a change to both
+	std::vector<std::string> Aliases(const Path &path);
+
+	// Missing paths are only cached beneath directories that a FileWatcher reports changes in, under any
+	// of their aliases. Anywhere else a file can appear from outside the engine with nothing to say so
+	void AddWatchedDir(const Path &dir);
+	void RemoveWatchedDir(const Path &dir);
+
 private:
-	VFSImpl *Lookup(Path &p);
+	// Roots are numbered for the path cache: /game, /data, /save and /temp, then the custom ones in order
+	static constexpr uint32_t kNoRoot = VFSPathCache::kMissing - 1;
+
+	// Also returns the I/O stats of the root p is under, if stats is given, and its number, if root is
+	VFSImpl *Lookup(Path &p, IoStats **stats = nullptr, uint32_t *root = nullptr);
+	// Strips the prefix of a numbered root from p
+	VFSImpl *Root(uint32_t root, Path &p, IoStats **stats);
+	Path RootPrefix(uint32_t root) const;
+	// Lookup, skipping the prefix matching for cached paths. Returns null for paths known not to exist
+	VFSImpl *CachedLookup(Path &p, IoStats **stats, uint32_t *root, uint64_t *generation);
+	// Records how a lookup that started at generation went. A path is only recorded as missing once a stat
+	// confirms it, so a file that exists but failed to open is never taken for a missing one
+	void Remember(const Path &path, uint32_t root, bool found, VFSImpl *vfs, const Path &p, uint64_t generation);
+	// Whether path is beneath a watched directory, so that it may be cached as missing
+	bool Watched(const Path &path);
 
 	std::shared_ptr<VFSImpl> data_vfs_;
 	std::shared_ptr<VFSImpl> game_vfs_;
 	std::shared_ptr<VFSImpl> save_vfs_;
-	SafeVFSImpl temp_vfs_;
+	std::shared_ptr<VFSImpl> temp_vfs_;
+
+	// Every file opened under a root counts toward that root's stats
+	RefPtr<IoStats> data_stats_;
+	RefPtr<IoStats> game_stats_;
+	RefPtr<IoStats> save_stats_;
+	RefPtr<IoStats> temp_stats_;
 
 	struct Entry
 	{
 		char prefix[16];
 		size_t len;
 		std::shared_ptr<VFSImpl> vfs;
+		RefPtr<IoStats> stats;
 	};
 	std::vector<Entry> custom_;
+
+	VFSPathCache path_cache_;
+
+	CriticalSection watched_lock_;
+	// VFS paths ending in '/'. A directory watched more than once is listed more than once
+	std::vector<std::string> watched_;
 };
 
 // This access system disk from the current path
@@ -518,4 +736,8 @@ extern SafeVFSSplit *safe_vfs_impl;
 
 extern std::shared_ptr<VFSImpl> null_vfs;
 
+// Stops threads the OS backend started for itself, once every op issued to them has completed. OS files
+// stay usable, through whatever slower path the backend has left
+void ShutdownOsIo();
+
 } // namespace lune
@@ -0,0 +1,560 @@
+#include "direct_io.h"
+#include "file.h"
+#include "uring_linux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <deque>
+
+namespace lune {
+
+namespace {
+size_t GetSysMapSize()
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+} // namespace
+size_t kSystemMappingSizeMask = ~(GetSysMapSize() - 1);
+size_t kSystemMappingSize = GetSysMapSize();
+
+namespace {
+int OpenModeToFlags(OpenMode mode)
+{
+	switch(mode) {
+	case OpenMode::OpenExisting:
+		return 0;
+	case OpenMode::CreateIfNotExist:
+		return O_CREAT | O_EXCL;
+	case OpenMode::CreateOrTruncate:
+		return O_CREAT | O_TRUNC;
+	case OpenMode::OpenOrCreate:
+		return O_CREAT;
+	case OpenMode::TruncateExisting:
+		return O_TRUNC;
+	}
+	return 0;
+}
+
+class LinuxSHM : public ShmRegion
+{
+public:
+	// base/len describe the whole page-aligned mapping, which may start before the requested offset
+	LinuxSHM(void *base, size_t len, size_t delta, size_t s, uint64_t o) : base(base), len(len)
+	{
+		ptr = base ? (uint8_t *)base + delta : nullptr;
+		size = s;
+		offset = o;
+	}
+	~LinuxSHM()
+	{
+		if(base)
+			munmap(base, len);
+	}
+
+private:
+	void *base;
+	size_t len;
+};
+
+// Runs ops with blocking preadv/pwritev when io_uring is not available
+class PreadPool
+{
+public:
+	static constexpr uint32_t kThreads = 4;
+
+	static PreadPool *Get()
+	{
+		static PreadPool *pool = new PreadPool();
+		return pool;
+	}
+
+	void Submit(AsyncOp *op, int fd, bool write)
+	{
+		{
+			std::unique_lock<CriticalSection> l(lock_);
+			queue_.push_back(Entry{op, fd, write});
+		}
+		cv_.notify_one();
+	}
+
+private:
+	struct Entry
+	{
+		AsyncOp *op;
+		int fd;
+		bool write;
+	};
+
+	PreadPool()
+	{
+		for(uint32_t i = 0; i < kThreads; i++)
+			threads_.emplace_back(OsThread::CreateRawThread(std::bind(&PreadPool::ThreadMain, this), "PreadPool", ThreadType::IO));
+	}
+
+	void ThreadMain()
+	{
+		while(true) {
+			Entry e;
+			{
+				std::unique_lock<CriticalSection> l(lock_);
+				while(queue_.empty()) cv_.wait(l);
+				e = queue_.front();
+				queue_.pop_front();
+			}
+			Run(e);
+		}
+	}
+
+	static void Run(const Entry &e)
+	{
+		AsyncOp *op = e.op;
+		// Ops cancelled while queued are never started
+		if(op->cancel && op->cancel->IsCancelled()) {
+			// Counted as avoided like CompleteIfCancelled does, rather than as aborted on completion
+			cancel_stats::Avoided();
+			op->cancel = nullptr;
+			op->err = io_err::kCancelled;
+			op->transferred = 0;
+			op->op(op);
+			return;
+		}
+		static_assert(sizeof(SGBuf) == sizeof(iovec), "SGBuf must match iovec");
+		const iovec *iov = (const iovec *)op->sg;
+		ssize_t ret;
+		do {
+			if(!e.write)
+				ret = preadv(e.fd, iov, op->nsg, (off_t)op->offset);
+			else if(op->offset == kAppendOffset)
+				ret = writev(e.fd, iov, op->nsg);
+			else
+				ret = pwritev(e.fd, iov, op->nsg, (off_t)op->offset);
+		} while(ret < 0 && errno == EINTR);
+
+		if(ret < 0) {
+			op->err = ErrnoIoErr(errno);
+			op->transferred = 0;
+		} else if(ret == 0 && !e.write && op->nsg > 0 && op->sg[0].len > 0) {
+			op->err = io_err::kEOF;
+			op->transferred = 0;
+		} else {
+			op->err = 0;
+			op->transferred = (uint32_t)ret;
+		}
+		op->op(op);
+	}
+
+	CriticalSection lock_;
+	CondVar cv_;
+	std::deque<Entry> queue_;
+	std::vector<std::shared_ptr<OsThread>> threads_;
+};
+
+class LinuxFile : public IoFile
+{
+public:
+	LinuxFile(int fd, bool writable, uint32_t flags) : fd_(fd), writable_(writable), flags_(flags), ring_(IoUring::Get())
+	{
+		slot_ = ring_ ? ring_->RegisterFile(fd) : -1;
+		if(flags & file_flags::kSequential)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		else if(flags & file_flags::kRandomAccess)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+	}
+	~LinuxFile()
+	{
+		if(ring_)
+			ring_->UnregisterFile(slot_);
+		if(append_fd_ >= 0)
+			close(append_fd_);
+		close(fd_);
+	}
+
+	void BeginRead(AsyncOp *op) override
+	{
+		if(op->CompleteIfCancelled())
+			return;
+		AddRef();
+		op->op = &AsyncOp::CompleteOp;
+		op->unref = this;
+		if(!ring_ || !ring_->Read(op, fd_, slot_))
+			PreadPool::Get()->Submit(op, fd_, false);
+	}
+	void BeginWrite(AsyncOp *op) override
+	{
+		if(op->CompleteIfCancelled())
+			return;
+		if(!writable_) {
+			op->CompleteErr(ErrnoIoErr(EBADF));
+			return;
+		}
+		// Without O_APPEND the kernel writes appends at the descriptor's position rather than the end, so
+		// they go through a descriptor that has it. Then the kernel finds the end as each is written, and
+		// appends from several streams or handles interleave rather than overwrite, as on Windows
+		int fd = fd_, slot = slot_;
+		if(op->offset == kAppendOffset && !(flags_ & file_flags::kAppendOnly)) {
+			fd = AppendFd();
+			slot = -1;
+			if(fd < 0) {
+				// Only without /proc. The end found here is only right while appends don't overlap
+				fd = fd_;
+				slot = slot_;
+				op->offset = GetFileSize();
+			}
+		}
+		AddRef();
+		op->op = &AsyncOp::CompleteOp;
+		op->unref = this;
+		if(!ring_ || !ring_->Write(op, fd, slot))
+			PreadPool::Get()->Submit(op, fd, true);
+	}
+
+	void Flush() override { fsync(fd_); }
+
+	bool Sync() override { return fdatasync(fd_) == 0; }
+
+	bool AllowWrites() const override { return writable_; }
+
+	uint64_t GetFileSize() const override
+	{
+		struct stat st;
+		if(fstat(fd_, &st) < 0)
+			return 0;
+		return (uint64_t)st.st_size;
+	}
+
+	uint64_t GetDeviceId() const override
+	{
+		struct stat st;
+		if(fstat(fd_, &st) < 0)
+			return 0;
+		return (uint64_t)st.st_dev + 1;
+	}
+
+	std::unique_ptr<ShmRegion> MapRegion(void *addr, uint64_t offset, uint64_t size, bool ro) override
+	{
+		if(!size) {
+			size = GetFileSize();
+			if(size <= offset) {
+				// It's not actually an error to map an empty file
+				return std::make_unique<LinuxSHM>(nullptr, 0, 0, 0, offset);
+			}
+			size -= offset;
+		}
+		// mmap offsets must be page aligned. Map from the page containing offset and hand back a
+		// pointer into it, unless the caller asked for a fixed address, which must line up itself
+		size_t delta = (size_t)(offset & ~(uint64_t)kSystemMappingSizeMask);
+		if(addr && delta)
+			return nullptr;
+		uint64_t base_offset = offset - delta;
+		size_t len = (size_t)size + delta;
+
+		bool wr = (writable_ & !ro);
+		int prot = wr ? PROT_READ | PROT_WRITE : PROT_READ;
+		void *p = mmap(addr, len, prot, addr ? MAP_SHARED | MAP_FIXED_NOREPLACE : MAP_SHARED, fd_, (off_t)base_offset);
+		if(p == MAP_FAILED)
+			return nullptr;
+		if(flags_ & file_flags::kSequential) {
+			madvise(p, len, MADV_SEQUENTIAL);
+			madvise(p, len, MADV_WILLNEED);
+		} else if(flags_ & file_flags::kRandomAccess)
+			madvise(p, len, MADV_RANDOM);
+		return std::make_unique<LinuxSHM>(p, len, delta, (size_t)size, offset);
+	}
+
+	void Truncate(uint64_t bytes) override
+	{
+		if(ftruncate(fd_, (off_t)bytes) < 0)
+			LUNE_BP();
+	}
+
+private:
+	// Reopens the file with O_APPEND on first use, keeping O_DIRECT if fd_ has it. -1 if that fails
+	int AppendFd()
+	{
+		std::unique_lock<CriticalSection> l(append_lock_);
+		if(append_fd_ == -2) {
+			char name[32];
+			snprintf(name, sizeof(name), "/proc/self/fd/%d", fd_);
+			int fl = fcntl(fd_, F_GETFL);
+			append_fd_ = open(name, O_WRONLY | O_APPEND | O_CLOEXEC | (fl >= 0 ? fl & O_DIRECT : 0));
+			if(append_fd_ < 0)
+				append_fd_ = -1;
+		}
+		return append_fd_;
+	}
+
+	int fd_;
+	int slot_;
+	bool writable_;
+	uint32_t flags_;
+	IoUring *ring_;
+
+	CriticalSection append_lock_;
+	// -2 until AppendFd first runs
+	int append_fd_ = -2;
+};
+
+class LinuxDir : public IoDir
+{
+public:
+	LinuxDir(const Path &path) : path_(path) {}
+
+	bool EnumerateFiles(const char *query, std::function<bool(const FileInfo &)> fn) override
+	{
+		int dfd = open(path_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(dfd < 0)
+			return false;
+		// Same layout as the kernel's linux_dirent64
+		struct Dirent64
+		{
+			uint64_t d_ino;
+			int64_t d_off;
+			unsigned short d_reclen;
+			unsigned char d_type;
+			char d_name[1];
+		};
+		alignas(8) char buf[8192];
+		FileInfo fi;
+		bool stop = false;
+		while(!stop) {
+			long n = syscall(SYS_getdents64, dfd, buf, sizeof(buf));
+			if(n <= 0)
+				break;
+			for(long pos = 0; pos < n && !stop;) {
+				auto e = (Dirent64 *)(buf + pos);
+				pos += e->d_reclen;
+				const char *name = e->d_name;
+				if(name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+					continue;
+				if(!MatchFileQuery(query, name))
+					continue;
+				struct stat st;
+				if(fstatat(dfd, name, &st, 0) < 0)
+					continue;
+				fi.filename = name;
+				fi.size = (uint64_t)st.st_size;
+				fi.flags = S_ISDIR(st.st_mode) ? file_flags::kIsDir : file_flags::kIsFile;
+				if(faccessat(dfd, name, W_OK, 0) < 0)
+					fi.flags |= file_flags::kReadOnly;
+				stop = !fn(fi);
+			}
+		}
+		close(dfd);
+		return true;
+	}
+
+	RefPtr<IoDir> OpenSubdir(const Path &path) override;
+	RefPtr<IoFile> OpenFile(const Path &path, uint32_t flags, OpenMode mode) override;
+
+	std::string path_;
+};
+
+class LinuxVFS : public VFSImpl
+{
+public:
+	LinuxVFS() {}
+	IoFilePtr OpenFile(const Path &path, uint32_t flags, OpenMode mode) override
+	{
+		bool writable = !(flags & file_flags::kReadOnly);
+		int oflags = O_CLOEXEC | OpenModeToFlags(mode);
+		oflags |= writable ? O_RDWR : O_RDONLY;
+		if(flags & file_flags::kAppendOnly)
+			oflags |= O_APPEND;
+
+		std::string s(path);
+		bool direct = !!(flags & file_flags::kDirectIo);
+		int fd = open(s.c_str(), oflags | (direct ? O_DIRECT : 0), 0644);
+		if(fd < 0 && direct && errno == EINVAL) {
+			// Some filesystems (tmpfs, some FUSE mounts) refuse O_DIRECT. Cached I/O is still correct
+			direct = false;
+			fd = open(s.c_str(), oflags, 0644);
+		}
+		if(fd < 0)
+			return nullptr;
+		IoFilePtr f = new LinuxFile(fd, writable, flags);
+		if(direct)
+			return new details::DirectIoFile(std::move(f));
+		return f;
+	}
+	IoDirPtr OpenDir(const Path &path) override
+	{
+		std::string s(path);
+		struct stat st;
+		if(stat(s.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+			return nullptr;
+		return new LinuxDir(path);
+	}
+	bool Delete(const Path &path) override
+	{
+		std::string s(path);
+		return unlink(s.c_str()) == 0;
+	}
+
+	bool CreateDirectory(const Path &path) override
+	{
+		std::string s(path);
+		return mkdir(s.c_str(), 0755) == 0;
+	}
+
+	bool Stat(const Path &path, StatBuf *buf) override
+	{
+		std::string s(path);
+		struct stat st;
+		if(stat(s.c_str(), &st) < 0)
+			return false;
+		buf->size = (uint64_t)st.st_size;
+		buf->flags = S_ISDIR(st.st_mode) ? file_flags::kIsDir : file_flags::kIsFile;
+		buf->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + (uint64_t)st.st_mtim.tv_nsec;
+		if(access(s.c_str(), W_OK) < 0)
+			buf->flags |= file_flags::kReadOnly;
+		return true;
+	}
+	bool CheckAccess(const Path &path, uint32_t flags) override
+	{
+		std::string s(path);
+		return access(s.c_str(), (flags & file_flags::kReadOnly) ? R_OK : R_OK | W_OK) == 0;
+	}
+	uint64_t GetFreeBytesForWriting(const Path &path) override
+	{
+		std::string s(path);
+		struct statvfs sv;
+		if(statvfs(s.c_str(), &sv) < 0)
+			return 0;
+		return (uint64_t)sv.f_bavail * sv.f_frsize;
+	}
+};
+LinuxVFS *linuxvfs;
+
+RefPtr<IoDir> LinuxDir::OpenSubdir(const Path &path)
+{
+	if(!path.empty() && path[0] == '/')
+		return nullptr;
+	std::string p = path_;
+	if(p.back() != '/')
+		p.push_back('/');
+	p.append(path);
+	return linuxvfs->OpenDir(p);
+}
+
+RefPtr<IoFile> LinuxDir::OpenFile(const Path &path, uint32_t flags, OpenMode mode)
+{
+	if(!path.empty() && path[0] == '/')
+		return nullptr;
+	std::string p = path_;
+	if(p.back() != '/')
+		p.push_back('/');
+	p.append(path);
+	return linuxvfs->OpenFile(p, flags, mode);
+}
+
+} // namespace
+
+VFSImpl *VFSImpl::GetOsVfs()
+{
+	if(!linuxvfs)
+		linuxvfs = new LinuxVFS();
+	return linuxvfs;
+}
+
+void ShutdownOsIo()
+{
+	// Files go on working through the preadv pool, so late writes such as the log's still land. Its
+	// threads only ever wait on its queue, so they are left to process exit
+	IoUring::Shutdown();
+}
+
+namespace {
+
+void MaybeInitSaveDir(std::string &out_path, const char *in_path)
+{
+	if(mkdir(in_path, 0755) < 0 && errno != EEXIST)
+		return;
+	if(access(in_path, W_OK) < 0)
+		return;
+	out_path = in_path;
+}
+
+} // namespace
+
+bool SafeVFSSplit::PreInitialize(const Options &options)
+{
+	std::string app_path;
+	std::string data_path;
+	std::string temp_path;
+
+	char buf[4096];
+	if(!getcwd(buf, sizeof(buf)))
+		return false;
+	app_path = buf;
+
+	data_path = app_path;
+	if(!options.data_dir.empty()) {
+		data_path.push_back('/');
+		data_path.append(options.data_dir);
+	}
+
+	const char *tmp = getenv("TMPDIR");
+	temp_path = tmp && *tmp ? tmp : "/tmp";
+	if(temp_path.back() != '/')
+		temp_path.push_back('/');
+
+	if(safe_vfs_impl)
+		delete safe_vfs_impl;
+	safe_vfs_impl = new SafeVFSSplit(VFSImpl::GetOsVfs(), temp_path, data_path);
+	safe_vfs = VFS(safe_vfs_impl);
+	if(!options.game_pack.empty())
+		safe_vfs_impl->MountGamePack(options.game_pack);
+
+	return true;
+}
+
+bool SafeVFSSplit::Initialize(const Options &options)
+{
+	std::string save_path;
+	if(!options.use_writable_app_dir_if_possible.empty()) {
+		MaybeInitSaveDir(save_path, options.use_writable_app_dir_if_possible.c_str());
+	}
+
+	if(save_path.empty() && !options.app_name.empty()) {
+		// XDG base directory spec, falling back to ~/.local/share
+		const char *xdg = getenv("XDG_DATA_HOME");
+		const char *home = getenv("HOME");
+		if(xdg && *xdg) {
+			save_path = xdg;
+		} else if(home && *home) {
+			save_path = home;
+			save_path.append("/.local/share");
+		} else {
+			return false;
+		}
+
+		save_path.push_back('/');
+		if(!options.add_lune_subdir) {
+			save_path.append("Lune/");
+			if(mkdir(save_path.c_str(), 0755) < 0 && errno != EEXIST)
+				return false;
+		}
+		save_path.append(options.app_name);
+		if(mkdir(save_path.c_str(), 0755) < 0 && errno != EEXIST)
+			return false;
+		save_path.push_back('/');
+	}
+
+	if(!save_path.empty())
+		safe_vfs_impl->SetSave(std::make_shared<SafeVFSImpl>(VFSImpl::GetOsVfs(), save_path));
+	if(options.temp_ram_budget)
+		safe_vfs_impl->UseRamTemp(options.temp_ram_budget);
+
+	return true;
+}
+
+} // namespace lune
@@ -1,3 +1,4 @@
+#include "direct_io.h"
 #include "file.h"
 
 #include <Windows.h>
@@ -73,40 +74,11 @@ public:
 
 	void BeginRead(AsyncOp *op) override
 	{
-		AddRef();
-		op->op = &AsyncOp::CompleteOp;
-		op->unref = this;
-		assert(op->nsg == 1);
-
-		OVERLAPPED *ov = (OVERLAPPED *)&op->overlapped[0];
-		ov->Offset = (uint32_t)op->offset;
-		ov->OffsetHigh = (uint32_t)(op->offset >> 32);
-		ov->Internal = 0;
-		ov->InternalHigh = 0;
-		BOOL ret = ReadFile(h_, op->sg[0].buf, op->sg[0].len, NULL, ov);
-		DWORD err;
-		if(ret) {
-			assert(false);
-		} else if((err = GetLastError()) != ERROR_IO_PENDING) {
-			op->CompleteErr((int32_t)err);
-		}
+		Begin(op, false);
 	}
 	void BeginWrite(AsyncOp *op) override
 	{
-		AddRef();
-		op->op = &AsyncOp::CompleteOp;
-		op->unref = this;
-		assert(op->nsg == 1);
-
-		OVERLAPPED *ov = (OVERLAPPED *)&op->overlapped[0];
-		ov->Pointer = (void *)op->offset;
-		BOOL ret = WriteFile(h_, op->sg[0].buf, op->sg[0].len, NULL, ov);
-		DWORD err;
-		if(ret) {
-			assert(false);
-		} else if((err = GetLastError()) != ERROR_IO_PENDING) {
-			op->CompleteErr((int32_t)err);
-		}
+		Begin(op, true);
 	}
 
 	void Flush() override { FlushFileBuffers(h_); }
@@ -121,6 +93,14 @@ public:
 		return sz.QuadPart;
 	}
 
+	uint64_t GetDeviceId() const override
+	{
+		BY_HANDLE_FILE_INFORMATION info;
+		if(!GetFileInformationByHandle(h_, &info))
+			return 0;
+		return (uint64_t)info.dwVolumeSerialNumber + 1;
+	}
+
 	std::unique_ptr<ShmRegion> MapRegion(void *addr, uint64_t offset, uint64_t size, bool ro) override
 	{
 		if(!size) {
@@ -157,6 +137,84 @@ public:
 	}
 
 private:
+	void Begin(AsyncOp *op, bool write)
+	{
+		if(op->CompleteIfCancelled())
+			return;
+		AddRef();
+		op->unref = this;
+		// ReadFile/WriteFile take a single buffer, and the scatter/gather variants need page-sized
+		// unbuffered segments, so vectored ops issue their segments one after another
+		op->op = op->nsg > 1 ? &Win32File::OnSegmentDone : &AsyncOp::CompleteOp;
+
+		OVERLAPPED *ov = (OVERLAPPED *)&op->overlapped[0];
+		op->SetCancelHook([h = h_, ov]() { CancelIoEx(h, ov); });
+		IssueSegment(op, 0, write);
+	}
+
+	// op_context holds the segment in flight and whether this is a write
+	static void SetSegment(AsyncOp *op, int i, bool write)
+	{
+		op->op_context = (void *)(((uintptr_t)i << 1) | (write ? 1 : 0));
+	}
+	static int GetSegment(AsyncOp *op, bool *write)
+	{
+		*write = !!((uintptr_t)op->op_context & 1);
+		return (int)((uintptr_t)op->op_context >> 1);
+	}
+	static uint64_t SegmentStart(AsyncOp *op, int i)
+	{
+		uint64_t n = 0;
+		for(int j = 0; j < i; j++) n += op->sg[j].len;
+		return n;
+	}
+
+	void IssueSegment(AsyncOp *op, int i, bool write)
+	{
+		SetSegment(op, i, write);
+		uint64_t offset = op->offset;
+		if(offset != kAppendOffset)
+			offset += SegmentStart(op, i);
+
+		OVERLAPPED *ov = (OVERLAPPED *)&op->overlapped[0];
+		ov->Internal = 0;
+		ov->InternalHigh = 0;
+		ov->Offset = (uint32_t)offset;
+		ov->OffsetHigh = (uint32_t)(offset >> 32);
+		BOOL ret = write ? WriteFile(h_, op->sg[i].buf, op->sg[i].len, NULL, ov)
+		                 : ReadFile(h_, op->sg[i].buf, op->sg[i].len, NULL, ov);
+		DWORD err;
+		if(ret) {
+			// Completion port notifications are skipped on synchronous success
+			DWORD n = 0;
+			GetOverlappedResult(h_, ov, &n, FALSE);
+			op->err = 0;
+			op->transferred = n;
+			op->op(op);
+		} else if((err = GetLastError()) != ERROR_IO_PENDING) {
+			op->err = err == ERROR_HANDLE_EOF ? io_err::kEOF : io_err::FromOs(err);
+			op->transferred = 0;
+			op->op(op);
+		}
+	}
+
+	static void OnSegmentDone(AsyncOp *op)
+	{
+		bool write;
+		int i = GetSegment(op, &write);
+		uint64_t done = SegmentStart(op, i);
+		uint32_t n = op->transferred;
+		if(!op->err && n == op->sg[i].len && i + 1 < op->nsg) {
+			static_cast<Win32File *>(op->unref)->IssueSegment(op, i + 1, write);
+			return;
+		}
+		// A short or failed segment ends the op with whatever was transferred before it
+		if(op->err == io_err::kEOF && done)
+			op->err = 0;
+		op->transferred = (uint32_t)(done + n);
+		AsyncOp::CompleteOp(op);
+	}
+
 	HANDLE h_;
 	bool writable_;
 };
@@ -218,15 +276,24 @@ public:
 		if(flags & file_flags::kAppendOnly)
 			access |= FILE_APPEND_DATA;
 		DWORD creation = OpenModeToCreationDisposition(mode);
+		DWORD attrs = FILE_FLAG_OVERLAPPED | FILE_ATTRIBUTE_NORMAL;
+		if(flags & file_flags::kSequential)
+			attrs |= FILE_FLAG_SEQUENTIAL_SCAN;
+		else if(flags & file_flags::kRandomAccess)
+			attrs |= FILE_FLAG_RANDOM_ACCESS;
+		if(flags & file_flags::kDirectIo)
+			attrs |= FILE_FLAG_NO_BUFFERING;
 
 		std::string s(path);
-		HANDLE h = CreateFileA(
-		    s.data(), access, FILE_SHARE_READ, NULL, creation, FILE_FLAG_OVERLAPPED | FILE_ATTRIBUTE_NORMAL, NULL);
+		HANDLE h = CreateFileA(s.data(), access, FILE_SHARE_READ, NULL, creation, attrs, NULL);
 		if(h == INVALID_HANDLE_VALUE) {
 			DWORD err = GetLastError();
 			return nullptr;
 		}
-		return new Win32File(h, writable);
+		IoFilePtr f = new Win32File(h, writable);
+		if(flags & file_flags::kDirectIo)
+			return new details::DirectIoFile(std::move(f));
+		return f;
 	}
 	IoDirPtr OpenDir(const Path &path) override
 	{
@@ -257,6 +324,7 @@ public:
 		if(!GetFileAttributesExA(s.data(), GetFileExInfoStandard, &attr))
 			return false;
 		buf->size = attr.nFileSizeLow + ((uint64_t)attr.nFileSizeHigh << 32);
+		buf->mtime = attr.ftLastWriteTime.dwLowDateTime + ((uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32);
 		buf->flags = 0;
 		if(attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
 			buf->flags |= file_flags::kIsDir;
@@ -314,6 +382,11 @@ VFSImpl *VFSImpl::GetOsVfs()
 	return win32vfs;
 }
 
+void ShutdownOsIo()
+{
+	// Completions arrive on the I/O pool's threads, which have no other state to stop
+}
+
 namespace {
 
 std::string Utf16ToUtf8(wchar_t *str)
@@ -376,6 +449,8 @@ bool SafeVFSSplit::PreInitialize(const Options &options)
 		delete safe_vfs_impl;
 	safe_vfs_impl = new SafeVFSSplit(VFSImpl::GetOsVfs(), temp_path, data_path);
 	safe_vfs = VFS(safe_vfs_impl);
+	if(!options.game_pack.empty())
+		safe_vfs_impl->MountGamePack(options.game_pack);
 
 	return true;
 }
@@ -409,6 +484,8 @@ bool SafeVFSSplit::Initialize(const Options &options)
 
 	if(!save_path.empty())
 		safe_vfs_impl->SetSave(std::make_shared<SafeVFSImpl>(VFSImpl::GetOsVfs(), save_path));
+	if(options.temp_ram_budget)
+		safe_vfs_impl->UseRamTemp(options.temp_ram_budget);
 
 	return true;
 }
@@ -1,17 +1,34 @@
 #include "lua/lua.h"
 #include "lua/luabuiltin.h"
 
+#include "event.h"
+#include "sys/thread.h"
+
+#include "blob_cache.h"
+#include "buffered_file.h"
 #include "file.h"
+#include "stats.h"
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
 namespace lune {
 
 
+// mode: 1 read-write, 2 append. open: 1 truncate, 2 create, either of which also opens it to write
 void *ffi_fs_open(const char *name, size_t len, uint32_t mode, uint32_t open)
 {
-	uint32_t flags = file_flags::kReadOnly;
-	OpenMode open_mode = OpenMode::OpenExisting;
+	uint32_t flags = ((mode & 3) || (open & 3)) ? 0 : file_flags::kReadOnly;
+	if(mode & 2)
+		flags |= file_flags::kAppendOnly;
+	static const OpenMode open_modes[4] = {
+	    OpenMode::OpenExisting, OpenMode::TruncateExisting, OpenMode::OpenOrCreate, OpenMode::CreateOrTruncate};
+	OpenMode open_mode = open_modes[open & 3];
 	auto f = safe_vfs.OpenFile(Path(name, len), flags, open_mode);
 	if(!f) {
 		return nullptr;
@@ -46,6 +63,274 @@ void *fs_read(IoFile *f, uint64_t offset, uint64_t size)
 	return b;
 }
 
+size_t fs_read_at(IoFile *f, void *p, size_t n, uint64_t offset)
+{
+	return File(f).ReadAbs(p, n, offset);
+}
+
+namespace {
+// Streams a file for Lua. Reads go through a BufferedFile, which reads ahead once it sees them run
+// sequentially. Files opened to append are only ever written at the end, so they are written behind the
+// caller through a FileOutputStream; anything else is written through the BufferedFile at the current
+// position
+class FsStream
+{
+public:
+	FsStream(IoFile *f, bool append) : buffered_(IoFilePtr(f))
+	{
+		if(append) {
+			out_ = std::make_unique<FileOutputStream>(f);
+			end_ = f->GetFileSize();
+		}
+	}
+
+	size_t Read(void *p, size_t n)
+	{
+		// Reads must see what was written before them
+		if(out_)
+			out_->Flush();
+		return buffered_.Read(p, n);
+	}
+
+	size_t Write(const void *p, size_t n)
+	{
+		if(!out_)
+			return buffered_.Write(p, n);
+		// Appends are written behind, so a failure shows up on a later write, flush or close
+		if(out_->error())
+			return 0;
+		for(size_t done = 0; done < n;) {
+			uint32_t piece = (uint32_t)std::min<size_t>(n - done, 1u << 30);
+			out_->Write((const uint8_t *)p + done, piece);
+			done += piece;
+		}
+		// Appends leave the position at the end, wherever it was before
+		end_ += n;
+		buffered_.Seek(end_);
+		return n;
+	}
+
+	bool Flush()
+	{
+		bool ok = true;
+		if(out_) {
+			out_->Flush();
+			ok = !out_->error();
+		}
+		return buffered_.Flush() && ok;
+	}
+
+	void Seek(uint64_t position) { buffered_.Seek(position); }
+	uint64_t Tell() const { return buffered_.Tell(); }
+
+private:
+	BufferedFile buffered_;
+	std::unique_ptr<FileOutputStream> out_;
+	// Where appended data ends, including any still being written behind
+	uint64_t end_ = 0;
+};
+} // namespace
+
+void *fs_stream_open(IoFile *f, bool append)
+{
+	return new FsStream(f, append);
+}
+
+// Waits for everything written to reach the file. Returns false if any of it could not be written
+bool fs_stream_close(FsStream *s)
+{
+	bool ok = s->Flush();
+	delete s;
+	return ok;
+}
+
+size_t fs_stream_read(FsStream *s, void *p, size_t n)
+{
+	return s->Read(p, n);
+}
+
+size_t fs_stream_write(FsStream *s, const void *p, size_t n)
+{
+	return s->Write(p, n);
+}
+
+bool fs_stream_flush(FsStream *s)
+{
+	return s->Flush();
+}
+
+void fs_stream_seek(FsStream *s, uint64_t position)
+{
+	s->Seek(position);
+}
+
+uint64_t fs_stream_tell(FsStream *s)
+{
+	return s->Tell();
+}
+
+void *fs_read_cached(const char *name, size_t len)
+{
+	auto b = blob_cache.Read(safe_vfs_impl, Path(name, len));
+	if(!b)
+		return nullptr;
+
+	b->AddRef();
+	return b.get();
+}
+
+
+namespace {
+// A metadata request made from Lua, which polls it until it is done. Lua and the pending future each
+// hold a reference
+class FsRequest : public Refcounted
+{
+public:
+	std::atomic<bool> done = false;
+	bool ok = false;
+	IoFilePtr file;
+	std::vector<StatResult> stats;
+	std::vector<DirEntry> entries;
+	RefPtr<Blob> blob;
+};
+
+template<typename F, typename Fn>
+FsRequest *StartRequest(F future, Fn store)
+{
+	RefPtr<FsRequest> r = new FsRequest();
+	future.Then([r, store](typename F::value_type &v, bool ok) {
+		r->ok = ok;
+		if(ok)
+			store(r.get(), v);
+		r->done.store(true, std::memory_order_release);
+	});
+	r->AddRef();
+	return r.get();
+}
+} // namespace
+
+void *fs_open_async(const char *name, size_t len)
+{
+	return StartRequest(safe_vfs.OpenFileAsync(Path(name, len), file_flags::kReadOnly),
+	    [](FsRequest *r, IoFilePtr &f) { r->file = std::move(f); });
+}
+
+void *fs_stat_async(const char **names, const size_t *lens, int n)
+{
+	std::vector<std::string> paths;
+	paths.reserve(n);
+	for(int i = 0; i < n; i++) paths.emplace_back(names[i], lens[i]);
+	return StartRequest(safe_vfs.StatManyAsync(std::move(paths)),
+	    [](FsRequest *r, std::vector<StatResult> &v) { r->stats = std::move(v); });
+}
+
+void *fs_list_async(const char *name, size_t len)
+{
+	return StartRequest(safe_vfs.EnumerateAsync(Path(name, len)),
+	    [](FsRequest *r, std::vector<DirEntry> &v) { r->entries = std::move(v); });
+}
+
+// Reads a whole file through the blob cache without blocking the caller, even to open it. Once the blob
+// has resolved the request is done and, if id isn't 0, a Callback event with id is posted to the main state
+void *fs_read_async(const char *name, size_t len, double id)
+{
+	RefPtr<FsRequest> r = new FsRequest();
+	GetPoolIo()->PostTask([r, path = std::string(name, len), id]() {
+		auto finish = [r, id](bool ok) {
+			r->ok = ok;
+			r->done.store(true, std::memory_order_release);
+			if(id)
+				PostEvent(LuneToLuaEv::Callback, id);
+		};
+		auto b = blob_cache.Read(safe_vfs_impl, path);
+		if(!b) {
+			finish(false);
+			return;
+		}
+		r->blob = b;
+		b->Then([finish](RefPtr<Blob>, bool ok) { finish(ok); });
+	});
+	r->AddRef();
+	return r.get();
+}
+
+bool fs_request_done(FsRequest *r)
+{
+	return r->done.load(std::memory_order_acquire);
+}
+
+bool fs_request_ok(FsRequest *r)
+{
+	return r->ok;
+}
+
+void *fs_request_file(FsRequest *r)
+{
+	IoFile *f = r->file.get();
+	if(f)
+		f->AddRef();
+	return f;
+}
+
+// Returns the stat flags, or 0 if the path could not be stat'd
+uint32_t fs_request_stat(FsRequest *r, int i, uint64_t *size)
+{
+	auto &s = r->stats[i];
+	if(!s.ok)
+		return 0;
+	*size = s.stat.size;
+	return s.stat.flags;
+}
+
+void *fs_request_blob(FsRequest *r)
+{
+	if(!r->ok)
+		return nullptr;
+	r->blob->AddRef();
+	return r->blob.get();
+}
+
+int fs_request_count(FsRequest *r)
+{
+	return (int)r->entries.size();
+}
+
+const char *fs_request_entry(FsRequest *r, int i, uint64_t *size, uint32_t *flags)
+{
+	auto &e = r->entries[i];
+	*size = e.size;
+	*flags = e.flags;
+	return e.name.c_str();
+}
+
+void fs_request_free(FsRequest *r)
+{
+	r->Release();
+}
+
+
+// Compiles a Lua file straight out of the blob it is read into, rather than copying it into a Lua string
+// first. Returns the function, or nil and an error
+int fs_load_chunk(lua_State *L)
+{
+	size_t len;
+	const char *name = luaL_checklstring(L, 1, &len);
+	auto b = blob_cache.Read(safe_vfs_impl, Path(name, len));
+	if(b)
+		b->wait();
+	if(!b || b->errored()) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "can't read %s", name);
+		return 2;
+	}
+	lua_pushfstring(L, "@%s", name);
+	if(luaL_loadbuffer(L, (const char *)b->GetData(), b->GetSize(), lua_tostring(L, -1))) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+	return 1;
+}
 
 void blob_destroy(Blob *b)
 {
@@ -55,16 +340,84 @@ uint64_t blob_size(Blob *b)
 {
 	return b->GetSize();
 }
+// Whether blob_data can return without waiting for the blob to load
+bool blob_ready(Blob *b)
+{
+	return b->resolved();
+}
 void *blob_data(Blob *b)
 {
 	b->wait();
 	return b->GetData();
 }
 
+namespace {
+struct StatsCopy
+{
+	std::string name;
+	std::string mount;
+	IoStats::Snapshot snapshot;
+};
+// Filled by fs_stats_capture so that the rest of the query sees one consistent set of entries
+thread_local std::vector<StatsCopy> stats_copy;
+} // namespace
+
+int fs_stats_capture()
+{
+	stats_copy.clear();
+	IoStats::ForEach([](IoStats *s) {
+		stats_copy.emplace_back();
+		auto &c = stats_copy.back();
+		c.name = s->name();
+		if(s->mount())
+			c.mount = s->mount()->name();
+		s->Get(&c.snapshot);
+	});
+	return (int)stats_copy.size();
+}
+
+const char *fs_stats_name(int i)
+{
+	return stats_copy[i].name.c_str();
+}
+
+const char *fs_stats_mount(int i)
+{
+	return stats_copy[i].mount.c_str();
+}
+
+void fs_stats_get(int i, IoStats::Snapshot *out)
+{
+	*out = stats_copy[i].snapshot;
+}
+
+void fs_path_cache_get(VFSPathCache::Counters *out)
+{
+	safe_vfs_impl->path_cache().Get(out);
+}
+
+void fs_blob_cache_get(BlobCache::Counters *out)
+{
+	blob_cache.Get(out);
+}
+
 
 LUA_REGISTER_FFI_FNS("fs", "open", &ffi_fs_open, "close", &ffi_fs_close, "size", &ffi_fs_size, "get_error",
-    &ffi_fs_get_error, "read", &fs_read);
-LUA_REGISTER_FFI_FNS("blob", "destroy", &blob_destroy, "size", &blob_size, "data", &blob_data);
+    &ffi_fs_get_error, "read", &fs_read, "read_cached", &fs_read_cached, "read_at", &fs_read_at);
+LUA_REGISTER_FFI_FNS("fs_stream", "open", &fs_stream_open, "close", &fs_stream_close, "read", &fs_stream_read, "write",
+    &fs_stream_write, "flush", &fs_stream_flush, "seek", &fs_stream_seek, "tell", &fs_stream_tell);
+LUA_REGISTER_FFI_FNS("fs_stats", "capture", &fs_stats_capture, "name", &fs_stats_name, "mount", &fs_stats_mount,
+    "get", &fs_stats_get);
+LUA_REGISTER_FFI_FNS("fs_path_cache", "get", &fs_path_cache_get);
+LUA_REGISTER_FFI_FNS("fs_blob_cache", "get", &fs_blob_cache_get);
+LUA_REGISTER_FFI_FNS("fs", "open_async", &fs_open_async, "stat_async", &fs_stat_async, "list_async", &fs_list_async,
+    "read_async", &fs_read_async);
+LUA_REGISTER_FFI_FNS("fs_request", "done", &fs_request_done, "ok", &fs_request_ok, "file", &fs_request_file, "stat",
+    &fs_request_stat, "blob", &fs_request_blob, "count", &fs_request_count, "entry", &fs_request_entry, "free",
+    &fs_request_free);
+LUA_REGISTER_FFI_FNS("blob", "destroy", &blob_destroy, "size", &blob_size, "ready", &blob_ready, "data",
+    &blob_data);
+LUA_REGISTER_GLOBAL("fs.loadChunk", fs_load_chunk);
 
 
 LUA_REGISTER_SETUP(R"(
@@ -78,12 +431,57 @@ void fs_close(void*);
 uint64_t fs_size(void*);
 
 void* fs_read(void*, uint64_t offset, uint64_t size);
+void* fs_read_cached(const char *name, size_t len);
+size_t fs_read_at(void*, void *p, size_t n, uint64_t offset);
+
+void* fs_stream_open(void*, bool append);
+bool fs_stream_close(void*);
+size_t fs_stream_read(void*, void *p, size_t n);
+size_t fs_stream_write(void*, const void *p, size_t n);
+bool fs_stream_flush(void*);
+void fs_stream_seek(void*, uint64_t position);
+uint64_t fs_stream_tell(void*);
+
+void* fs_open_async(const char *name, size_t len);
+void* fs_stat_async(const char **names, const size_t *lens, int n);
+void* fs_list_async(const char *name, size_t len);
+void* fs_read_async(const char *name, size_t len, double id);
+bool fs_request_done(void*);
+bool fs_request_ok(void*);
+void* fs_request_file(void*);
+uint32_t fs_request_stat(void*, int i, uint64_t *size);
+void* fs_request_blob(void*);
+int fs_request_count(void*);
+const char *fs_request_entry(void*, int i, uint64_t *size, uint32_t *flags);
+void fs_request_free(void*);
+
+typedef struct {
+	uint64_t reads, writes, read_bytes, write_bytes, errors, sequential, queue_us, service_us;
+	uint64_t queue_hist[24];
+	uint64_t service_hist[24];
+} IoStatsSnapshot;
+int fs_stats_capture();
+const char *fs_stats_name(int);
+const char *fs_stats_mount(int);
+void fs_stats_get(int, IoStatsSnapshot*);
+
+typedef struct {
+	uint64_t hits, negative_hits, misses, invalidations, entries;
+} VFSPathCacheCounters;
+void fs_path_cache_get(VFSPathCacheCounters*);
+
+typedef struct {
+	uint64_t hits, joined, misses, stale, evictions, entries, bytes, pinned_bytes;
+} BlobCacheCounters;
+void fs_blob_cache_get(BlobCacheCounters*);
 
 void blob_destroy(void*);
 uint64_t blob_size(void*);
+bool blob_ready(void*);
 uint8_t* blob_data(void*);
 ]]
 
+local bit = require "bit"
 local internal = internal
 local tostring = tostring
 local tonumber = tonumber
@@ -102,12 +500,72 @@ function blob:getString(offset)
 	return ffi.string(ptr + ofs, sz - ofs)
 end
 
+-- False while the blob is still loading, when reading it would wait for it
+function blob:isReady()
+	return C.blob_ready(blobmap[self])
+end
+
 function blob:getSize()
 	local b = blobmap[self]
 	local sz = C.blob_size(b)
 	return tonumber(sz)
 end
 
+-- Views give typed access to a blob's memory without copying it. view.ptr points at the first element
+-- and view.len is the number of elements, each view.elem bytes; the view keeps the blob alive, but a
+-- pointer taken from it doesn't, so hold on to the view while using one. Views are read-only, as the
+-- blob cache shares one blob between every reader of a file
+local view = {}
+local view_mt = {__index=view, __metatable="BlobView"}
+local ptr_types = {}
+
+local function ptr_type(ct)
+	local t = ptr_types[ct]
+	if not t then
+		t = ffi.typeof('const $*', type(ct) == 'string' and ffi.typeof(ct) or ct)
+		ptr_types[ct] = t
+	end
+	return t
+end
+
+local function make_view(owner, ptr, len, elem)
+	return setmetatable({ptr=ptr, len=len, elem=elem, owner=owner}, view_mt)
+end
+
+-- A view of count elements of ctype (uint8_t by default) from byte offset on, or all that fit
+function blob:view(ctype, offset, count)
+	local b = blobmap[self]
+	local t = ptr_type(ctype or 'uint8_t')
+	local elem = ffi.sizeof(ffi.typeof(ctype or 'uint8_t'))
+	local sz = tonumber(C.blob_size(b))
+	offset = offset or 0
+	count = count or math.floor((sz - offset) / elem)
+	if offset < 0 or count < 0 or offset + count * elem > sz then error('view out of range') end
+	return make_view(self, ffi.cast(t, C.blob_data(b) + offset), count, elem)
+end
+
+-- Elements first to first + count - 1 of this view, sharing its memory
+function view:sub(first, count)
+	count = count or self.len - first
+	if first < 0 or count < 0 or first + count > self.len then error('view out of range') end
+	return make_view(self.owner, self.ptr + first, count, self.elem)
+end
+
+-- Like sub, but over a different element type; offset is in bytes
+function view:cast(ctype, offset, count)
+	local bytes = self.len * self.elem
+	local elem = ffi.sizeof(ffi.typeof(ctype))
+	offset = offset or 0
+	count = count or math.floor((bytes - offset) / elem)
+	if offset < 0 or count < 0 or offset + count * elem > bytes then error('view out of range') end
+	return make_view(self.owner, ffi.cast(ptr_type(ctype), ffi.cast('const uint8_t*', self.ptr) + offset), count, elem)
+end
+
+-- Copies the viewed bytes into a Lua string
+function view:getString()
+	return ffi.string(self.ptr, self.len * self.elem)
+end
+
 function internal.make_blob(b)
 	local t = setmetatable({}, blob_mt)
 	blobmap[t] = b
@@ -117,25 +575,130 @@ end
 local file_errors = {}
 local filemap = setmetatable({}, {__mode="k"})
 local file = {}
-local file_mt = {__index=file, __metatable="File", __gc=function(t) C.fs_close(filemap[t]) end}
+local file_mt = {__index=file, __metatable="File", __gc=function(t)
+	local f = filemap[t]
+	if f then C.fs_close(f) end
+end}
 
 function file.type() return "File" end
 
 function file:readToBlob()
 	local f = filemap[self]
 	local blob = C.fs_read(f, 0, 0);
-	if not blob then return nil, file_errors[C.fs_get_error()] end
+	if blob == nil then return nil, file_errors[C.fs_get_error()] end
 
 	return internal.make_blob(blob)
 end
 
+function file:size()
+	local f = filemap[self]
+	return tonumber(C.fs_size(f))
+end
+
+-- Streaming. Reads and writes start at the file's position and advance it; readAt reads anywhere
+-- without moving it. Reads are buffered and read ahead and writes are buffered, so files of any size are
+-- processed in constant memory. Files opened to append are written behind the caller; their writes always
+-- land at the end of the file and leave the position there
+local function stream(self)
+	local s = self.stream
+	if not s then
+		s = ffi.gc(C.fs_stream_open(filemap[self], self.append), C.fs_stream_close)
+		self.stream = s
+	end
+	return s
+end
+
+local scratch_size = 64 * 1024
+local scratch = ffi.new("uint8_t[?]", scratch_size)
+
+local function read_into(n, fn)
+	local buf = n <= scratch_size and scratch or ffi.new("uint8_t[?]", n)
+	local got = tonumber(fn(buf, n))
+	if got == 0 and n > 0 then return nil end
+	return ffi.string(buf, got)
+end
+
+-- Up to n bytes as a string, or nil at the end of the file
+function file:read(n)
+	local s = stream(self)
+	return read_into(n, function(buf, n) return C.fs_stream_read(s, buf, n) end)
+end
+
+function file:readAt(offset, n)
+	local f = filemap[self]
+	return read_into(n, function(buf, n) return C.fs_read_at(f, buf, n, offset) end)
+end
+
+-- Iterates over the lines of the rest of the file, without their line endings
+function file:lines()
+	local rest, pos = '', 1
+	return function()
+		while true do
+			local e = rest:find('\n', pos, true)
+			if e then
+				local line = rest:sub(pos, rest:byte(e - 1) == 13 and e - 2 or e - 1)
+				pos = e + 1
+				return line
+			end
+			local chunk = self:read(scratch_size)
+			if not chunk then
+				if pos > #rest then return nil end
+				local line = rest:sub(pos)
+				rest, pos = '', 1
+				return line
+			end
+			rest, pos = rest:sub(pos) .. chunk, 1
+		end
+	end
+end
+
+-- Writes a string, a blob or a blob view. Returns the number of bytes written
+function file:write(data)
+	local s = stream(self)
+	local kind = getmetatable(data)
+	if kind == 'Blob' then data = data:view() kind = 'BlobView' end
+	if kind == 'BlobView' then return tonumber(C.fs_stream_write(s, data.ptr, data.len * data.elem)) end
+	data = tostring(data)
+	return tonumber(C.fs_stream_write(s, data, #data))
+end
+
 function file:writeFromBlob(blob)
-	error('NYI')
+	return self:write(blob)
 end
 
-function file:size()
+function file:seek(position)
+	C.fs_stream_seek(stream(self), position)
+end
+
+function file:tell()
+	return tonumber(C.fs_stream_tell(stream(self)))
+end
+
+-- Waits for everything written so far to reach the file. Returns false if any of it could not be written
+function file:flush()
+	if self.stream then return C.fs_stream_flush(self.stream) end
+	return true
+end
+
+-- Returns false if anything written could not be
+function file:close()
+	local ok = true
+	if self.stream then
+		ok = C.fs_stream_close(ffi.gc(self.stream, nil))
+		self.stream = nil
+	end
 	local f = filemap[self]
-	return fs_size(f)
+	if f then
+		filemap[self] = nil
+		C.fs_close(f)
+	end
+	return ok
+end
+
+local function make_file(f, append)
+	local t = setmetatable({offset=0, append=append or false}, file_mt)
+	filemap[t] = f
+	return t
 end
 
 lune.fs = lune.fs or {}
@@ -150,22 +713,188 @@ function lune.fs.open(name, opts)
 	end
 	local s = tostring(name)
 	local f = C.fs_open(s, #s, mode, open)
-	if not f then return nil, file_errors[C.fs_get_error()] end
-	local t = setmetatable({offset=0}, file_mt)
-	filemap[t] = f
+	if f == nil then return nil, file_errors[C.fs_get_error()] end
+	return make_file(f, opts and opts.append)
+end
+
+-- Non-blocking metadata. Each of these returns a request at once; request:poll() returns false while it
+-- is pending, then true followed by the results
+local requestmap = setmetatable({}, {__mode="k"})
+local request = {}
+local request_mt = {__index=request, __metatable="FsRequest",
+	__gc=function(t) C.fs_request_free(requestmap[t]) end}
+
+local function make_request(r, finish)
+	local t = setmetatable({finish=finish}, request_mt)
+	requestmap[t] = r
+	return t
+end
+
+function request:poll()
+	local r = requestmap[self]
+	if not C.fs_request_done(r) then return false end
+	return true, self.finish(r)
+end
+
+local function stat_table(flags, size)
+	if flags == 0 then return nil end
+	return {size=tonumber(size), isDir=bit.band(flags, 0x40000000) ~= 0, readOnly=bit.band(flags, 1) ~= 0}
+end
+
+-- Results in a File, or nil if it could not be opened
+function lune.fs.openAsync(name)
+	local s = tostring(name)
+	return make_request(C.fs_open_async(s, #s), function(r)
+		local f = C.fs_request_file(r)
+		if f == nil then return nil end
+		return make_file(f)
+	end)
+end
+
+-- Stats one path, or all of a table of paths at once. Results in {size, isDir, readOnly} or nil for a
+-- single path, and for a table, in a table with the result for each path at its index (false if missing)
+function lune.fs.statAsync(names)
+	local single = type(names) ~= 'table'
+	if single then names = {names} end
+	local n = #names
+	local strs = {}
+	local ptrs = ffi.new("const char*[?]", n)
+	local lens = ffi.new("size_t[?]", n)
+	for i = 1, n do
+		strs[i] = tostring(names[i])
+		ptrs[i - 1] = strs[i]
+		lens[i - 1] = #strs[i]
+	end
+	return make_request(C.fs_stat_async(ptrs, lens, n), function(r)
+		local size = ffi.new("uint64_t[1]")
+		local ret = {}
+		for i = 1, n do ret[i] = stat_table(C.fs_request_stat(r, i - 1, size), size[0]) or false end
+		if single then return ret[1] or nil end
+		return ret
+	end)
+end
+
+-- Results in an array of {name, size, isDir}, or nil if the directory could not be read
+function lune.fs.listAsync(name)
+	local s = tostring(name)
+	return make_request(C.fs_list_async(s, #s), function(r)
+		if not C.fs_request_ok(r) then return nil end
+		local size = ffi.new("uint64_t[1]")
+		local flags = ffi.new("uint32_t[1]")
+		local ret = {}
+		for i = 0, C.fs_request_count(r) - 1 do
+			local entry = ffi.string(C.fs_request_entry(r, i, size, flags))
+			ret[i + 1] = {name=entry, size=tonumber(size[0]), isDir=bit.band(flags[0], 0x40000000) ~= 0}
+		end
+		return ret
+	end)
+end
+
+-- Worker states are set up with this global before the jail runs; their callbacks would be posted to the
+-- main state's event loop, which has none of them, so only the main state may pass fn
+local on_engine_thread = g_isEngineThread
+
+-- Reads a whole file without ever blocking. Returns a request at once, which results in a blob, or nil
+-- if the file could not be read. If fn is given it is called with the same result from the event loop
+-- once the read is done; reads that finish during a frame are all delivered with its events. Only the
+-- main state has an event loop, so elsewhere fn is an error and the request has to be polled
+function lune.fs.readAsync(name, fn)
+	if fn and on_engine_thread then error("readAsync callbacks are only delivered on the main thread", 2) end
+	local s = tostring(name)
+	local req
+	local id = fn and internal.addCallback(function()
+		local _, b = req:poll()
+		fn(b)
+	end) or 0
+	req = make_request(C.fs_read_async(s, #s, id), function(r)
+		local b = C.fs_request_blob(r)
+		if b == nil then return nil end
+		return internal.make_blob(b)
+	end)
+	return req
+end
+
+-- Whole files are read through the shared blob cache, so reading a file again while it is unchanged
+-- returns the same blob without touching the disk
+function lune.fs.read(name)
+	local s = tostring(name)
+	local b = C.fs_read_cached(s, #s)
+	if b == nil then return nil, file_errors[C.fs_get_error()] end
+	return internal.make_blob(b)
+end
+
+local function stats_histogram(h)
+	local t = {}
+	for i = 0, 23 do t[i + 1] = tonumber(h[i]) end
 	return t
 end
 
-function lune.fs.read(name, size)
-	local f, err = lune.fs.open(name)
-	if f then return f:readToBlob(size) end
-	return nil, err
+-- Returns the I/O stats of the roots and of every open file under them, keyed by path, optionally only
+-- those whose path starts with prefix. Entry i of a histogram counts ops that took under 2^(i-1)us,
+-- the last entry everything slower.
+function lune.fs.getStats(prefix)
+	local s = ffi.new("IoStatsSnapshot")
+	local ret = {}
+	for i = 0, C.fs_stats_capture() - 1 do
+		local name = ffi.string(C.fs_stats_name(i))
+		if not prefix or name:sub(1, #prefix) == prefix then
+			C.fs_stats_get(i, s)
+			local mount = ffi.string(C.fs_stats_mount(i))
+			ret[name] = {
+				mount = mount ~= '' and mount or nil,
+				reads = tonumber(s.reads), writes = tonumber(s.writes),
+				readBytes = tonumber(s.read_bytes), writeBytes = tonumber(s.write_bytes),
+				errors = tonumber(s.errors), sequential = tonumber(s.sequential),
+				queueTime = tonumber(s.queue_us), serviceTime = tonumber(s.service_us),
+				queueHistogram = stats_histogram(s.queue_hist),
+				serviceHistogram = stats_histogram(s.service_hist),
+			}
+		end
+	end
+	return ret
+end
+
+-- Counts for the cache of resolved paths behind the safe roots
+function lune.fs.getPathCacheStats()
+	local c = ffi.new("VFSPathCacheCounters")
+	C.fs_path_cache_get(c)
+	local hits, misses = tonumber(c.hits), tonumber(c.misses)
+	return {
+		hits = hits, negativeHits = tonumber(c.negative_hits), misses = misses,
+		invalidations = tonumber(c.invalidations), entries = tonumber(c.entries),
+		hitRate = hits + misses > 0 and hits / (hits + misses) or 0,
+	}
+end
+
+-- Counts for the shared blob cache behind lune.fs.read
+function lune.fs.getBlobCacheStats()
+	local c = ffi.new("BlobCacheCounters")
+	C.fs_blob_cache_get(c)
+	local hits, misses = tonumber(c.hits), tonumber(c.misses)
+	return {
+		hits = hits, joined = tonumber(c.joined), misses = misses, stale = tonumber(c.stale),
+		evictions = tonumber(c.evictions), entries = tonumber(c.entries), bytes = tonumber(c.bytes),
+		pinnedBytes = tonumber(c.pinned_bytes), hitRate = hits + misses > 0 and hits / (hits + misses) or 0,
+	}
+end
+
+-- The time in microseconds under which fraction p of the ops in a histogram from getStats completed
+function lune.fs.statsPercentile(h, p)
+	local total = 0
+	for i = 1, #h do total = total + h[i] end
+	local seen = 0
+	for i = 1, #h do
+		seen = seen + h[i]
+		if seen >= total * p then return 2 ^ (i - 1) end
+	end
+	return 0
 end
 
+local load_chunk = lune.fs.loadChunk
+lune.fs.loadChunk = nil
+
 function lune.fs.load(name)
-	local contents, err = lune.fs.read(name)
-	if not contents then return nil, err end
-	local fn, err = loadstring(tostring(contents))
+	local fn, err = load_chunk(tostring(name))
 	if fn then setfenv(fn, root_jail) end
 	return fn, err
 end
@@ -0,0 +1,342 @@
+#include "pack.h"
+
+#include "util/compress.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+namespace lune {
+
+namespace pack {
+uint64_t HashName(std::string_view name)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(char c : name) {
+		h ^= (uint8_t)c;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+} // namespace pack
+
+namespace details {
+namespace {
+constexpr uint32_t kFileFlags = file_flags::kIsFile | file_flags::kReadOnly;
+constexpr uint32_t kDirFlags = file_flags::kIsDir | file_flags::kReadOnly;
+
+uint64_t BucketBytes(uint32_t bucket_count)
+{
+	return (((uint64_t)bucket_count + 1) * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+}
+
+// Names in the pack are relative, without leading or trailing slashes. The root is the empty name
+std::string_view Normalize(Path p)
+{
+	while(!p.empty() && p.front() == '/') p.remove_prefix(1);
+	while(!p.empty() && p.back() == '/') p.remove_suffix(1);
+	return p;
+}
+} // namespace
+
+class PackArchive : public Refcounted
+{
+public:
+	static RefPtr<PackArchive> Load(IoFilePtr file);
+
+	IoFilePtr OpenFile(Path path, uint32_t flags, OpenMode mode);
+	IoDirPtr OpenDir(Path path);
+	bool Stat(Path path, StatBuf *buf);
+
+	// Calls fn with each direct child of a directory, as a NUL-terminated leaf name
+	bool Enumerate(std::string_view dir, const char *query, const std::function<bool(const FileInfo &)> &fn);
+
+private:
+	PackArchive() = default;
+
+	// Returns null for the root, which has no entry
+	const pack::Entry *Find(std::string_view name) const;
+	std::string_view Name(const pack::Entry &e) const { return std::string_view(names_ + e.name_offset, e.name_len); }
+	bool Validate(uint64_t file_size) const;
+
+	// The bytes at [offset, offset + size) of the pack, mapped if map is set and the file allows it
+	RefPtr<Blob> ReadRange(uint64_t offset, uint64_t size, bool map);
+	IoFilePtr Decompress(const pack::Entry &e);
+
+	IoFilePtr file_;
+	pack::Header header_;
+	RefPtr<Blob> toc_;
+	const uint32_t *buckets_ = nullptr;
+	const pack::Entry *entries_ = nullptr;
+	const char *names_ = nullptr;
+	uint64_t names_size_ = 0;
+	RefPtr<Blob> dict_;
+
+	CriticalSection lock_;
+	// Idle decompressors, without and with the dictionary. Contexts are reused across entries
+	std::vector<std::unique_ptr<DecompressionContext>> idle_[2];
+};
+
+namespace {
+class PackDir : public IoDir
+{
+public:
+	PackDir(PackArchive *archive, std::string_view path) : archive_(archive), path_(path) {}
+
+	bool EnumerateFiles(const char *query, std::function<bool(const FileInfo &)> fn) override
+	{
+		return archive_->Enumerate(path_, query, fn);
+	}
+
+	RefPtr<IoDir> OpenSubdir(const Path &path) override
+	{
+		if(!path.empty() && path[0] == '/')
+			return nullptr;
+		return archive_->OpenDir(Join(path));
+	}
+	RefPtr<IoFile> OpenFile(const Path &path, uint32_t flags, OpenMode mode) override
+	{
+		if(!path.empty() && path[0] == '/')
+			return nullptr;
+		return archive_->OpenFile(Join(path), flags, mode);
+	}
+
+private:
+	std::string Join(const Path &path) const
+	{
+		std::string s = path_;
+		if(!s.empty())
+			s.push_back('/');
+		s.append(path);
+		return s;
+	}
+
+	RefPtr<PackArchive> archive_;
+	std::string path_;
+};
+} // namespace
+
+RefPtr<PackArchive> PackArchive::Load(IoFilePtr file)
+{
+	uint64_t file_size = file->GetFileSize();
+	RefPtr<PackArchive> a = new PackArchive();
+	pack::Header &h = a->header_;
+	if(File(file).ReadAbs(&h, sizeof(h), 0) != sizeof(h))
+		return nullptr;
+	if(memcmp(h.magic, pack::kMagic, sizeof(h.magic)) || h.version != pack::kVersion)
+		return nullptr;
+	if(!h.bucket_count || (h.bucket_count & (h.bucket_count - 1)) || h.toc_offset % 8)
+		return nullptr;
+	if(h.toc_offset > file_size || h.toc_size > file_size - h.toc_offset)
+		return nullptr;
+	if(h.dict_offset > file_size || h.dict_size > file_size - h.dict_offset)
+		return nullptr;
+	uint64_t bucket_bytes = BucketBytes(h.bucket_count);
+	uint64_t entry_bytes = (uint64_t)h.entry_count * sizeof(pack::Entry);
+	if(bucket_bytes + entry_bytes > h.toc_size)
+		return nullptr;
+
+	a->file_ = std::move(file);
+	a->toc_ = a->ReadRange(h.toc_offset, h.toc_size, true);
+	if(!a->toc_)
+		return nullptr;
+	auto toc = (const uint8_t *)a->toc_->GetData();
+	a->buckets_ = (const uint32_t *)toc;
+	a->entries_ = (const pack::Entry *)(toc + bucket_bytes);
+	a->names_ = (const char *)(toc + bucket_bytes + entry_bytes);
+	a->names_size_ = h.toc_size - bucket_bytes - entry_bytes;
+	if(!a->Validate(file_size))
+		return nullptr;
+
+	if(h.dict_size) {
+		a->dict_ = a->ReadRange(h.dict_offset, h.dict_size, true);
+		if(!a->dict_)
+			return nullptr;
+	}
+	return a;
+}
+
+bool PackArchive::Validate(uint64_t file_size) const
+{
+	// Everything Find and Open rely on is checked here, once, so that a corrupt pack fails to mount
+	// rather than reading out of bounds later
+	uint32_t mask = header_.bucket_count - 1;
+	if(buckets_[0] || buckets_[header_.bucket_count] != header_.entry_count)
+		return false;
+	for(uint32_t b = 0; b < header_.bucket_count; b++) {
+		if(buckets_[b] > buckets_[b + 1])
+			return false;
+		for(uint32_t i = buckets_[b]; i < buckets_[b + 1]; i++) {
+			const pack::Entry &e = entries_[i];
+			if((e.hash & mask) != b)
+				return false;
+			if(e.name_offset > names_size_ || e.name_len >= names_size_ - e.name_offset ||
+			    names_[e.name_offset + e.name_len])
+				return false;
+			if(e.flags & pack::entry_flags::kDir)
+				continue;
+			if(e.offset > file_size || e.stored_size > file_size - e.offset)
+				return false;
+			if(!(e.flags & pack::entry_flags::kCompressed) && e.stored_size != e.size)
+				return false;
+			if((e.flags & pack::entry_flags::kDictionary) && !header_.dict_size)
+				return false;
+		}
+	}
+	return true;
+}
+
+const pack::Entry *PackArchive::Find(std::string_view name) const
+{
+	uint64_t hash = pack::HashName(name);
+	uint32_t b = (uint32_t)hash & (header_.bucket_count - 1);
+	for(uint32_t i = buckets_[b]; i < buckets_[b + 1]; i++) {
+		const pack::Entry &e = entries_[i];
+		if(e.hash == hash && Name(e) == name)
+			return &e;
+	}
+	return nullptr;
+}
+
+RefPtr<Blob> PackArchive::ReadRange(uint64_t offset, uint64_t size, bool map)
+{
+	File f(file_);
+	if(map) {
+		if(auto b = f.MapToBlob(offset, size, true); b && b->GetSize() == size)
+			return b;
+	}
+	RefPtr<OwnedMemoryBlob> b = new OwnedMemoryBlob((size_t)size);
+	if(f.ReadAbs(b->GetData(), (size_t)size, offset) != size)
+		return nullptr;
+	return b;
+}
+
+IoFilePtr PackArchive::Decompress(const pack::Entry &e)
+{
+	auto in = ReadRange(e.offset, e.stored_size, false);
+	if(!in)
+		return nullptr;
+
+	int d = (e.flags & pack::entry_flags::kDictionary) ? 1 : 0;
+	std::unique_ptr<DecompressionContext> ctx;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		if(!idle_[d].empty()) {
+			ctx = std::move(idle_[d].back());
+			idle_[d].pop_back();
+		}
+	}
+	if(!ctx)
+		ctx = CompressionAlgorithm::Get(CompressionAlgorithmType::zstd)->CreateDecompressor(d ? dict_.get() : nullptr);
+
+	RefPtr<Blob> out = ctx->Decompress(in.get());
+	if(out->errored() || out->GetSize() != e.size)
+		return nullptr;
+	// A context is only reused after a clean frame, so no half-decoded state carries over
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		idle_[d].push_back(std::move(ctx));
+	}
+	return new IoBlobFile(out.get());
+}
+
+IoFilePtr PackArchive::OpenFile(Path path, uint32_t flags, OpenMode mode)
+{
+	if(mode != OpenMode::OpenExisting || !(flags & file_flags::kReadOnly))
+		return nullptr;
+	const pack::Entry *e = Find(Normalize(path));
+	if(!e || (e->flags & pack::entry_flags::kDir))
+		return nullptr;
+	if(e->flags & pack::entry_flags::kCompressed)
+		return Decompress(*e);
+	return new IoROSubsetFile(file_.get(), e->offset, e->size);
+}
+
+IoDirPtr PackArchive::OpenDir(Path path)
+{
+	auto name = Normalize(path);
+	if(!name.empty()) {
+		const pack::Entry *e = Find(name);
+		if(!e || !(e->flags & pack::entry_flags::kDir))
+			return nullptr;
+	}
+	return new PackDir(this, name);
+}
+
+bool PackArchive::Stat(Path path, StatBuf *buf)
+{
+	auto name = Normalize(path);
+	if(name.empty()) {
+		buf->size = 0;
+		buf->flags = kDirFlags;
+		return true;
+	}
+	const pack::Entry *e = Find(name);
+	if(!e)
+		return false;
+	bool dir = e->flags & pack::entry_flags::kDir;
+	buf->size = dir ? 0 : e->size;
+	buf->flags = dir ? kDirFlags : kFileFlags;
+	return true;
+}
+
+bool PackArchive::Enumerate(std::string_view dir, const char *query, const std::function<bool(const FileInfo &)> &fn)
+{
+	size_t skip = dir.empty() ? 0 : dir.size() + 1;
+	for(uint32_t i = 0; i < header_.entry_count; i++) {
+		const pack::Entry &e = entries_[i];
+		auto name = Name(e);
+		if(name.size() <= skip || name.find('/', skip) != std::string_view::npos)
+			continue;
+		if(skip && (name[dir.size()] != '/' || name.substr(0, dir.size()) != dir))
+			continue;
+		FileInfo fi;
+		fi.filename = name.data() + skip;
+		if(!MatchFileQuery(query, fi.filename))
+			continue;
+		bool is_dir = e.flags & pack::entry_flags::kDir;
+		fi.size = is_dir ? 0 : e.size;
+		fi.flags = is_dir ? kDirFlags : kFileFlags;
+		if(!fn(fi))
+			break;
+	}
+	return true;
+}
+} // namespace details
+
+std::shared_ptr<PackVFS> PackVFS::Mount(IoFilePtr file)
+{
+	if(!file)
+		return nullptr;
+	auto archive = details::PackArchive::Load(std::move(file));
+	if(!archive)
+		return nullptr;
+	return std::make_shared<PackVFS>(archive.get());
+}
+
+PackVFS::PackVFS(details::PackArchive *archive) : archive_(archive) {}
+
+PackVFS::~PackVFS() = default;
+
+IoFilePtr PackVFS::OpenFile(const Path &path, uint32_t flags, OpenMode mode)
+{
+	return archive_->OpenFile(path, flags, mode);
+}
+
+IoDirPtr PackVFS::OpenDir(const Path &path)
+{
+	return archive_->OpenDir(path);
+}
+
+bool PackVFS::Stat(const Path &path, StatBuf *buf)
+{
+	return archive_->Stat(path, buf);
+}
+
+bool PackVFS::CheckAccess(const Path &path, uint32_t flags)
+{
+	StatBuf st;
+	return (flags & file_flags::kReadOnly) && archive_->Stat(path, &st);
+}
+
+} // namespace lune
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "file.h"
+
+#include <memory>
+#include <string_view>
+
+namespace lune {
+
+// A pack holds many read-only files in one, so that baked game data is served from a single handle with
+// no per-file open cost. All fields are little-endian. Layout:
+//   pack::Header
+//   entry data, each entry starting on a multiple of the header's alignment
+//   an optional zstd dictionary shared by compressed entries
+//   the table of contents, 8-byte aligned:
+//     uint32_t bucket starts[bucket_count + 1], padded to 8 bytes
+//     pack::Entry[entry_count]
+//     names, each followed by a NUL
+// Entries are sorted by hash bucket, so a path is found by hashing it and scanning its bucket. Names are
+// relative paths with '/' separators and no leading slash. Every directory has an entry of its own
+namespace pack {
+static constexpr char kMagic[8] = {'L', 'U', 'N', 'E', 'P', 'A', 'C', 'K'};
+static constexpr uint32_t kVersion = 1;
+
+namespace entry_flags {
+static constexpr uint32_t kDir = 1;
+// Stored as a single zstd frame
+static constexpr uint32_t kCompressed = 2;
+// Compressed against the pack's dictionary
+static constexpr uint32_t kDictionary = 4;
+} // namespace entry_flags
+
+struct Header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t alignment;
+	uint32_t entry_count;
+	// A power of two
+	uint32_t bucket_count;
+	uint64_t toc_offset;
+	uint64_t toc_size;
+	uint64_t dict_offset;
+	uint64_t dict_size;
+};
+static_assert(sizeof(Header) == 56, "pack::Header layout");
+
+struct Entry
+{
+	uint64_t hash;
+	uint64_t offset;
+	// Bytes held in the pack, and the size of the file they decode to
+	uint64_t stored_size;
+	uint64_t size;
+	// Into the names
+	uint32_t name_offset;
+	uint32_t name_len;
+	uint32_t flags;
+	uint32_t reserved;
+};
+static_assert(sizeof(Entry) == 48, "pack::Entry layout");
+
+// 64-bit FNV-1a of a name
+uint64_t HashName(std::string_view name);
+} // namespace pack
+
+namespace details {
+class PackArchive;
+}
+
+// Serves the files of a pack. Raw entries are opened as views of the pack file, so they can be read and
+// mapped in place; compressed entries are decompressed into memory when opened.
+// Directory listings scan the whole table of contents.
+class PackVFS : public VFSImpl
+{
+public:
+	// Reads the table of contents of an open pack file. Returns null if it isn't a valid pack
+	static std::shared_ptr<PackVFS> Mount(IoFilePtr file);
+
+	explicit PackVFS(details::PackArchive *archive);
+	~PackVFS() override;
+
+	IoFilePtr OpenFile(const Path &path, uint32_t flags, OpenMode mode) override;
+	IoDirPtr OpenDir(const Path &path) override;
+
+	bool CreateDirectory(const Path &path) override { return false; }
+	bool Delete(const Path &path) override { return false; }
+
+	bool Stat(const Path &path, StatBuf *buf) override;
+	bool CheckAccess(const Path &path, uint32_t flags) override;
+
+	uint64_t GetFreeBytesForWriting(const Path &path) override { return 0; }
+
+private:
+	RefPtr<details::PackArchive> archive_;
+};
+
+} // namespace lune
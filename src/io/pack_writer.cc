@@ -0,0 +1,403 @@
+#include "pack_writer.h"
+
+#include "chain.h"
+#include "util/compress.h"
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+namespace lune {
+
+namespace {
+uint64_t Align(uint64_t n, uint64_t alignment)
+{
+	return (n + alignment - 1) & ~(alignment - 1);
+}
+
+// FNV-1a taken a word at a time. Only used to find duplicate candidates, which are compared in full
+uint64_t HashContents(Blob *b)
+{
+	auto data = b->GetContents();
+	auto p = (const uint8_t *)data.first;
+	size_t n = data.second;
+	uint64_t h = 0xcbf29ce484222325ULL ^ n;
+	for(; n >= 8; p += 8, n -= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+	}
+	for(; n; p++, n--) h = (h ^ *p) * 0x100000001b3ULL;
+	return h;
+}
+
+std::string Extension(std::string_view name)
+{
+	size_t slash = name.rfind('/');
+	size_t dot = name.rfind('.');
+	if(dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash))
+		return std::string();
+	std::string ext(name.substr(dot + 1));
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return (char)tolower(c); });
+	return ext;
+}
+
+bool WriteAll(File &f, const void *p, uint64_t n, uint64_t offset)
+{
+	for(uint64_t done = 0; done < n;) {
+		size_t k = (size_t)std::min<uint64_t>(n - done, IoChain::kMaxOpBytes);
+		if(f.WriteAbs((const uint8_t *)p + done, k, offset + done) != k)
+			return false;
+		done += k;
+	}
+	return true;
+}
+} // namespace
+
+struct PackWriter::Content
+{
+	RefPtr<Blob> data;
+	uint64_t size = 0;
+	uint64_t hash = 0;
+	// The first item with these contents
+	uint32_t item = 0;
+	// What goes in the pack, if not data itself
+	RefPtr<Blob> stored;
+	// Compressed without the dictionary, kept while deciding whether the dictionary pays for itself
+	RefPtr<Blob> fallback;
+	uint32_t flags = 0;
+	uint64_t offset = 0;
+
+	uint64_t stored_size() const { return stored ? stored->GetSize() : size; }
+};
+
+PackWriter::PackWriter(const Options &options) : options_(options) {}
+
+PackWriter::~PackWriter() = default;
+
+bool PackWriter::AddTree(VFSImpl *vfs, const std::string &root)
+{
+	return AddDir(vfs, root, std::string());
+}
+
+bool PackWriter::AddDir(VFSImpl *vfs, const std::string &root, const std::string &prefix)
+{
+	auto dir = vfs->OpenDir(root);
+	if(!dir)
+		return false;
+	std::vector<FileInfo> found;
+	std::vector<std::string> names;
+	dir->EnumerateFiles(nullptr, [&](const FileInfo &fi) {
+		names.push_back(fi.filename);
+		found.push_back(fi);
+		return true;
+	});
+
+	bool ok = true;
+	for(size_t i = 0; i < names.size(); i++) {
+		std::string path = root + "/" + names[i];
+		std::string name = prefix.empty() ? names[i] : prefix + "/" + names[i];
+		if(found[i].flags & file_flags::kIsDir) {
+			ok &= AddDir(vfs, path, name);
+			continue;
+		}
+		auto f = vfs->OpenFile(path, file_flags::kReadOnly, OpenMode::OpenExisting);
+		if(!f) {
+			ok = false;
+			continue;
+		}
+		uint64_t size = f->GetFileSize();
+		File file(std::move(f));
+		RefPtr<Blob> data;
+		// Mapped, so a large tree doesn't have to fit in memory at once
+		if(size)
+			data = file.MapToBlob(0, size, true);
+		if(!data || data->GetSize() != size) {
+			data = new OwnedMemoryBlob((size_t)size);
+			if(file.ReadAbs(data->GetData(), (size_t)size, 0) != size) {
+				ok = false;
+				continue;
+			}
+		}
+		AddFile(name, std::move(data));
+	}
+	return ok;
+}
+
+void PackWriter::AddFile(std::string_view name, RefPtr<Blob> data)
+{
+	while(!name.empty() && name.front() == '/') name.remove_prefix(1);
+	items_.push_back(Item{std::string(name), std::move(data), 0});
+}
+
+void PackWriter::SetAccessOrder(std::string_view trace)
+{
+	trace_.clear();
+	while(!trace.empty()) {
+		size_t eol = trace.find('\n');
+		auto line = trace.substr(0, eol);
+		trace.remove_prefix(eol == std::string_view::npos ? trace.size() : eol + 1);
+		while(!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.remove_suffix(1);
+		while(!line.empty() && line.front() == '/') line.remove_prefix(1);
+		if(!line.empty())
+			trace_.emplace_back(line);
+	}
+}
+
+void PackWriter::Dedup(std::vector<Content> *contents)
+{
+	std::vector<uint64_t> hashes(items_.size());
+	ParallelFor(
+	    GetPoolUser(), items_.size(), [&](uint32_t, size_t i) { hashes[i] = HashContents(items_[i].data.get()); });
+
+	std::unordered_multimap<uint64_t, uint32_t> seen;
+	for(uint32_t i = 0; i < items_.size(); i++) {
+		Item &item = items_[i];
+		uint64_t size = item.data->GetSize();
+		auto range = seen.equal_range(hashes[i]);
+		auto it = std::find_if(range.first, range.second, [&](auto &kv) {
+			Content &c = (*contents)[kv.second];
+			return c.size == size && !memcmp(c.data->GetData(), item.data->GetData(), (size_t)size);
+		});
+		if(it != range.second) {
+			item.content = it->second;
+			continue;
+		}
+		item.content = (uint32_t)contents->size();
+		seen.emplace(hashes[i], item.content);
+		Content c;
+		c.data = item.data;
+		c.size = size;
+		c.hash = hashes[i];
+		c.item = i;
+		contents->push_back(std::move(c));
+	}
+}
+
+RefPtr<Blob> PackWriter::TrainDictionary(const std::vector<Content> &contents)
+{
+	if(!options_.dict_max_file || !options_.dict_size)
+		return nullptr;
+	std::vector<Blob *> samples;
+	for(auto &c : contents) {
+		if(c.size && c.size <= options_.dict_max_file)
+			samples.push_back(c.data.get());
+	}
+	return CompressionAlgorithm::Get(CompressionAlgorithmType::zstd)->TrainDictionary(samples, options_.dict_size);
+}
+
+void PackWriter::Compress(std::vector<Content> *contents, Blob *dict)
+{
+	auto zstd = CompressionAlgorithm::Get(CompressionAlgorithmType::zstd);
+	// Contexts are per worker, as a context only compresses one input at a time
+	uint32_t workers = ParallelWorkers(GetPoolUser());
+	std::vector<std::unique_ptr<CompressionContext>> plain(workers), with_dict(workers);
+	ParallelFor(GetPoolUser(), contents->size(), [&](uint32_t w, size_t i) {
+		Content &c = (*contents)[i];
+		if(!c.size)
+			return;
+		if(!plain[w])
+			plain[w] = zstd->CreateCompressor(nullptr, options_.level);
+		RefPtr<Blob> b = plain[w]->Compress(c.data.get());
+		if(Worthwhile(b.get(), c.size)) {
+			c.stored = b;
+			c.flags = pack::entry_flags::kCompressed;
+		}
+		if(dict && c.size <= options_.dict_max_file) {
+			if(!with_dict[w])
+				with_dict[w] = zstd->CreateCompressor(dict, options_.level);
+			b = with_dict[w]->Compress(c.data.get());
+			if(Worthwhile(b.get(), c.size) && b->GetSize() < c.stored_size()) {
+				c.fallback = std::move(c.stored);
+				c.stored = b;
+				c.flags = pack::entry_flags::kCompressed | pack::entry_flags::kDictionary;
+			}
+		}
+	});
+
+	// The dictionary is stored too, so it has to save more than its own size
+	uint64_t saved = 0;
+	for(auto &c : *contents) {
+		if(c.flags & pack::entry_flags::kDictionary)
+			saved += (c.fallback ? c.fallback->GetSize() : c.size) - c.stored_size();
+	}
+	bool drop = dict && saved <= dict->GetSize();
+	for(auto &c : *contents) {
+		if(drop && (c.flags & pack::entry_flags::kDictionary)) {
+			c.stored = std::move(c.fallback);
+			c.flags = c.stored ? pack::entry_flags::kCompressed : 0;
+		}
+		c.fallback = nullptr;
+	}
+}
+
+bool PackWriter::Worthwhile(Blob *compressed, uint64_t size) const
+{
+	return !compressed->errored() && compressed->GetSize() <= size * (1 - options_.min_saving);
+}
+
+bool PackWriter::Write(IoFilePtr out, Report *report)
+{
+	// Traced files first, in trace order, then everything else by name. Contents are created in this
+	// order, so each one lands where its first reader expects it
+	std::unordered_map<std::string_view, uint32_t> position;
+	for(auto &name : trace_) position.emplace(name, (uint32_t)position.size());
+	auto rank = [&](const Item &item) {
+		auto it = position.find(item.name);
+		return it == position.end() ? UINT32_MAX : it->second;
+	};
+	std::stable_sort(items_.begin(), items_.end(), [&](const Item &a, const Item &b) {
+		uint32_t ra = rank(a), rb = rank(b);
+		return ra != rb ? ra < rb : a.name < b.name;
+	});
+
+	std::vector<Content> contents;
+	Dedup(&contents);
+	RefPtr<Blob> dict = TrainDictionary(contents);
+	Compress(&contents, dict.get());
+	if(std::none_of(contents.begin(), contents.end(),
+	       [](const Content &c) { return c.flags & pack::entry_flags::kDictionary; }))
+		dict = nullptr;
+
+	// Raw entries at least a block long are aligned so they can be mapped and read directly. Smaller
+	// ones, and compressed entries, which are always read whole, are packed tightly
+	pack::Header h = {};
+	memcpy(h.magic, pack::kMagic, sizeof(h.magic));
+	h.version = pack::kVersion;
+	h.alignment = options_.alignment;
+	uint64_t pos = Align(sizeof(h), options_.alignment);
+	for(auto &c : contents) {
+		if(!c.stored && c.size >= options_.alignment)
+			pos = Align(pos, options_.alignment);
+		c.offset = pos;
+		pos += c.stored_size();
+	}
+	h.dict_offset = dict ? pos : 0;
+	h.dict_size = dict ? dict->GetSize() : 0;
+	pos += h.dict_size;
+	h.toc_offset = Align(pos, 8);
+
+	// Every parent directory of a file gets an entry
+	std::map<std::string_view, int> names;
+	for(uint32_t i = 0; i < items_.size(); i++) {
+		std::string_view name = items_[i].name;
+		names[name] = (int)i;
+		for(size_t slash = name.rfind('/'); slash != std::string_view::npos; slash = name.rfind('/', slash - 1)) {
+			names.emplace(name.substr(0, slash), -1);
+			if(!slash)
+				break;
+		}
+	}
+	h.entry_count = (uint32_t)names.size();
+	h.bucket_count = 1;
+	while(h.bucket_count < h.entry_count) h.bucket_count *= 2;
+
+	std::vector<pack::Entry> entries;
+	entries.reserve(names.size());
+	for(auto &[name, item] : names) {
+		pack::Entry e = {};
+		e.hash = pack::HashName(name);
+		e.name_len = (uint32_t)name.size();
+		if(item < 0) {
+			e.flags = pack::entry_flags::kDir;
+		} else {
+			const Content &c = contents[items_[item].content];
+			e.offset = c.offset;
+			e.stored_size = c.stored_size();
+			e.size = c.size;
+			e.flags = c.flags;
+		}
+		entries.push_back(e);
+	}
+	std::vector<std::string_view> sorted_names;
+	for(auto &kv : names) sorted_names.push_back(kv.first);
+
+	// Sort by bucket, keeping each entry's name alongside
+	uint32_t mask = h.bucket_count - 1;
+	std::vector<uint32_t> order(entries.size());
+	for(uint32_t i = 0; i < order.size(); i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(),
+	    [&](uint32_t a, uint32_t b) { return (entries[a].hash & mask) < (entries[b].hash & mask); });
+
+	std::vector<uint32_t> buckets(h.bucket_count + 1, 0);
+	for(auto &e : entries) buckets[(e.hash & mask) + 1]++;
+	for(uint32_t b = 0; b < h.bucket_count; b++) buckets[b + 1] += buckets[b];
+
+	std::string toc((((size_t)h.bucket_count + 1) * sizeof(uint32_t) + 7) & ~(size_t)7, '\0');
+	memcpy(toc.data(), buckets.data(), buckets.size() * sizeof(uint32_t));
+	std::string name_bytes;
+	std::vector<pack::Entry> sorted;
+	for(uint32_t i : order) {
+		pack::Entry e = entries[i];
+		e.name_offset = (uint32_t)name_bytes.size();
+		name_bytes.append(sorted_names[i]);
+		name_bytes.push_back('\0');
+		sorted.push_back(e);
+	}
+	toc.append((const char *)sorted.data(), sorted.size() * sizeof(pack::Entry));
+	toc.append(name_bytes);
+	h.toc_size = toc.size();
+
+	File f(std::move(out));
+	bool ok = WriteAll(f, &h, sizeof(h), 0);
+	for(auto &c : contents) {
+		Blob *b = c.stored ? c.stored.get() : c.data.get();
+		ok = ok && WriteAll(f, b->GetData(), c.stored_size(), c.offset);
+	}
+	if(dict)
+		ok = ok && WriteAll(f, dict->GetData(), h.dict_size, h.dict_offset);
+	ok = ok && WriteAll(f, toc.data(), toc.size(), h.toc_offset);
+	f.Flush();
+	if(!ok)
+		return false;
+
+	if(report) {
+		MakeReport(contents, report);
+		report->dirs = h.entry_count - (uint32_t)items_.size();
+		report->dict_size = h.dict_size;
+		report->pack_size = h.toc_offset + h.toc_size;
+		report->pack_seconds += (h.dict_size + h.toc_size) / options_.read_rate;
+	}
+	return true;
+}
+
+void PackWriter::MakeReport(const std::vector<Content> &contents, Report *report) const
+{
+	*report = Report();
+	std::map<std::string, TypeReport> types;
+	for(auto &item : items_) {
+		const Content &c = contents[item.content];
+		bool first = &items_[c.item] == &item;
+		TypeReport &t = types[Extension(item.name)];
+		t.files++;
+		t.size += c.size;
+		report->files++;
+		report->size += c.size;
+		report->loose_seconds += options_.open_seconds + c.size / options_.read_rate;
+		if(!first) {
+			report->duplicates++;
+			continue;
+		}
+		t.stored_size += c.stored_size();
+		report->unique_size += c.size;
+		report->stored_size += c.stored_size();
+		report->pack_seconds += c.stored_size() / options_.read_rate;
+		if(c.flags & pack::entry_flags::kCompressed) {
+			report->compressed++;
+			report->pack_seconds += c.size / options_.decode_rate;
+		}
+		if(c.flags & pack::entry_flags::kDictionary)
+			report->dictionary++;
+	}
+	// The pack itself is opened once
+	report->pack_seconds += options_.open_seconds;
+
+	for(auto &[ext, t] : types) {
+		report->types.push_back(t);
+		report->types.back().ext = ext;
+	}
+	std::sort(report->types.begin(), report->types.end(),
+	    [](const TypeReport &a, const TypeReport &b) { return a.stored_size > b.stored_size; });
+}
+
+} // namespace lune
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "pack.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lune {
+
+// Builds a pack (see pack.h) offline. Files with identical contents are stored once. Files named in an
+// access trace are laid out first, in the order the game first read them, so a load reads the pack front
+// to back. Each file is stored whichever way is smallest: raw, zstd compressed, or for small files,
+// compressed against a dictionary trained on all of them. Compression that saves too little to be worth
+// decoding is not used.
+class PackWriter
+{
+public:
+	struct Options
+	{
+		// Raw entries start on a multiple of this, so they can be mapped. A power of two
+		uint32_t alignment = 4096;
+		int level = 19;
+		// Compression must save at least this fraction of a file
+		double min_saving = 0.1;
+		// Files no bigger than this are compressed with the dictionary where it helps. 0 disables it
+		uint64_t dict_max_file = 16 * 1024;
+		size_t dict_size = 112 * 1024;
+
+		// Models the load time estimate in the report: the cost of opening a file, and read and
+		// decompression throughput in bytes per second
+		double open_seconds = 100e-6;
+		double read_rate = 200e6;
+		double decode_rate = 1000e6;
+	};
+
+	struct TypeReport
+	{
+		// Extension without the dot, or empty
+		std::string ext;
+		uint32_t files = 0;
+		uint64_t size = 0;
+		// Bytes stored for this type. Duplicates count towards the type of the first copy
+		uint64_t stored_size = 0;
+	};
+
+	struct Report
+	{
+		uint32_t files = 0;
+		uint32_t dirs = 0;
+		uint32_t duplicates = 0;
+		uint32_t compressed = 0;
+		uint32_t dictionary = 0;
+		uint64_t size = 0;
+		uint64_t unique_size = 0;
+		uint64_t stored_size = 0;
+		uint64_t dict_size = 0;
+		uint64_t pack_size = 0;
+		// Modelled time to read every file, loose and from the pack
+		double loose_seconds = 0;
+		double pack_seconds = 0;
+		// Sorted by stored size, largest first
+		std::vector<TypeReport> types;
+	};
+
+	explicit PackWriter(const Options &options);
+	~PackWriter();
+
+	PackWriter(const PackWriter &) = delete;
+	void operator=(const PackWriter &) = delete;
+
+	// Adds every file under root in vfs, named relative to root. Returns false if something could not
+	// be read
+	bool AddTree(VFSImpl *vfs, const std::string &root);
+	// Adds a file by its relative name. Parent directories are added implicitly
+	void AddFile(std::string_view name, RefPtr<Blob> data);
+
+	// Takes an access trace, one path per line. Repeated paths keep their first position; paths that
+	// aren't in the pack are ignored
+	void SetAccessOrder(std::string_view trace);
+
+	// Dedups and compresses the files on the user pool, then writes the pack to out
+	bool Write(IoFilePtr out, Report *report);
+
+private:
+	struct Item
+	{
+		std::string name;
+		RefPtr<Blob> data;
+		uint32_t content;
+	};
+	struct Content;
+
+	bool AddDir(VFSImpl *vfs, const std::string &root, const std::string &prefix);
+	void Dedup(std::vector<Content> *contents);
+	RefPtr<Blob> TrainDictionary(const std::vector<Content> &contents);
+	void Compress(std::vector<Content> *contents, Blob *dict);
+	bool Worthwhile(Blob *compressed, uint64_t size) const;
+	void MakeReport(const std::vector<Content> &contents, Report *report) const;
+
+	Options options_;
+	std::vector<Item> items_;
+	std::vector<std::string> trace_;
+};
+
+} // namespace lune
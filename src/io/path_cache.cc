@@ -0,0 +1,90 @@
+#include "path_cache.h"
+
+#include <mutex>
+
+namespace lune {
+
+bool VFSPathCache::Find(std::string_view path, uint32_t *where)
+{
+	Shard &s = ShardFor(path);
+	{
+		std::unique_lock<CriticalSection> l(s.lock);
+		auto it = s.map.find(path);
+		if(it != s.map.end()) {
+			*where = it->second;
+			l.unlock();
+			hits_.fetch_add(1, std::memory_order_relaxed);
+			if(*where == kMissing)
+				negative_hits_.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	misses_.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+void VFSPathCache::Insert(std::string_view path, uint32_t where, uint64_t generation)
+{
+	Shard &s = ShardFor(path);
+	std::unique_lock<CriticalSection> l(s.lock);
+	// Checked under the shard lock: invalidations bump a generation before they erase anything, so either
+	// this sees the new generation or the entry is erased after it goes in
+	if(tree_generation_.load(std::memory_order_acquire) + s.generation.load(std::memory_order_acquire) !=
+	    generation)
+		return;
+	if(s.map.size() >= kMaxShardEntries)
+		s.map.clear();
+	s.map.insert_or_assign(std::string(path), where);
+}
+
+void VFSPathCache::Invalidate(std::string_view path)
+{
+	invalidations_.fetch_add(1, std::memory_order_relaxed);
+	while(path.size() > 1 && path.back() == '/') path.remove_suffix(1);
+	Shard &s = ShardFor(path);
+	std::unique_lock<CriticalSection> l(s.lock);
+	s.generation.fetch_add(1, std::memory_order_acq_rel);
+	if(auto it = s.map.find(path); it != s.map.end())
+		s.map.erase(it);
+	if(auto it = s.map.find(std::string(path) + '/'); it != s.map.end())
+		s.map.erase(it);
+}
+
+void VFSPathCache::InvalidateTree(std::string_view path)
+{
+	tree_generation_.fetch_add(1, std::memory_order_acq_rel);
+	invalidations_.fetch_add(1, std::memory_order_relaxed);
+	while(path.size() > 1 && path.back() == '/') path.remove_suffix(1);
+	for(auto &s : shards_) {
+		std::unique_lock<CriticalSection> l(s.lock);
+		std::erase_if(s.map, [&](const auto &kv) {
+			std::string_view p = kv.first;
+			return p.starts_with(path) && (p.size() == path.size() || p[path.size()] == '/' || path.back() == '/');
+		});
+	}
+}
+
+void VFSPathCache::Clear()
+{
+	tree_generation_.fetch_add(1, std::memory_order_acq_rel);
+	invalidations_.fetch_add(1, std::memory_order_relaxed);
+	for(auto &s : shards_) {
+		std::unique_lock<CriticalSection> l(s.lock);
+		s.map.clear();
+	}
+}
+
+void VFSPathCache::Get(Counters *out) const
+{
+	out->hits = hits_.load(std::memory_order_relaxed);
+	out->negative_hits = negative_hits_.load(std::memory_order_relaxed);
+	out->misses = misses_.load(std::memory_order_relaxed);
+	out->invalidations = invalidations_.load(std::memory_order_relaxed);
+	out->entries = 0;
+	for(auto &s : shards_) {
+		std::unique_lock<CriticalSection> l(s.lock);
+		out->entries += s.map.size();
+	}
+}
+
+} // namespace lune
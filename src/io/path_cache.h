@@ -0,0 +1,87 @@
+#pragma once
+
+#include "sys/sync.h"
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace lune {
+
+// Remembers how paths resolved: which layer of a VFS served them, or that they don't exist, so repeated
+// lookups skip the probing. Safe to use from any thread.
+// Results computed while something was invalidated are never stored, so a lookup racing a write can't
+// bring a stale answer back
+class VFSPathCache
+{
+public:
+	// Recorded for paths known not to exist
+	static constexpr uint32_t kMissing = UINT32_MAX;
+
+	struct Counters
+	{
+		uint64_t hits;
+		// Hits that found the path to be missing
+		uint64_t negative_hits;
+		uint64_t misses;
+		uint64_t invalidations;
+		uint64_t entries;
+	};
+
+	// Returns false, counting a miss, if path isn't cached
+	bool Find(std::string_view path, uint32_t *where);
+
+	// Read before resolving path, and passed to Insert with the result. Only invalidations that could
+	// touch path change it: those of its shard, and tree-wide ones
+	uint64_t generation(std::string_view path) const
+	{
+		return tree_generation_.load(std::memory_order_acquire) +
+		       ShardFor(path).generation.load(std::memory_order_acquire);
+	}
+	void Insert(std::string_view path, uint32_t where, uint64_t generation);
+
+	// Forgets path alone: enough when a file, or an empty directory, is created or deleted
+	void Invalidate(std::string_view path);
+	// Forgets path and everything beneath it, for a directory whose contents changed as a whole
+	void InvalidateTree(std::string_view path);
+	void Clear();
+
+	void Get(Counters *out) const;
+
+private:
+	struct Hash
+	{
+		using is_transparent = void;
+		size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+	};
+	struct Shard
+	{
+		mutable CriticalSection lock;
+		std::unordered_map<std::string, uint32_t, Hash, std::equal_to<>> map;
+		// Bumped under the lock by exact invalidations of paths in this shard
+		std::atomic<uint64_t> generation{0};
+	};
+	static constexpr uint32_t kShards = 16;
+	// A full shard is emptied rather than evicting entry by entry
+	static constexpr size_t kMaxShardEntries = 4096;
+
+	// Trailing slashes don't pick the shard, so Invalidate finds a directory however it was spelled
+	static size_t ShardIndex(std::string_view path)
+	{
+		while(path.size() > 1 && path.back() == '/') path.remove_suffix(1);
+		return Hash()(path) % kShards;
+	}
+	Shard &ShardFor(std::string_view path) { return shards_[ShardIndex(path)]; }
+	const Shard &ShardFor(std::string_view path) const { return shards_[ShardIndex(path)]; }
+
+	Shard shards_[kShards];
+	// Both only grow, so their sum changes whenever either does
+	std::atomic<uint64_t> tree_generation_{0};
+	std::atomic<uint64_t> hits_{0};
+	std::atomic<uint64_t> negative_hits_{0};
+	std::atomic<uint64_t> misses_{0};
+	std::atomic<uint64_t> invalidations_{0};
+};
+
+} // namespace lune
@@ -0,0 +1,744 @@
+#include "ram_vfs.h"
+
+#include "sys/thread.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <random>
+#include <vector>
+
+namespace lune {
+
+namespace details {
+namespace {
+// Extents are allocated in whole blocks and at least double when they grow, so appends are amortised
+constexpr uint64_t kExtentBlock = 4096;
+// Spills copy out this much at a time under the file's lock, so writers aren't held up for long
+constexpr size_t kSpillChunk = 1 << 20;
+
+class Extent : public Refcounted
+{
+public:
+	explicit Extent(uint64_t capacity) : data((uint8_t *)malloc((size_t)capacity)), capacity(capacity) {}
+	~Extent() override { free(data); }
+
+	uint8_t *const data;
+	const uint64_t capacity;
+};
+
+// Names are relative, without leading or trailing slashes. The root is the empty name. Returns false for
+// paths with empty, "." or ".." components
+bool Normalize(Path p, std::string *out)
+{
+	while(!p.empty() && p.front() == '/') p.remove_prefix(1);
+	while(!p.empty() && p.back() == '/') p.remove_suffix(1);
+	for(Path rest = p; !rest.empty();) {
+		size_t slash = rest.find('/');
+		Path part = rest.substr(0, slash);
+		if(part.empty() || part == "." || part == "..")
+			return false;
+		rest.remove_prefix(slash == Path::npos ? rest.size() : slash + 1);
+	}
+	out->assign(p);
+	return true;
+}
+
+std::string_view Parent(std::string_view name)
+{
+	size_t slash = name.rfind('/');
+	return slash == std::string_view::npos ? std::string_view() : name.substr(0, slash);
+}
+
+uint64_t SgBytes(const AsyncOp *op)
+{
+	uint64_t n = 0;
+	for(int i = 0; i < op->nsg; i++) n += op->sg[i].len;
+	return n;
+}
+} // namespace
+
+class RamNode : public Refcounted
+{
+public:
+	RamNode(RamStore *store, bool dir);
+	~RamNode() override;
+
+	// The spilled file if there is one, else the resident size. Callers don't hold lock
+	IoFilePtr Spilled(uint64_t *size, uint64_t *version = nullptr);
+	uint64_t FileSize(uint64_t *version = nullptr);
+	// Callers hold lock. Returns false if over a hard budget
+	bool Reserve(uint64_t bytes);
+	// Callers hold lock
+	void Resize(uint64_t bytes);
+
+	RefPtr<RamStore> store;
+	const bool dir;
+
+	CriticalSection lock;
+	// A file's data lives in one of these. An empty resident file may have neither
+	RefPtr<Extent> extent;
+	IoFilePtr spilled;
+	std::string spill_name;
+	uint64_t size = 0;
+	// Restamped from the store's clock on every change, so a spill can tell the file changed while it was
+	// being written out. Being store-wide, a recreated file never repeats an old file's version
+	uint64_t version;
+	// Live mappings. A mapped file is not spilled
+	uint32_t maps = 0;
+
+	std::atomic<uint64_t> last_use{0};
+};
+
+class RamStore : public Refcounted
+{
+public:
+	RamStore(uint64_t budget, std::shared_ptr<VFSImpl> spill);
+
+	IoFilePtr OpenFile(Path path, uint32_t flags, OpenMode mode);
+	IoDirPtr OpenDir(Path path);
+	bool Stat(Path path, StatBuf *buf);
+	// Calls fn with each direct child of a directory, outside the lock
+	bool Enumerate(const std::string &dir, const char *query, const std::function<bool(const FileInfo &)> &fn);
+
+	// Accounts for resident bytes. Fails if that would go over a budget there is no spilling from
+	bool Charge(uint64_t bytes);
+	void Refund(uint64_t bytes) { resident.fetch_sub(bytes, std::memory_order_relaxed); }
+	uint64_t Tick() { return clock.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+	// Starts spilling on the I/O pool if over budget and it isn't already
+	void MaybeSpill();
+
+	// Callers hold lock
+	RamNode *Find(std::string_view name)
+	{
+		auto it = tree.find(name);
+		return it == tree.end() ? nullptr : it->second.get();
+	}
+	bool IsDir(std::string_view name)
+	{
+		if(name.empty())
+			return true;
+		RamNode *n = Find(name);
+		return n && n->dir;
+	}
+
+	const uint64_t budget;
+	const std::shared_ptr<VFSImpl> spill;
+
+	// Guards the tree and the spill state. Taken before a node's lock, never after
+	CriticalSection lock;
+	std::map<std::string, RefPtr<RamNode>, std::less<>> tree;
+
+	std::atomic<uint64_t> resident{0};
+
+private:
+	void Spill();
+	// Moves the least recently used file out to the spill VFS. Returns false if there was nothing it
+	// could move
+	bool SpillOne();
+
+	std::atomic<uint64_t> clock{0};
+	bool spilling_ = false;
+	uint64_t spill_count_ = 0;
+	// Spill files of several processes may share a directory
+	std::string spill_prefix_;
+};
+
+namespace {
+struct RamRegion : public ShmRegion
+{
+	~RamRegion() override
+	{
+		std::unique_lock<CriticalSection> l(node->lock);
+		node->maps--;
+		// Writes through the mapping aren't seen by the file, so count them as a change
+		if(writable)
+			node->version = node->store->Tick();
+	}
+
+	RefPtr<RamNode> node;
+	RefPtr<Extent> extent;
+	bool writable;
+};
+
+class RamFile : public IoFile
+{
+public:
+	RamFile(RamNode *node, uint32_t flags) : node_(node), flags_(flags) {}
+
+	void BeginRead(AsyncOp *op) override
+	{
+		IoFilePtr f;
+		uint64_t n = 0;
+		bool eof = false;
+		{
+			std::unique_lock<CriticalSection> l(node_->lock);
+			if(node_->spilled) {
+				f = node_->spilled;
+			} else if(op->offset >= node_->size) {
+				eof = true;
+			} else {
+				n = std::min(SgBytes(op), node_->size - op->offset);
+				op->CopyToSg(0, node_->extent->data + op->offset, n);
+				node_->last_use.store(node_->store->Tick(), std::memory_order_relaxed);
+			}
+		}
+		if(f)
+			f->BeginRead(op);
+		else if(eof)
+			op->CompleteErr(io_err::kEOF);
+		else
+			op->Complete((uint32_t)n);
+	}
+
+	void BeginWrite(AsyncOp *op) override
+	{
+		if(!AllowWrites()) {
+			op->CompleteErr(-1);
+			return;
+		}
+		if(flags_ & file_flags::kAppendOnly)
+			op->offset = kAppendOffset;
+		IoFilePtr f;
+		uint64_t n = SgBytes(op);
+		if(!n) {
+			op->Complete(0);
+			return;
+		}
+		bool ok = true;
+		{
+			std::unique_lock<CriticalSection> l(node_->lock);
+			if(node_->spilled) {
+				f = node_->spilled;
+				node_->version = node_->store->Tick();
+			} else {
+				uint64_t offset = op->offset == kAppendOffset ? node_->size : op->offset;
+				ok = offset + n >= offset && node_->Reserve(offset + n);
+				if(ok) {
+					if(offset > node_->size)
+						memset(node_->extent->data + node_->size, 0, offset - node_->size);
+					uint8_t *p = node_->extent->data + offset;
+					for(int i = 0; i < op->nsg; i++) {
+						memcpy(p, op->sg[i].buf, op->sg[i].len);
+						p += op->sg[i].len;
+					}
+					node_->size = std::max(node_->size, offset + n);
+					node_->version = node_->store->Tick();
+					node_->last_use.store(node_->store->Tick(), std::memory_order_relaxed);
+				}
+			}
+		}
+		if(f) {
+			// Spill files aren't opened for appending, so the end is resolved here
+			if(op->offset == kAppendOffset)
+				op->offset = f->GetFileSize();
+			f->BeginWrite(op);
+			return;
+		}
+		if(!ok) {
+			op->CompleteErr(-1);
+			return;
+		}
+		node_->store->MaybeSpill();
+		op->Complete((uint32_t)n);
+	}
+
+	void Flush() override
+	{
+		uint64_t size;
+		if(auto f = node_->Spilled(&size))
+			f->Flush();
+	}
+
+	bool AllowWrites() const override { return !(flags_ & file_flags::kReadOnly); }
+
+	uint64_t GetFileSize() const override { return node_->FileSize(); }
+
+	bool Sync() override
+	{
+		uint64_t size;
+		if(auto f = node_->Spilled(&size))
+			return f->Sync();
+		return false;
+	}
+
+	uint64_t GetDeviceId() const override
+	{
+		uint64_t size;
+		if(auto f = node_->Spilled(&size))
+			return f->GetDeviceId();
+		return 0;
+	}
+
+	void Truncate(uint64_t bytes) override
+	{
+		if(!AllowWrites())
+			return;
+		IoFilePtr f;
+		{
+			std::unique_lock<CriticalSection> l(node_->lock);
+			if(node_->spilled) {
+				f = node_->spilled;
+				node_->version = node_->store->Tick();
+			} else {
+				node_->Resize(bytes);
+			}
+		}
+		if(f)
+			f->Truncate(bytes);
+		else
+			node_->store->MaybeSpill();
+	}
+
+	std::unique_ptr<ShmRegion> MapRegion(void *addr, uint64_t offset, uint64_t size, bool ro) override
+	{
+		// The data can't be moved to a caller's address
+		if(addr || (!ro && !AllowWrites()))
+			return nullptr;
+		IoFilePtr f;
+		{
+			std::unique_lock<CriticalSection> l(node_->lock);
+			if(node_->spilled) {
+				f = node_->spilled;
+			} else {
+				if(offset > node_->size)
+					return nullptr;
+				auto r = std::make_unique<RamRegion>();
+				r->offset = offset;
+				r->size = (size_t)(size ? std::min(size, node_->size - offset) : node_->size - offset);
+				r->ptr = node_->extent ? node_->extent->data + offset : nullptr;
+				r->node = node_;
+				r->extent = node_->extent;
+				r->writable = !ro;
+				node_->maps++;
+				node_->last_use.store(node_->store->Tick(), std::memory_order_relaxed);
+				return r;
+			}
+		}
+		return f->MapRegion(addr, offset, size, ro);
+	}
+
+private:
+	RefPtr<RamNode> node_;
+	uint32_t flags_;
+};
+
+class RamDir : public IoDir
+{
+public:
+	RamDir(RamStore *store, std::string_view path) : store_(store), path_(path) {}
+
+	bool EnumerateFiles(const char *query, std::function<bool(const FileInfo &)> fn) override
+	{
+		return store_->Enumerate(path_, query, fn);
+	}
+
+	RefPtr<IoDir> OpenSubdir(const Path &path) override
+	{
+		if(!path.empty() && path[0] == '/')
+			return nullptr;
+		return store_->OpenDir(Join(path));
+	}
+	RefPtr<IoFile> OpenFile(const Path &path, uint32_t flags, OpenMode mode) override
+	{
+		if(!path.empty() && path[0] == '/')
+			return nullptr;
+		return store_->OpenFile(Join(path), flags, mode);
+	}
+
+private:
+	std::string Join(const Path &path) const
+	{
+		std::string s = path_;
+		if(!s.empty())
+			s.push_back('/');
+		s.append(path);
+		return s;
+	}
+
+	RefPtr<RamStore> store_;
+	std::string path_;
+};
+} // namespace
+
+RamNode::RamNode(RamStore *store, bool dir) : store(store), dir(dir), version(store->Tick())
+{
+	last_use.store(version, std::memory_order_relaxed);
+}
+
+RamNode::~RamNode()
+{
+	if(extent)
+		store->Refund(extent->capacity);
+	if(spilled) {
+		spilled = nullptr;
+		store->spill->Delete(spill_name);
+	}
+}
+
+IoFilePtr RamNode::Spilled(uint64_t *size, uint64_t *version)
+{
+	std::unique_lock<CriticalSection> l(lock);
+	*size = this->size;
+	if(version)
+		*version = this->version;
+	return spilled;
+}
+
+uint64_t RamNode::FileSize(uint64_t *version)
+{
+	uint64_t size;
+	if(auto f = Spilled(&size, version))
+		return f->GetFileSize();
+	return size;
+}
+
+bool RamNode::Reserve(uint64_t bytes)
+{
+	uint64_t capacity = extent ? extent->capacity : 0;
+	if(bytes <= capacity)
+		return true;
+	// Grown into a new extent rather than realloc'd in place, as mappings may still point at the old one
+	uint64_t grown = std::max(bytes, capacity * 2);
+	grown = (grown + kExtentBlock - 1) & ~(kExtentBlock - 1);
+	if(!store->Charge(grown))
+		return false;
+	RefPtr<Extent> e = new Extent(grown);
+	if(size)
+		memcpy(e->data, extent->data, (size_t)size);
+	if(extent)
+		store->Refund(capacity);
+	extent = std::move(e);
+	return true;
+}
+
+void RamNode::Resize(uint64_t bytes)
+{
+	if(!bytes) {
+		// Emptied files give their memory back straight away
+		if(extent)
+			store->Refund(extent->capacity);
+		extent = nullptr;
+	} else if(bytes > size) {
+		if(!Reserve(bytes))
+			return;
+		memset(extent->data + size, 0, (size_t)(bytes - size));
+	}
+	size = bytes;
+	version = store->Tick();
+	last_use.store(store->Tick(), std::memory_order_relaxed);
+}
+
+RamStore::RamStore(uint64_t budget, std::shared_ptr<VFSImpl> spill) : budget(budget), spill(std::move(spill))
+{
+	std::random_device rd;
+	char buf[32];
+	snprintf(buf, sizeof(buf), "lune-ram-%08x%08x-", rd(), rd());
+	spill_prefix_ = buf;
+	// The root is the empty name, so it sorts first and is never a file
+	tree.emplace(std::string(), new RamNode(this, true));
+}
+
+IoFilePtr RamStore::OpenFile(Path path, uint32_t flags, OpenMode mode)
+{
+	std::string name;
+	if(!Normalize(path, &name) || name.empty())
+		return nullptr;
+	RefPtr<RamNode> node;
+	bool existed;
+	{
+		std::unique_lock<CriticalSection> l(lock);
+		node = Find(name);
+		existed = node;
+		if(node && node->dir)
+			return nullptr;
+		switch(mode) {
+		case OpenMode::OpenExisting:
+		case OpenMode::TruncateExisting:
+			if(!node)
+				return nullptr;
+			break;
+		case OpenMode::CreateIfNotExist:
+			if(node)
+				return nullptr;
+			break;
+		default:
+			break;
+		}
+		if(!node) {
+			if(!IsDir(Parent(name)))
+				return nullptr;
+			node = new RamNode(this, false);
+			tree.emplace(std::move(name), node);
+		}
+	}
+	RefPtr<RamFile> f = new RamFile(node.get(), flags);
+	if(existed && (mode == OpenMode::CreateOrTruncate || mode == OpenMode::TruncateExisting)) {
+		if(!f->AllowWrites())
+			return nullptr;
+		f->Truncate(0);
+	}
+	return f;
+}
+
+IoDirPtr RamStore::OpenDir(Path path)
+{
+	std::string name;
+	if(!Normalize(path, &name))
+		return nullptr;
+	std::unique_lock<CriticalSection> l(lock);
+	if(!IsDir(name))
+		return nullptr;
+	return new RamDir(this, name);
+}
+
+bool RamStore::Stat(Path path, StatBuf *buf)
+{
+	std::string name;
+	if(!Normalize(path, &name))
+		return false;
+	RefPtr<RamNode> node;
+	{
+		std::unique_lock<CriticalSection> l(lock);
+		node = Find(name);
+	}
+	if(!node)
+		return false;
+	if(node->dir) {
+		buf->size = 0;
+		buf->flags = file_flags::kIsDir;
+		return true;
+	}
+	// The version stands in for a modification time
+	buf->size = node->FileSize(&buf->mtime);
+	buf->flags = file_flags::kIsFile;
+	return true;
+}
+
+bool RamStore::Enumerate(const std::string &dir, const char *query, const std::function<bool(const FileInfo &)> &fn)
+{
+	std::string prefix = dir;
+	if(!prefix.empty())
+		prefix.push_back('/');
+	// Collected first, as fn may well open the files it is given
+	std::vector<std::pair<std::string, RefPtr<RamNode>>> children;
+	{
+		std::unique_lock<CriticalSection> l(lock);
+		if(!IsDir(dir))
+			return false;
+		for(auto it = tree.lower_bound(prefix); it != tree.end() && it->first.starts_with(prefix); ++it) {
+			std::string_view leaf = std::string_view(it->first).substr(prefix.size());
+			if(leaf.empty() || leaf.find('/') != std::string_view::npos)
+				continue;
+			children.emplace_back(leaf, it->second);
+		}
+	}
+	for(auto &c : children) {
+		FileInfo fi;
+		fi.filename = c.first.c_str();
+		if(!MatchFileQuery(query, fi.filename))
+			continue;
+		fi.flags = c.second->dir ? file_flags::kIsDir : file_flags::kIsFile;
+		fi.size = c.second->dir ? 0 : c.second->FileSize();
+		if(!fn(fi))
+			break;
+	}
+	return true;
+}
+
+bool RamStore::Charge(uint64_t bytes)
+{
+	uint64_t now = resident.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	if(!spill && now > budget) {
+		Refund(bytes);
+		return false;
+	}
+	return true;
+}
+
+void RamStore::MaybeSpill()
+{
+	if(!spill || resident.load(std::memory_order_relaxed) <= budget)
+		return;
+	{
+		std::unique_lock<CriticalSection> l(lock);
+		if(spilling_)
+			return;
+		spilling_ = true;
+	}
+	AddRef();
+	GetPoolIo()->PostTask([this]() {
+		Spill();
+		Release();
+	});
+}
+
+void RamStore::Spill()
+{
+	bool stuck = false;
+	while(true) {
+		if(!stuck && resident.load(std::memory_order_relaxed) > budget) {
+			stuck = !SpillOne();
+			continue;
+		}
+		// A write that went over budget meanwhile saw a spill running and left it to this one, so check
+		// again under the lock before stopping. When everything left is mapped, the next write retries
+		std::unique_lock<CriticalSection> l(lock);
+		if(!stuck && resident.load(std::memory_order_relaxed) > budget)
+			continue;
+		spilling_ = false;
+		return;
+	}
+}
+
+bool RamStore::SpillOne()
+{
+	RefPtr<RamNode> victim;
+	std::string name;
+	{
+		std::unique_lock<CriticalSection> l(lock);
+		uint64_t oldest = UINT64_MAX;
+		for(auto &[_, node] : tree) {
+			if(node->dir)
+				continue;
+			std::unique_lock<CriticalSection> nl(node->lock);
+			uint64_t use = node->last_use.load(std::memory_order_relaxed);
+			if(node->extent && !node->maps && use < oldest) {
+				oldest = use;
+				victim = node;
+			}
+		}
+		if(!victim)
+			return false;
+		name = spill_prefix_ + std::to_string(++spill_count_);
+	}
+
+	uint64_t version, size;
+	{
+		std::unique_lock<CriticalSection> l(victim->lock);
+		version = victim->version;
+		size = victim->size;
+	}
+	IoFilePtr f = spill->OpenFile(name, 0, OpenMode::CreateOrTruncate);
+	if(!f)
+		return false;
+
+	// Copied out a chunk at a time, giving up as soon as the file changes
+	bool written = true, changed = false;
+	std::vector<uint8_t> chunk(std::min<uint64_t>(size, kSpillChunk));
+	File out(f);
+	for(uint64_t pos = 0; pos < size && written && !changed;) {
+		size_t n = (size_t)std::min<uint64_t>(size - pos, kSpillChunk);
+		{
+			std::unique_lock<CriticalSection> l(victim->lock);
+			changed = victim->version != version || !victim->extent;
+			if(!changed)
+				memcpy(chunk.data(), victim->extent->data + pos, n);
+		}
+		written = !changed && out.WriteAbs(chunk.data(), n, pos) == n;
+		pos += n;
+	}
+	if(written && !changed) {
+		std::unique_lock<CriticalSection> l(victim->lock);
+		if(victim->version == version && !victim->maps && !victim->spilled) {
+			if(victim->extent)
+				Refund(victim->extent->capacity);
+			victim->extent = nullptr;
+			victim->spilled = std::move(f);
+			victim->spill_name = name;
+			return true;
+		}
+		changed = true;
+	}
+	f = nullptr;
+	spill->Delete(name);
+	// A file that changed is worth another try; a spill VFS that can't take the data isn't
+	return changed;
+}
+} // namespace details
+
+RamVFS::RamVFS(uint64_t budget, std::shared_ptr<VFSImpl> spill) : store_(new details::RamStore(budget, std::move(spill)))
+{
+}
+
+RamVFS::~RamVFS()
+{
+	// Nodes hold the store, so the tree is emptied to free whatever no open file still uses
+	std::map<std::string, RefPtr<details::RamNode>, std::less<>> tree;
+	std::unique_lock<CriticalSection> l(store_->lock);
+	tree.swap(store_->tree);
+	l.unlock();
+}
+
+IoFilePtr RamVFS::OpenFile(const Path &path, uint32_t flags, OpenMode mode)
+{
+	return store_->OpenFile(path, flags, mode);
+}
+
+IoDirPtr RamVFS::OpenDir(const Path &path)
+{
+	return store_->OpenDir(path);
+}
+
+bool RamVFS::CreateDirectory(const Path &path)
+{
+	std::string name;
+	if(!details::Normalize(path, &name) || name.empty())
+		return false;
+	std::unique_lock<CriticalSection> l(store_->lock);
+	if(store_->Find(name) || !store_->IsDir(details::Parent(name)))
+		return false;
+	store_->tree.emplace(std::move(name), new details::RamNode(store_.get(), true));
+	return true;
+}
+
+bool RamVFS::Delete(const Path &path)
+{
+	std::string name;
+	if(!details::Normalize(path, &name) || name.empty())
+		return false;
+	// Released outside the lock, as dropping a spilled file deletes it from the spill VFS. Files still
+	// open keep working until closed
+	RefPtr<details::RamNode> node;
+	std::unique_lock<CriticalSection> l(store_->lock);
+	auto it = store_->tree.find(name);
+	if(it == store_->tree.end())
+		return false;
+	if(it->second->dir) {
+		std::string prefix = name + "/";
+		auto child = store_->tree.lower_bound(prefix);
+		if(child != store_->tree.end() && child->first.starts_with(prefix))
+			return false;
+	}
+	node = std::move(it->second);
+	store_->tree.erase(it);
+	l.unlock();
+	return true;
+}
+
+bool RamVFS::Stat(const Path &path, StatBuf *buf)
+{
+	return store_->Stat(path, buf);
+}
+
+bool RamVFS::CheckAccess(const Path &path, uint32_t flags)
+{
+	StatBuf st;
+	return store_->Stat(path, &st);
+}
+
+uint64_t RamVFS::GetFreeBytesForWriting(const Path &path)
+{
+	if(store_->spill)
+		return store_->spill->GetFreeBytesForWriting("");
+	uint64_t resident = resident_bytes();
+	return resident < store_->budget ? store_->budget - resident : 0;
+}
+
+uint64_t RamVFS::resident_bytes() const
+{
+	return store_->resident.load(std::memory_order_relaxed);
+}
+
+} // namespace lune
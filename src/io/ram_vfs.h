@@ -0,0 +1,44 @@
+#pragma once
+
+#include "file.h"
+
+#include <memory>
+
+namespace lune {
+
+namespace details {
+class RamStore;
+}
+
+// A VFS held in memory, for scratch data that doesn't need to outlive the process. Each file is one
+// contiguous extent, so it maps without copying, and ops on it complete inline. A write that grows a file
+// past its extent moves it, after which earlier mappings no longer see new writes.
+// Once more than the budget is held, the least recently used files are spilled to the backing VFS on the
+// I/O pool and served from there until they are deleted. Mapped files are never spilled. Without a
+// backing VFS the budget is a hard limit, and writes beyond it fail.
+class RamVFS : public VFSImpl
+{
+public:
+	RamVFS(uint64_t budget, std::shared_ptr<VFSImpl> spill);
+	~RamVFS() override;
+
+	IoFilePtr OpenFile(const Path &path, uint32_t flags, OpenMode mode) override;
+	IoDirPtr OpenDir(const Path &path) override;
+
+	bool CreateDirectory(const Path &path) override;
+	// Directories must be empty
+	bool Delete(const Path &path) override;
+
+	bool Stat(const Path &path, StatBuf *buf) override;
+	bool CheckAccess(const Path &path, uint32_t flags) override;
+
+	uint64_t GetFreeBytesForWriting(const Path &path) override;
+
+	// Bytes of file data held in memory
+	uint64_t resident_bytes() const;
+
+private:
+	RefPtr<details::RamStore> store_;
+};
+
+} // namespace lune
@@ -0,0 +1,313 @@
+#include "scheduler.h"
+
+#include "clock.h"
+#include "direct_io.h"
+#include "logging/logging.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace lune {
+
+namespace {
+// Windows issues the segments of a vectored file read one after another, so merged reads there
+// always land in a single bounce buffer instead
+#if IS_WIN
+constexpr bool kVectoredMerge = false;
+#else
+constexpr bool kVectoredMerge = true;
+#endif
+
+std::atomic<uint32_t> num_schedulers;
+
+uint64_t OpLength(const AsyncOp *op)
+{
+	uint64_t n = 0;
+	for(int i = 0; i < op->nsg; i++) n += op->sg[i].len;
+	return n;
+}
+
+class ScheduledFile : public IoFile
+{
+public:
+	ScheduledFile(IoScheduler *sched, IoFilePtr f) : sched_(sched), f_(std::move(f)) {}
+
+	void BeginRead(AsyncOp *op) override { sched_->Submit(f_.get(), op); }
+	void BeginWrite(AsyncOp *op) override { f_->BeginWrite(op); }
+
+	void Flush() override { f_->Flush(); }
+	bool Sync() override { return f_->Sync(); }
+	bool AllowWrites() const override { return f_->AllowWrites(); }
+	uint64_t GetFileSize() const override { return f_->GetFileSize(); }
+	uint64_t GetDeviceId() const override { return f_->GetDeviceId(); }
+	void Truncate(uint64_t bytes) override { f_->Truncate(bytes); }
+
+	std::unique_ptr<ShmRegion> MapRegion(void *addr, uint64_t offset, uint64_t size, bool ro) override
+	{
+		return f_->MapRegion(addr, offset, size, ro);
+	}
+
+private:
+	IoScheduler *sched_;
+	IoFilePtr f_;
+};
+} // namespace
+
+// A contiguous span of one file read by a single carrier op on behalf of one or more queued ops
+struct IoScheduler::Group
+{
+	IoScheduler *sched;
+	IoFilePtr file;
+	uint64_t start;
+	uint64_t end;
+	bool overlap = false;
+	std::vector<AsyncOp *> ops;
+	std::vector<SGBuf> sg;
+};
+
+IoScheduler::IoScheduler(uint32_t max_depth) : index_(num_schedulers++), max_depth_(std::max(max_depth, 1u)) {}
+
+IoScheduler::~IoScheduler()
+{
+	LUNE_ASSERT(!pending_ && !inflight_);
+}
+
+IoScheduler *IoScheduler::ForDevice(uint64_t device_id)
+{
+	// Never destroyed, as reads may still be in flight at exit
+	static CriticalSection lock;
+	static auto schedulers = new std::map<uint64_t, IoScheduler *>();
+	std::unique_lock<CriticalSection> l(lock);
+	auto &s = (*schedulers)[device_id];
+	if(!s)
+		s = new IoScheduler();
+	return s;
+}
+
+IoFilePtr IoScheduler::Wrap(IoFilePtr f)
+{
+	if(!f)
+		return f;
+	auto sched = ForDevice(f->GetDeviceId());
+	return new ScheduledFile(sched, std::move(f));
+}
+
+void IoScheduler::SetMaxDepth(uint32_t n)
+{
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		max_depth_ = std::max(n, 1u);
+	}
+	Pump();
+}
+
+void IoScheduler::Submit(IoFile *f, AsyncOp *op)
+{
+	uint64_t len = OpLength(op);
+	if(op->offset == kAppendOffset || !len) {
+		f->BeginRead(op);
+		return;
+	}
+	if(op->CompleteIfCancelled())
+		return;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		uint8_t cls = std::min(op->priority, (uint8_t)(io_priority::kCount - 1));
+		Key key(f, op->offset);
+		queues_[cls].emplace(key, Entry{op, f, len});
+		if(op->deadline)
+			deadlines_.emplace(op->deadline, DeadlineRef{cls, key, op});
+		pending_++;
+		submitted_++;
+	}
+	Pump();
+}
+
+void IoScheduler::Take(Group *g, uint8_t cls, std::multimap<Key, Entry>::iterator it)
+{
+	AsyncOp *op = it->second.op;
+	if(op->deadline) {
+		auto range = deadlines_.equal_range(op->deadline);
+		for(auto d = range.first; d != range.second; ++d) {
+			if(d->second.op == op) {
+				deadlines_.erase(d);
+				break;
+			}
+		}
+	}
+	if(g->ops.empty()) {
+		g->file = std::move(it->second.file);
+		g->start = it->first.second;
+		g->end = g->start + it->second.len;
+	} else {
+		if(it->first.second < g->end)
+			g->overlap = true;
+		g->end = std::max(g->end, it->first.second + it->second.len);
+		merged_++;
+	}
+	g->ops.push_back(op);
+	queues_[cls].erase(it);
+	pending_--;
+}
+
+IoScheduler::Group *IoScheduler::NextGroup()
+{
+	auto g = new Group();
+	g->sched = this;
+
+	// Ops that are about to miss their deadline go first, then the most urgent class in elevator order
+	uint64_t now = ClkUpdateRealtime();
+	if(!deadlines_.empty() && deadlines_.begin()->first <= now + kDeadlineSlack) {
+		DeadlineRef ref = deadlines_.begin()->second;
+		auto range = queues_[ref.cls].equal_range(ref.key);
+		for(auto it = range.first; it != range.second; ++it) {
+			if(it->second.op == ref.op) {
+				Take(g, ref.cls, it);
+				break;
+			}
+		}
+	}
+	for(uint8_t cls = 0; g->ops.empty() && cls < io_priority::kCount; cls++) {
+		auto &q = queues_[cls];
+		if(q.empty())
+			continue;
+		auto it = q.lower_bound(cursor_);
+		if(it == q.end())
+			it = q.begin();
+		Take(g, cls, it);
+	}
+	LUNE_ASSERT(!g->ops.empty());
+
+	// Pull in everything queued that touches the span, until it stops growing. Merged spans never
+	// exceed one pool block, so an overlapping group always fits its bounce buffer
+	IoFile *f = g->file.get();
+	uint64_t max_bytes = AlignedBufferPool::Get()->block_size();
+	for(bool grown = true; grown;) {
+		grown = false;
+		for(uint8_t cls = 0; cls < io_priority::kCount; cls++) {
+			auto &q = queues_[cls];
+			auto it = q.lower_bound(Key(f, g->start));
+			while(it != q.end() && it->first.first == f && it->first.second <= g->end &&
+			      g->ops.size() < kMaxMergeOps) {
+				uint64_t end = std::max(g->end, it->first.second + it->second.len);
+				if(end - g->start > max_bytes)
+					break;
+				auto next = std::next(it);
+				Take(g, cls, it);
+				it = next;
+				grown = true;
+			}
+		}
+	}
+	cursor_ = Key(f, g->end);
+	return g;
+}
+
+void IoScheduler::EmitCounters()
+{
+	static const char *const series[5] = {"depth", "pending", "submitted", "merged", "deadline_misses"};
+	int64_t values[5] = {(int64_t)inflight_, (int64_t)pending_, (int64_t)submitted_, (int64_t)merged_,
+	    (int64_t)deadline_misses_};
+	TRACE_COUNTER("io", "IoScheduler", index_, 5, series, values);
+}
+
+void IoScheduler::Pump()
+{
+	std::vector<Group *> ready;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		while(pending_ && inflight_ < max_depth_) {
+			ready.push_back(NextGroup());
+			inflight_++;
+		}
+		EmitCounters();
+	}
+	// Backends may complete inline, which re-enters the scheduler
+	for(auto g : ready) Issue(g);
+}
+
+void IoScheduler::Issue(Group *g)
+{
+	bool all_cancelled = true;
+	for(auto op : g->ops) {
+		if(!op->cancel || !op->cancel->IsCancelled()) {
+			all_cancelled = false;
+			break;
+		}
+	}
+	if(all_cancelled) {
+		for(auto op : g->ops) op->CompleteIfCancelled();
+		Retire(g);
+		return;
+	}
+
+	uint64_t now = ClkUpdateRealtime();
+	for(auto op : g->ops) op->issue_time = now;
+
+	AsyncOp *carrier;
+	if(g->overlap || (g->ops.size() > 1 && !kVectoredMerge)) {
+		carrier = AsyncOp::AllocForMaxWrite(AlignedBufferPool::Get()->Alloc());
+		carrier->default_sg[0].len = (BufLen)(g->end - g->start);
+	} else {
+		carrier = AsyncOp::Alloc();
+		if(g->ops.size() == 1) {
+			carrier->sg = g->ops[0]->sg;
+			carrier->nsg = g->ops[0]->nsg;
+		} else {
+			std::sort(g->ops.begin(), g->ops.end(), [](AsyncOp *a, AsyncOp *b) { return a->offset < b->offset; });
+			for(auto op : g->ops) g->sg.insert(g->sg.end(), op->sg, op->sg + op->nsg);
+			carrier->sg = g->sg.data();
+			carrier->nsg = (int)g->sg.size();
+		}
+	}
+	carrier->offset = g->start;
+	carrier->SetCompletion(&IoScheduler::OnGroupDone, g);
+	g->file->BeginRead(carrier);
+}
+
+void IoScheduler::OnGroupDone(void *ctx, AsyncOp *carrier)
+{
+	auto g = (Group *)ctx;
+	// A short read means the file ended there
+	int32_t err = carrier->err == io_err::kEOF ? 0 : carrier->err;
+	uint64_t data_end = g->start + (err ? 0 : carrier->transferred);
+	const uint8_t *bounce = carrier->buffer ? (const uint8_t *)carrier->sg[0].buf : nullptr;
+
+	uint64_t now = ClkUpdateRealtime();
+	uint32_t misses = 0;
+	for(auto op : g->ops) {
+		if(op->deadline && now > op->deadline)
+			misses++;
+		uint64_t len = OpLength(op);
+		uint64_t n = data_end > op->offset ? std::min(data_end - op->offset, len) : 0;
+		if(bounce && n)
+			op->CopyToSg(0, bounce + (op->offset - g->start), n);
+		if(err)
+			op->CompleteErr(err);
+		else if(!n)
+			op->CompleteErr(io_err::kEOF);
+		else
+			op->Complete((uint32_t)n);
+	}
+	carrier->Release();
+
+	IoScheduler *s = g->sched;
+	{
+		std::unique_lock<CriticalSection> l(s->lock_);
+		s->deadline_misses_ += misses;
+	}
+	s->Retire(g);
+}
+
+void IoScheduler::Retire(Group *g)
+{
+	delete g;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		inflight_--;
+	}
+	Pump();
+}
+
+} // namespace lune
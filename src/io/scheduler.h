@@ -0,0 +1,84 @@
+#pragma once
+
+#include "file.h"
+#include "sys/sync.h"
+
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace lune {
+
+// Sits between File and the backend IoFile of every file on one device. Reads are queued and handed
+// to the device at most max_depth at a time:
+//  - by priority class (AsyncOp::priority), then in ascending offset order within a file, like an
+//    elevator, so that a spinning disk or a busy SSD sees mostly sequential traffic
+//  - an op whose deadline is near or past jumps ahead of everything else
+//  - queued reads that touch or overlap the span being issued, in any class, are merged into a single
+//    read and split back out on completion
+// Writes, appends and empty reads bypass the queue.
+class IoScheduler
+{
+public:
+	static constexpr uint32_t kDefaultQueueDepth = 32;
+	static constexpr uint32_t kMaxMergeOps = 16;
+	// Ops are promoted this many microseconds before their deadline
+	static constexpr uint64_t kDeadlineSlack = 2000;
+
+	explicit IoScheduler(uint32_t max_depth = kDefaultQueueDepth);
+	~IoScheduler();
+
+	IoScheduler(const IoScheduler &) = delete;
+	void operator=(const IoScheduler &) = delete;
+
+	// The scheduler shared by every file on the given device (see IoFile::GetDeviceId)
+	static IoScheduler *ForDevice(uint64_t device_id);
+	// Routes the file's reads through the scheduler of its device
+	static IoFilePtr Wrap(IoFilePtr f);
+
+	void Submit(IoFile *f, AsyncOp *op);
+
+	void SetMaxDepth(uint32_t n);
+
+private:
+	struct Group;
+	typedef std::pair<IoFile *, uint64_t> Key;
+	struct Entry
+	{
+		AsyncOp *op;
+		IoFilePtr file;
+		uint64_t len;
+	};
+	struct DeadlineRef
+	{
+		uint8_t cls;
+		Key key;
+		AsyncOp *op;
+	};
+
+	Group *NextGroup();
+	void Take(Group *g, uint8_t cls, std::multimap<Key, Entry>::iterator it);
+	void Pump();
+	void EmitCounters();
+	void Issue(Group *g);
+	void Retire(Group *g);
+
+	static void OnGroupDone(void *ctx, AsyncOp *carrier);
+
+	uint32_t index_;
+
+	CriticalSection lock_;
+	uint32_t max_depth_;
+	uint32_t inflight_ = 0;
+	uint32_t pending_ = 0;
+	std::multimap<Key, Entry> queues_[io_priority::kCount];
+	std::multimap<uint64_t, DeadlineRef> deadlines_;
+	// Where the elevator last stopped
+	Key cursor_ = {nullptr, 0};
+
+	uint64_t submitted_ = 0;
+	uint64_t merged_ = 0;
+	uint64_t deadline_misses_ = 0;
+};
+
+} // namespace lune
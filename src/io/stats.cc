@@ -0,0 +1,186 @@
+#include "stats.h"
+
+#include "clock.h"
+#include "logging/logging.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <vector>
+
+namespace lune {
+
+namespace {
+std::atomic<uint32_t> num_stats;
+
+// Never destroyed, as files may outlive static destruction
+CriticalSection &RegistryLock()
+{
+	static auto lock = new CriticalSection();
+	return *lock;
+}
+std::vector<IoStats *> &Registry()
+{
+	static auto registry = new std::vector<IoStats *>();
+	return *registry;
+}
+
+uint64_t OpLength(const AsyncOp *op)
+{
+	uint64_t n = 0;
+	for(int i = 0; i < op->nsg; i++) n += op->sg[i].len;
+	return n;
+}
+
+int Bucket(uint64_t us)
+{
+	return std::min((int)std::bit_width(us), IoStats::kBuckets - 1);
+}
+
+class StatsFile : public IoFile
+{
+public:
+	StatsFile(IoFilePtr f, RefPtr<IoStats> stats) : f_(std::move(f)), stats_(std::move(stats)) {}
+
+	void BeginRead(AsyncOp *op) override
+	{
+		stats_->OnSubmit(op, false);
+		f_->BeginRead(op);
+	}
+	void BeginWrite(AsyncOp *op) override
+	{
+		stats_->OnSubmit(op, true);
+		f_->BeginWrite(op);
+	}
+
+	void Flush() override { f_->Flush(); }
+	bool Sync() override { return f_->Sync(); }
+	bool AllowWrites() const override { return f_->AllowWrites(); }
+	uint64_t GetFileSize() const override { return f_->GetFileSize(); }
+	uint64_t GetDeviceId() const override { return f_->GetDeviceId(); }
+	void Truncate(uint64_t bytes) override { f_->Truncate(bytes); }
+
+	std::unique_ptr<ShmRegion> MapRegion(void *addr, uint64_t offset, uint64_t size, bool ro) override
+	{
+		return f_->MapRegion(addr, offset, size, ro);
+	}
+
+private:
+	IoFilePtr f_;
+	RefPtr<IoStats> stats_;
+};
+} // namespace
+
+IoStats::IoStats(std::string name, IoStats *mount) : name_(std::move(name)), mount_(mount), index_(num_stats++)
+{
+	static const char *const suffixes[6] = {
+	    ".reads", ".writes", ".read_bytes", ".write_bytes", ".errors", ".sequential"};
+	for(int i = 0; i < 6; i++) series_[i] = name_ + suffixes[i];
+
+	std::unique_lock<CriticalSection> l(RegistryLock());
+	Registry().push_back(this);
+}
+
+IoStats::~IoStats()
+{
+	std::unique_lock<CriticalSection> l(RegistryLock());
+	auto &r = Registry();
+	r.erase(std::find(r.begin(), r.end(), this));
+}
+
+void IoStats::ForEach(const std::function<void(IoStats *)> &fn)
+{
+	std::unique_lock<CriticalSection> l(RegistryLock());
+	for(auto s : Registry()) fn(s);
+}
+
+IoFilePtr IoStats::Wrap(IoFilePtr f, std::string name, IoStats *mount)
+{
+	if(!f)
+		return f;
+	return new StatsFile(std::move(f), new IoStats(std::move(name), mount));
+}
+
+void IoStats::Get(Snapshot *out) const
+{
+	out->reads = c_.reads;
+	out->writes = c_.writes;
+	out->read_bytes = c_.read_bytes;
+	out->write_bytes = c_.write_bytes;
+	out->errors = c_.errors;
+	out->sequential = c_.sequential;
+	out->queue_us = c_.queue_us;
+	out->service_us = c_.service_us;
+	for(int i = 0; i < kBuckets; i++) {
+		out->queue_hist[i] = c_.queue_hist[i];
+		out->service_hist[i] = c_.service_hist[i];
+	}
+}
+
+void IoStats::OnSubmit(AsyncOp *op, bool write)
+{
+	if(op->stats)
+		return;
+	AddRef();
+	op->stats = this;
+	op->stats_write = write;
+	op->submit_time = ClkUpdateRealtime();
+	op->issue_time = 0;
+
+	// Appends always continue where the file ends
+	bool sequential = op->offset == kAppendOffset;
+	if(!sequential)
+		sequential = last_end_.exchange(op->offset + OpLength(op), std::memory_order_relaxed) == op->offset;
+	if(sequential) {
+		for(IoStats *s = this; s; s = s->mount_.get()) s->c_.sequential.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void IoStats::OnComplete(AsyncOp *op)
+{
+	IoStats *stats = op->stats;
+	uint64_t now = ClkUpdateRealtime();
+	uint64_t issued = std::max(op->issue_time, op->submit_time);
+	uint64_t queue_us = issued - op->submit_time;
+	uint64_t service_us = now > issued ? now - issued : 0;
+	for(IoStats *s = stats; s; s = s->mount_.get()) {
+		s->Add(op, queue_us, service_us);
+		if(!s->mount_)
+			s->EmitCounters(now);
+	}
+	stats->Release();
+}
+
+void IoStats::Add(const AsyncOp *op, uint64_t queue_us, uint64_t service_us)
+{
+	constexpr auto relaxed = std::memory_order_relaxed;
+	if(op->stats_write) {
+		c_.writes.fetch_add(1, relaxed);
+		c_.write_bytes.fetch_add(op->transferred, relaxed);
+	} else {
+		c_.reads.fetch_add(1, relaxed);
+		c_.read_bytes.fetch_add(op->transferred, relaxed);
+	}
+	// Reading up to the end of the file is not a failure
+	if(op->err && op->err != io_err::kEOF)
+		c_.errors.fetch_add(1, relaxed);
+	c_.queue_us.fetch_add(queue_us, relaxed);
+	c_.service_us.fetch_add(service_us, relaxed);
+	c_.queue_hist[Bucket(queue_us)].fetch_add(1, relaxed);
+	c_.service_hist[Bucket(service_us)].fetch_add(1, relaxed);
+}
+
+void IoStats::EmitCounters(uint64_t now)
+{
+	uint64_t last = last_emit_.load(std::memory_order_relaxed);
+	if(now < last + kCounterInterval || !last_emit_.compare_exchange_strong(last, now))
+		return;
+	const char *series[6];
+	for(int i = 0; i < 6; i++) series[i] = series_[i].c_str();
+	int64_t values[6] = {(int64_t)c_.reads, (int64_t)c_.writes, (int64_t)c_.read_bytes, (int64_t)c_.write_bytes,
+	    (int64_t)c_.errors, (int64_t)c_.sequential};
+	TRACE_COUNTER("io", "IoStats", index_, 6, series, values);
+}
+
+} // namespace lune
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "file.h"
+
+#include <atomic>
+#include <functional>
+#include <string>
+
+namespace lune {
+
+// Byte and op counts with queue and service time histograms for one file or one mount.
+// Queue time runs from submission until IoScheduler issues the op, service time from then until the op
+// completes; ops that bypass the scheduler only have service time. Histogram bucket i counts ops that
+// took less than 2^i microseconds, the last bucket everything slower.
+// Every live IoStats is listed in a registry, so per-file stats are visible only while the file is open.
+// A file's ops are also counted by its mount.
+class IoStats : public Refcounted
+{
+public:
+	static constexpr int kBuckets = 24;
+
+	struct Snapshot
+	{
+		uint64_t reads;
+		uint64_t writes;
+		uint64_t read_bytes;
+		uint64_t write_bytes;
+		uint64_t errors;
+		// Ops that started where the previous one on the same file ended
+		uint64_t sequential;
+		uint64_t queue_us;
+		uint64_t service_us;
+		uint64_t queue_hist[kBuckets];
+		uint64_t service_hist[kBuckets];
+	};
+
+	explicit IoStats(std::string name, IoStats *mount = nullptr);
+	~IoStats() override;
+
+	IoStats(const IoStats &) = delete;
+	void operator=(const IoStats &) = delete;
+
+	const std::string &name() const { return name_; }
+	IoStats *mount() const { return mount_.get(); }
+
+	void Get(Snapshot *out) const;
+
+	// Calls fn for each live IoStats, with the registry locked
+	static void ForEach(const std::function<void(IoStats *)> &fn);
+
+	// Tracks the ops of f in a new IoStats named name, which mount (if any) also counts
+	static IoFilePtr Wrap(IoFilePtr f, std::string name, IoStats *mount);
+
+	// Starts tracking an op about to be issued. Ops already tracked by an outer IoStats are left alone
+	void OnSubmit(AsyncOp *op, bool write);
+	// Called by AsyncOp::Complete for ops that are being tracked
+	static void OnComplete(AsyncOp *op);
+
+private:
+	void Add(const AsyncOp *op, uint64_t queue_us, uint64_t service_us);
+	void EmitCounters(uint64_t now);
+
+	struct Counters
+	{
+		std::atomic<uint64_t> reads{0};
+		std::atomic<uint64_t> writes{0};
+		std::atomic<uint64_t> read_bytes{0};
+		std::atomic<uint64_t> write_bytes{0};
+		std::atomic<uint64_t> errors{0};
+		std::atomic<uint64_t> sequential{0};
+		std::atomic<uint64_t> queue_us{0};
+		std::atomic<uint64_t> service_us{0};
+		std::atomic<uint64_t> queue_hist[kBuckets] = {};
+		std::atomic<uint64_t> service_hist[kBuckets] = {};
+	};
+
+	std::string name_;
+	RefPtr<IoStats> mount_;
+	uint32_t index_;
+	Counters c_;
+	// Where the last op submitted ended, to tell sequential access from random
+	std::atomic<uint64_t> last_end_{UINT64_MAX};
+
+	// Mounts publish trace counters at most this often
+	static constexpr uint64_t kCounterInterval = 100000;
+	std::atomic<uint64_t> last_emit_{0};
+	std::string series_[6];
+};
+
+} // namespace lune
@@ -0,0 +1,453 @@
+#include "uring_linux.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace lune {
+namespace {
+int io_uring_setup(uint32_t entries, io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int io_uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uint32_t LoadAcquire(const uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void StoreRelease(uint32_t *p, uint32_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+// user_data for SQEs whose completions nobody waits on (cancel requests, the shutdown wakeup). Op tags
+// have a nonzero generation, so are never 0
+constexpr uint64_t kInternalTag = 0;
+
+// Stored in op_context so the ring thread can tell a read that hit EOF from an empty write
+void *const kOpRead = (void *)1;
+void *const kOpWrite = (void *)2;
+} // namespace
+
+struct IoUring::ThreadBatch
+{
+	uint32_t depth = 0;
+	uint32_t n = 0;
+	io_uring_sqe sqes[kMaxBatch];
+};
+
+namespace {
+TLS_DECL(IoUring::ThreadBatch) tls_batch;
+}
+
+int32_t ErrnoIoErr(int err)
+{
+	switch(err) {
+	case ECANCELED:
+		return io_err::kCancelled;
+	}
+	return io_err::FromOs(err);
+}
+
+IoUring *IoUring::instance_;
+
+IoUring *IoUring::Get()
+{
+	static IoUring *ring = []() -> IoUring * {
+		// Opt-in: the preadv/pwritev pool stays the default until iobench shows the ring beating it
+		const char *enable = getenv("LUNE_IO_URING");
+		if(!enable || !*enable || *enable == '0')
+			return nullptr;
+		auto r = new IoUring();
+		if(r->Init())
+			return instance_ = r;
+		delete r;
+		return nullptr;
+	}();
+	return ring;
+}
+
+void IoUring::Shutdown()
+{
+	if(instance_)
+		instance_->Stop();
+}
+
+bool IoUring::Init()
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	fd_ = io_uring_setup(kEntries, &p);
+	if(fd_ < 0)
+		return false;
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool single = !!(p.features & IORING_FEAT_SINGLE_MMAP);
+	if(single)
+		sq_size = cq_size = std::max(sq_size, cq_size);
+
+	uint8_t *sq = (uint8_t *)mmap(
+	    nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if(sq == MAP_FAILED) {
+		close(fd_);
+		return false;
+	}
+	uint8_t *cq = sq;
+	if(!single) {
+		cq = (uint8_t *)mmap(
+		    nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if(cq == MAP_FAILED) {
+			munmap(sq, sq_size);
+			close(fd_);
+			return false;
+		}
+	}
+	void *sqes = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED) {
+		if(!single)
+			munmap(cq, cq_size);
+		munmap(sq, sq_size);
+		close(fd_);
+		return false;
+	}
+
+	sq_head_ = (uint32_t *)(sq + p.sq_off.head);
+	sq_tail_ = (uint32_t *)(sq + p.sq_off.tail);
+	sq_array_ = (uint32_t *)(sq + p.sq_off.array);
+	sq_mask_ = *(uint32_t *)(sq + p.sq_off.ring_mask);
+	sq_entries_ = *(uint32_t *)(sq + p.sq_off.ring_entries);
+	sqes_ = (io_uring_sqe *)sqes;
+
+	cq_head_ = (uint32_t *)(cq + p.cq_off.head);
+	cq_tail_ = (uint32_t *)(cq + p.cq_off.tail);
+	cq_mask_ = *(uint32_t *)(cq + p.cq_off.ring_mask);
+	cqes_ = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	// IORING_OP_READ/WRITE arrived after the vectored forms. Older kernels get readv/writev for everything
+	size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	std::unique_ptr<uint8_t[]> probe_mem(new uint8_t[probe_size]());
+	auto probe = (io_uring_probe *)probe_mem.get();
+	if(io_uring_register(fd_, IORING_REGISTER_PROBE, probe, 256) >= 0) {
+		has_read_op_ = probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+		               (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	// A sparse table that files are slotted into as they are opened
+	std::vector<int> fds(kMaxRegisteredFiles, -1);
+	if(io_uring_register(fd_, IORING_REGISTER_FILES, fds.data(), kMaxRegisteredFiles) >= 0) {
+		files_registered_ = true;
+		free_slots_.reserve(kMaxRegisteredFiles);
+		for(uint32_t i = kMaxRegisteredFiles; i-- > 0;) free_slots_.push_back((int)i);
+	}
+
+	tags_.reset(new Tag[kMaxInFlight]);
+	free_tags_.reserve(kMaxInFlight);
+	for(uint32_t i = kMaxInFlight; i-- > 0;) free_tags_.push_back(i);
+
+	thread_ = OsThread::CreateRawThread(std::bind(&IoUring::ThreadMain, this), "IoUring", ThreadType::IO);
+	return true;
+}
+
+int IoUring::RegisterFile(int fd)
+{
+	std::unique_lock<CriticalSection> l(files_lock_);
+	if(!files_registered_ || free_slots_.empty())
+		return -1;
+	int slot = free_slots_.back();
+	io_uring_files_update up;
+	memset(&up, 0, sizeof(up));
+	up.offset = (uint32_t)slot;
+	up.fds = (uint64_t)(uintptr_t)&fd;
+	if(io_uring_register(fd_, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+		return -1;
+	free_slots_.pop_back();
+	return slot;
+}
+
+void IoUring::UnregisterFile(int slot)
+{
+	if(slot < 0)
+		return;
+	std::unique_lock<CriticalSection> l(files_lock_);
+	int fd = -1;
+	io_uring_files_update up;
+	memset(&up, 0, sizeof(up));
+	up.offset = (uint32_t)slot;
+	up.fds = (uint64_t)(uintptr_t)&fd;
+	io_uring_register(fd_, IORING_REGISTER_FILES_UPDATE, &up, 1);
+	free_slots_.push_back(slot);
+}
+
+bool IoUring::RegisterBuffers(const iovec *iov, uint32_t n)
+{
+	if(!buffers_.empty() || !n)
+		return false;
+	if(io_uring_register(fd_, IORING_REGISTER_BUFFERS, iov, n) < 0)
+		return false;
+	for(uint32_t i = 0; i < n; i++) buffers_.emplace_back((uintptr_t)iov[i].iov_base, iov[i].iov_len);
+	return true;
+}
+
+int IoUring::FindRegisteredBuffer(const SGBuf &sg) const
+{
+	uintptr_t p = (uintptr_t)sg.buf;
+	for(size_t i = 0; i < buffers_.size(); i++) {
+		if(p >= buffers_[i].first && p + sg.len <= buffers_[i].first + buffers_[i].second)
+			return (int)i;
+	}
+	return -1;
+}
+
+bool IoUring::Read(AsyncOp *op, int fd, int slot)
+{
+	return Prep(op, fd, slot, false);
+}
+
+bool IoUring::Write(AsyncOp *op, int fd, int slot)
+{
+	return Prep(op, fd, slot, true);
+}
+
+bool IoUring::Prep(AsyncOp *op, int fd, int slot, bool write)
+{
+	static_assert(sizeof(SGBuf) == sizeof(iovec), "SGBuf must match iovec");
+
+	// Counted before stopping_ is checked, and the ring thread checks them the other way round, so
+	// either the op is refused or the ring thread waits for it
+	in_flight_.fetch_add(1);
+	uint64_t tag = stopping_.load() ? 0 : AllocTag(op);
+	if(!tag) {
+		in_flight_.fetch_sub(1);
+		return false;
+	}
+
+	io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	if(slot >= 0) {
+		sqe.fd = slot;
+		sqe.flags = IOSQE_FIXED_FILE;
+	} else {
+		sqe.fd = fd;
+	}
+	// -1 means the current file position, which is the end for descriptors opened with O_APPEND. LinuxFile
+	// sends appends to other files through such a descriptor
+	sqe.off = op->offset == kAppendOffset ? (uint64_t)-1 : op->offset;
+	sqe.user_data = tag;
+	op->op_context = write ? kOpWrite : kOpRead;
+
+	int buf_index = op->nsg == 1 && !buffers_.empty() ? FindRegisteredBuffer(op->sg[0]) : -1;
+	if(buf_index >= 0) {
+		sqe.opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe.addr = (uint64_t)(uintptr_t)op->sg[0].buf;
+		sqe.len = (uint32_t)op->sg[0].len;
+		sqe.buf_index = (uint16_t)buf_index;
+	} else if(op->nsg == 1 && has_read_op_) {
+		sqe.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe.addr = (uint64_t)(uintptr_t)op->sg[0].buf;
+		sqe.len = (uint32_t)op->sg[0].len;
+	} else {
+		// op->sg lives as long as the op, so the kernel may read the iovecs at any point before completion
+		sqe.opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe.addr = (uint64_t)(uintptr_t)op->sg;
+		sqe.len = (uint32_t)op->nsg;
+	}
+
+	op->SetCancelHook([this, tag]() { Cancel(tag); });
+	Queue(sqe);
+	return true;
+}
+
+uint64_t IoUring::AllocTag(AsyncOp *op)
+{
+	std::unique_lock<CriticalSection> l(tags_lock_);
+	if(free_tags_.empty())
+		return 0;
+	uint32_t slot = free_tags_.back();
+	free_tags_.pop_back();
+	Tag &t = tags_[slot];
+	t.op = op;
+	if(!++t.gen)
+		t.gen = 1;
+	return (uint64_t)t.gen << 32 | slot;
+}
+
+AsyncOp *IoUring::FreeTag(uint64_t tag)
+{
+	uint32_t slot = (uint32_t)tag;
+	std::unique_lock<CriticalSection> l(tags_lock_);
+	AsyncOp *op = tags_[slot].op;
+	tags_[slot].op = nullptr;
+	free_tags_.push_back(slot);
+	return op;
+}
+
+void IoUring::Cancel(uint64_t tag)
+{
+	// Only a request - the op itself completes with -ECANCELED if it was caught in time. An op still
+	// sitting in another thread's batch is missed and runs to completion. The tag's slot is reused once
+	// the op completes, but with a new generation, so a late cancel matches nothing
+	io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.fd = -1;
+	sqe.addr = tag;
+	sqe.user_data = kInternalTag;
+	Submit(&sqe, 1);
+}
+
+void IoUring::Queue(const io_uring_sqe &sqe)
+{
+	auto &b = tls_batch;
+	if(!b.depth) {
+		Submit(&sqe, 1);
+		return;
+	}
+	b.sqes[b.n++] = sqe;
+	if(b.n == kMaxBatch)
+		FlushBatch(b);
+}
+
+void IoUring::Submit(const io_uring_sqe *sqes, uint32_t n)
+{
+	while(n) {
+		uint32_t k;
+		{
+			std::unique_lock<CriticalSection> l(sq_lock_);
+			uint32_t tail = *sq_tail_;
+			k = std::min(sq_entries_ - (tail - LoadAcquire(sq_head_)), n);
+			for(uint32_t i = 0; i < k; i++) {
+				uint32_t idx = (tail + i) & sq_mask_;
+				sqes_[idx] = sqes[i];
+				sq_array_[idx] = idx;
+			}
+			StoreRelease(sq_tail_, tail + k);
+		}
+		sqes += k;
+		n -= k;
+		if(!k) {
+			// The ring is full of entries other threads have published and are about to submit
+			OsThread::Sleep(50);
+			continue;
+		}
+
+		// The kernel consumes SQEs from the head of the ring, so this may hand over entries another
+		// thread published while that thread's enter hands over ours. Each thread enters for as many
+		// entries as it published, so between them every entry is submitted. The lock isn't held here:
+		// cached reads are done inside io_uring_enter, and must not be serialised across submitters
+		while(k) {
+			int ret = io_uring_enter(fd_, k, 0, 0);
+			if(ret > 0) {
+				k -= std::min((uint32_t)ret, k);
+			} else if(ret == 0) {
+				// Nothing left to take means other threads' enters have already handed over ours. If
+				// entries remain the kernel took none of them this time, so go again
+				if(LoadAcquire(sq_head_) == LoadAcquire(sq_tail_))
+					break;
+				OsThread::Sleep(50);
+			} else if(errno == EAGAIN || errno == EBUSY) {
+				// Out of kernel resources or completion space until the ring thread reaps
+				OsThread::Sleep(50);
+			} else if(errno != EINTR) {
+				LUNE_BP();
+				break;
+			}
+		}
+	}
+}
+
+void IoUring::FlushBatch(ThreadBatch &b)
+{
+	if(!b.n)
+		return;
+	Get()->Submit(b.sqes, b.n);
+	b.n = 0;
+}
+
+IoUring::Batch::Batch()
+{
+	tls_batch.depth++;
+}
+
+IoUring::Batch::~Batch()
+{
+	auto &b = tls_batch;
+	if(--b.depth == 0)
+		FlushBatch(b);
+}
+
+void IoUring::Stop()
+{
+	stopping_.store(true);
+	// The ring thread may be waiting for a completion that never comes, so give it one
+	io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_NOP;
+	sqe.fd = -1;
+	sqe.user_data = kInternalTag;
+	Submit(&sqe, 1);
+	if(thread_)
+		thread_->Join();
+	thread_ = nullptr;
+}
+
+void IoUring::ThreadMain()
+{
+	while(true) {
+		int ret = io_uring_enter(fd_, 0, 1, IORING_ENTER_GETEVENTS);
+		if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			LUNE_BP();
+			return;
+		}
+		Reap();
+		if(stopping_.load() && !in_flight_.load())
+			return;
+	}
+}
+
+void IoUring::Reap()
+{
+	uint32_t head = *cq_head_;
+	uint32_t tail = LoadAcquire(cq_tail_);
+	while(head != tail) {
+		io_uring_cqe cqe = cqes_[head & cq_mask_];
+		// Release the slot before completing, as completions commonly issue more I/O
+		StoreRelease(cq_head_, ++head);
+		if(cqe.user_data == kInternalTag)
+			continue;
+
+		// Freed before completing, so the slot's next user already has a different tag
+		AsyncOp *op = FreeTag(cqe.user_data);
+		if(cqe.res < 0) {
+			op->err = ErrnoIoErr(-cqe.res);
+			op->transferred = 0;
+		} else if(cqe.res == 0 && op->op_context == kOpRead && op->nsg > 0 && op->sg[0].len > 0) {
+			op->err = io_err::kEOF;
+			op->transferred = 0;
+		} else {
+			op->err = 0;
+			op->transferred = (uint32_t)cqe.res;
+		}
+		op->op(op);
+		// After completing, so ops the completion issues keep the count from touching 0 in between
+		in_flight_.fetch_sub(1);
+	}
+}
+
+} // namespace lune
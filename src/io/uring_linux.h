@@ -0,0 +1,128 @@
+#pragma once
+
+#include "aio.h"
+#include "sys/sync.h"
+#include "sys/thread.h"
+
+#include <linux/io_uring.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+struct iovec;
+
+namespace lune {
+
+// Maps a positive errno onto an AsyncOp error, see io_err::FromOs
+int32_t ErrnoIoErr(int err);
+
+// The process-wide io_uring. Any thread may submit; completions are reaped on a dedicated ring thread
+// and delivered through the op's op hook, the same way the IOCP pool delivers them on Windows. Only
+// used when LUNE_IO_URING is set, as the preadv/pwritev pool has measured faster so far
+class IoUring
+{
+public:
+	static constexpr uint32_t kEntries = 256;
+	static constexpr uint32_t kMaxRegisteredFiles = 256;
+	static constexpr uint32_t kMaxBatch = 32;
+	// Ops the ring will hold at once. Past that Read and Write refuse ops, to be issued some other way
+	static constexpr uint32_t kMaxInFlight = 4096;
+
+	// Returns nullptr if io_uring has not been enabled for this process or the kernel does not support it
+	static IoUring *Get();
+	// Stops the ring thread once every op issued so far has completed. Read and Write refuse ops from
+	// then on. Does nothing if the ring was never created
+	static void Shutdown();
+
+	IoUring(const IoUring &) = delete;
+	void operator=(const IoUring &) = delete;
+
+	// Registered files skip the per-op fd table lookup. Returns the slot, or -1 if the table is full
+	// and the raw fd must be used
+	int RegisterFile(int fd);
+	void UnregisterFile(int slot);
+
+	// Pins buffers for the fixed-buffer opcodes. May be called once. Single-segment ops that lie
+	// entirely within a registered buffer use them automatically
+	bool RegisterBuffers(const iovec *iov, uint32_t n);
+
+	// Queues a read/write of op->sg at op->offset. slot is the registered slot for fd, or -1. Returns
+	// false, leaving the op to be issued some other way, once the ring has been shut down or is full
+	bool Read(AsyncOp *op, int fd, int slot);
+	bool Write(AsyncOp *op, int fd, int slot);
+
+	// While a batch is open on a thread, that thread's submissions are held back and handed to the
+	// kernel with a single system call when the outermost batch closes
+	class Batch
+	{
+	public:
+		Batch();
+		~Batch();
+
+		Batch(const Batch &) = delete;
+		void operator=(const Batch &) = delete;
+	};
+
+	struct ThreadBatch;
+
+private:
+	IoUring() = default;
+	bool Init();
+
+	bool Prep(AsyncOp *op, int fd, int slot, bool write);
+	void Queue(const io_uring_sqe &sqe);
+	void Submit(const io_uring_sqe *sqes, uint32_t n);
+	// Tags are an op's user_data: a slot in tags_ and that slot's generation. Returns 0 if none are free
+	uint64_t AllocTag(AsyncOp *op);
+	AsyncOp *FreeTag(uint64_t tag);
+	void Cancel(uint64_t tag);
+	int FindRegisteredBuffer(const SGBuf &sg) const;
+
+	void Stop();
+	void ThreadMain();
+	void Reap();
+
+	static void FlushBatch(ThreadBatch &b);
+
+	static IoUring *instance_;
+
+	int fd_ = -1;
+
+	CriticalSection sq_lock_;
+	uint32_t *sq_head_;
+	uint32_t *sq_tail_;
+	uint32_t *sq_array_;
+	uint32_t sq_mask_;
+	uint32_t sq_entries_;
+	io_uring_sqe *sqes_;
+
+	uint32_t *cq_head_;
+	uint32_t *cq_tail_;
+	uint32_t cq_mask_;
+	io_uring_cqe *cqes_;
+
+	bool has_read_op_ = false;
+
+	CriticalSection files_lock_;
+	bool files_registered_ = false;
+	std::vector<int> free_slots_;
+
+	std::vector<std::pair<uintptr_t, size_t>> buffers_;
+
+	struct Tag
+	{
+		AsyncOp *op = nullptr;
+		uint32_t gen = 0;
+	};
+	CriticalSection tags_lock_;
+	std::unique_ptr<Tag[]> tags_;
+	std::vector<uint32_t> free_tags_;
+
+	// Ops issued and not yet completed, so Stop can let them finish
+	std::atomic<uint32_t> in_flight_ = 0;
+	std::atomic<bool> stopping_ = false;
+	std::shared_ptr<OsThread> thread_;
+};
+
+} // namespace lune
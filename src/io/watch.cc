@@ -0,0 +1,86 @@
+#include "watch.h"
+
+#include "blob_cache.h"
+#include "clock.h"
+
+#include <mutex>
+
+namespace lune {
+
+FileWatcher::FileWatcher(SafeVFSSplit *vfs, uint32_t debounce_ms) : vfs_(vfs), debounce_(debounce_ms * 1000ull) {}
+
+FileWatcher::~FileWatcher()
+{
+	for(auto &dir : watching_) vfs_->RemoveWatchedDir(dir);
+}
+
+void FileWatcher::Watching(const std::string &dir)
+{
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		watching_.push_back(dir);
+	}
+	vfs_->AddWatchedDir(dir);
+}
+
+void FileWatcher::AddListener(Listener fn)
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	listeners_.push_back(std::move(fn));
+}
+
+void FileWatcher::Changed(std::string path, bool tree)
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	pending_[std::move(path)] |= tree;
+	last_change_ = ClkUpdateRealtime();
+}
+
+int64_t FileWatcher::TimeToFlush()
+{
+	std::unique_lock<CriticalSection> l(lock_);
+	if(pending_.empty())
+		return -1;
+	uint64_t since = ClkUpdateRealtime() - last_change_;
+	return since >= debounce_ ? 0 : (int64_t)(debounce_ - since);
+}
+
+void FileWatcher::FlushIfDue()
+{
+	std::vector<std::string> paths;
+	std::map<std::string, bool> pending;
+	std::vector<Listener> listeners;
+	{
+		std::unique_lock<CriticalSection> l(lock_);
+		if(pending_.empty() || ClkUpdateRealtime() - last_change_ < debounce_)
+			return;
+		pending.swap(pending_);
+		listeners = listeners_;
+	}
+	// Other roots may be served by the directory that changed, such as /game when it is /data; they
+	// changed too. A path seen as a tree under one name stays a tree under the rest
+	std::map<std::string, bool> changed;
+	for(auto &[p, tree] : pending) {
+		for(auto &alias : vfs_->Aliases(p)) changed[alias] |= tree;
+	}
+	// Only what changed is forgotten; everything else stays cached
+	paths.reserve(changed.size());
+	for(auto &[p, tree] : changed) {
+		if(tree)
+			vfs_->InvalidateTree(p);
+		else
+			vfs_->InvalidatePath(p);
+		blob_cache.Invalidate(vfs_, p);
+		paths.push_back(p);
+	}
+	for(auto &fn : listeners) fn(paths);
+}
+
+#if !IS_LINUX
+std::unique_ptr<FileWatcher> FileWatcher::Create(SafeVFSSplit *vfs, uint32_t debounce_ms)
+{
+	return nullptr;
+}
+#endif
+
+} // namespace lune
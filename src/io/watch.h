@@ -0,0 +1,64 @@
+#pragma once
+
+#include "file.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace lune {
+
+// Watches directories on disk behind a SafeVFSSplit and reports what changed in them by VFS path.
+// Changes are debounced: a batch is delivered once no more have arrived for the debounce interval, so
+// an editor saving through a temp file and a rename is seen once. Before the listeners hear of a batch,
+// the split's path cache and the blob cache have already forgotten the changed paths
+class FileWatcher
+{
+public:
+	// Called on the watcher's thread with the VFS paths that changed, under every root that shows them
+	// (see SafeVFSSplit::Aliases), sorted. A changed directory stands for everything beneath it
+	using Listener = std::function<void(const std::vector<std::string> &paths)>;
+
+	// Returns null where the OS has no change notification this supports
+	static std::unique_ptr<FileWatcher> Create(SafeVFSSplit *vfs, uint32_t debounce_ms = 100);
+
+	virtual ~FileWatcher();
+
+	FileWatcher(const FileWatcher &) = delete;
+	void operator=(const FileWatcher &) = delete;
+
+	// Watches a VFS directory and everything beneath it, including directories created later. False if
+	// the directory isn't on disk, like /temp in memory or /game in a pack
+	virtual bool Watch(const Path &dir) = 0;
+
+	void AddListener(Listener fn);
+
+protected:
+	FileWatcher(SafeVFSSplit *vfs, uint32_t debounce_ms);
+
+	// Backends report changes from their thread with these. tree is set when path is a directory that
+	// stands for everything beneath it
+	void Changed(std::string path, bool tree = false);
+	// Microseconds until the pending changes are due, or -1 if there are none
+	int64_t TimeToFlush();
+	// Delivers the pending changes if nothing has arrived for the debounce interval
+	void FlushIfDue();
+	// Backends call this once dir is being watched, so the split may cache missing paths beneath it
+	void Watching(const std::string &dir);
+
+	SafeVFSSplit *vfs_;
+
+private:
+	uint64_t debounce_;
+
+	CriticalSection lock_;
+	// Each path, and whether it was reported as a tree
+	std::map<std::string, bool> pending_;
+	uint64_t last_change_ = 0;
+	std::vector<Listener> listeners_;
+	std::vector<std::string> watching_;
+};
+
+} // namespace lune
@@ -0,0 +1,191 @@
+#include "watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <unordered_map>
+
+namespace lune {
+namespace {
+class InotifyWatcher : public FileWatcher
+{
+public:
+	InotifyWatcher(SafeVFSSplit *vfs, uint32_t debounce_ms, int fd, int wake)
+	    : FileWatcher(vfs, debounce_ms), fd_(fd), wake_(wake)
+	{
+		thread_ = OsThread::CreateRawThread(std::bind(&InotifyWatcher::ThreadMain, this), "FileWatcher", ThreadType::IO);
+	}
+
+	~InotifyWatcher() override
+	{
+		uint64_t one = 1;
+		(void)!write(wake_, &one, sizeof(one));
+		thread_->Join();
+		close(fd_);
+		close(wake_);
+	}
+
+	bool Watch(const Path &dir) override
+	{
+		std::string vfs_dir(dir);
+		if(vfs_dir.empty() || vfs_dir.back() != '/')
+			vfs_dir.push_back('/');
+		std::string os_dir;
+		if(!vfs_->GetOsPath(vfs_dir, &os_dir))
+			return false;
+		if(os_dir.back() != '/')
+			os_dir.push_back('/');
+		{
+			std::unique_lock<CriticalSection> l(dirs_lock_);
+			roots_.push_back(vfs_dir);
+			if(!AddTree(vfs_dir, os_dir))
+				return false;
+		}
+		Watching(vfs_dir);
+		return true;
+	}
+
+private:
+	static constexpr uint32_t kMask =
+	    IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+	// Both paths end in '/'
+	struct Dir
+	{
+		std::string vfs;
+		std::string os;
+	};
+
+	// Callers hold dirs_lock_. Inotify isn't recursive, so every directory beneath gets its own watch
+	bool AddTree(const std::string &vfs_dir, const std::string &os_dir)
+	{
+		int wd = inotify_add_watch(fd_, os_dir.c_str(), kMask);
+		if(wd < 0)
+			return false;
+		dirs_[wd] = Dir{vfs_dir, os_dir};
+		DIR *d = opendir(os_dir.c_str());
+		if(!d)
+			return true;
+		while(auto e = readdir(d)) {
+			if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+				continue;
+			std::string os = os_dir + e->d_name;
+			bool is_dir = e->d_type == DT_DIR;
+			if(e->d_type == DT_UNKNOWN) {
+				struct stat st;
+				is_dir = !stat(os.c_str(), &st) && S_ISDIR(st.st_mode);
+			}
+			if(is_dir)
+				AddTree(vfs_dir + e->d_name + "/", os + "/");
+		}
+		closedir(d);
+		return true;
+	}
+
+	// Callers hold dirs_lock_. Watches on a directory moved away would report the wrong paths; if it moved
+	// somewhere watched, it is added again there
+	void RemoveTree(const std::string &vfs_dir)
+	{
+		for(auto it = dirs_.begin(); it != dirs_.end();) {
+			if(it->second.vfs.starts_with(vfs_dir)) {
+				inotify_rm_watch(fd_, it->first);
+				it = dirs_.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	void Drain()
+	{
+		alignas(inotify_event) char buf[16384];
+		while(true) {
+			ssize_t n = read(fd_, buf, sizeof(buf));
+			if(n <= 0)
+				return;
+			std::unique_lock<CriticalSection> l(dirs_lock_);
+			for(ssize_t i = 0; i < n;) {
+				auto ev = (const inotify_event *)(buf + i);
+				i += sizeof(inotify_event) + ev->len;
+				Handle(ev);
+			}
+		}
+	}
+
+	// Callers hold dirs_lock_
+	void Handle(const inotify_event *ev)
+	{
+		if(ev->mask & IN_Q_OVERFLOW) {
+			// Events were lost, so anything may have changed
+			for(auto &r : roots_) Changed(r.substr(0, r.size() - 1), true);
+			return;
+		}
+		auto it = dirs_.find(ev->wd);
+		if(it == dirs_.end())
+			return;
+		if(ev->mask & IN_IGNORED) {
+			dirs_.erase(it);
+			return;
+		}
+		Dir dir = it->second;
+		if(!ev->len) {
+			Changed(dir.vfs.substr(0, dir.vfs.size() - 1), true);
+			return;
+		}
+		std::string vfs = dir.vfs + ev->name;
+		if((ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM))
+			RemoveTree(vfs + "/");
+		// Files may land in a new directory before it is watched; reporting the directory covers them
+		if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+			AddTree(vfs + "/", dir.os + ev->name + "/");
+		Changed(std::move(vfs), (ev->mask & IN_ISDIR) != 0);
+	}
+
+	void ThreadMain()
+	{
+		while(true) {
+			int64_t t = TimeToFlush();
+			pollfd fds[2] = {{fd_, POLLIN, 0}, {wake_, POLLIN, 0}};
+			int n = poll(fds, 2, t < 0 ? -1 : (int)((t + 999) / 1000));
+			if(n < 0 && errno != EINTR)
+				break;
+			if(fds[1].revents)
+				break;
+			if(fds[0].revents & POLLIN)
+				Drain();
+			FlushIfDue();
+		}
+	}
+
+	int fd_;
+	// Signalled to stop the thread
+	int wake_;
+	std::shared_ptr<OsThread> thread_;
+
+	CriticalSection dirs_lock_;
+	std::unordered_map<int, Dir> dirs_;
+	std::vector<std::string> roots_;
+};
+} // namespace
+
+std::unique_ptr<FileWatcher> FileWatcher::Create(SafeVFSSplit *vfs, uint32_t debounce_ms)
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd < 0)
+		return nullptr;
+	int wake = eventfd(0, EFD_CLOEXEC);
+	if(wake < 0) {
+		close(fd);
+		return nullptr;
+	}
+	return std::make_unique<InotifyWatcher>(vfs, debounce_ms, fd, wake);
+}
+
+} // namespace lune
@@ -22,6 +22,8 @@ local function safe_smt(o, mt)
 end
 
 local blacklist = {ffi=true, debug=true, jit=true}
+-- The VFS path each module was loaded from, so it can be reloaded once the file changes
+local module_files = {}
 local function safe_require(m, t)
 	if blacklist[m] then
 		error("can't load " .. m)
@@ -30,14 +32,30 @@ local function safe_require(m, t)
 	if v then
 		return v
 	end
-	local fn, err = lune.fs.load(m .. '.lua')
+	local file = m .. '.lua'
+	local fn, err = lune.fs.load(file)
 	if err then error(err) end
 	setfenv(fn, t)
 	local ret = fn(m)
 	package.loaded[m] = ret or true
+	module_files[m] = file
 	return ret
 end
 
+-- Forgets the modules loaded from any of the changed paths, so the next require loads them again. A
+-- changed directory stands for everything beneath it
+function unloadChangedModules(paths)
+	for m, file in pairs(module_files) do
+		for _, p in ipairs(paths) do
+			if file == p or file:sub(1, #p + 1) == p .. '/' then
+				package.loaded[m] = nil
+				module_files[m] = nil
+				break
+			end
+		end
+	end
+end
+
 local function traceback(t)
 	return debug.traceback((type(t) == 'thread') and t)
 end
@@ -160,6 +160,12 @@ void TraceObjEnd(LuneDurationEventInfo *info, uint64_t id)
 		details::trace_writer.ObjDel(info, id, GetLoggingTime());
 }
 
+void TraceCounter(LuneDurationEventInfo *info, uint64_t id, uint32_t n, const char *const *series, const int64_t *values)
+{
+	if(info->enabled & CurrentTracingMode.load(std::memory_order_acquire))
+		trace_writer.Counter(info, id, GetLoggingTime(), n, series, values);
+}
+
 std::vector<LuneDurationEventInfo *> AllKnownDurationEvents = OsPopulateDurationEvents();
 
 TraceProcessorSink *current_trace_sink = nullptr;
@@ -182,6 +188,10 @@ void EnableTracingInternal(uint32_t level)
 
 void PostFatalLog()
 {
+	// The file log is written behind; get the lines leading up to the failure onto disk. The wait is
+	// bounded, as the failing thread may be the one that would complete the writes
+	if(file_log::log_output)
+		file_log::log_output->FlushFor(1000000);
 	BreakpointNow();
 }
 
@@ -131,6 +131,7 @@ extern std::atomic<uint32_t> CurrentTracingMode;
 
 #if LUNE_NO_TRACING
 #define TRACE_SCOPED(category, name)
+#define TRACE_COUNTER(category, name, id, n, series, values)
 
 #else
 #define TRACE_SCOPED(category, name)                                                           \
@@ -144,6 +145,10 @@ void TraceAsyncEnd(LuneDurationEventInfo *info, uint64_t id);
 void TraceObjStart(LuneDurationEventInfo *info, uint64_t id);
 void TraceObjEnd(LuneDurationEventInfo *info, uint64_t id);
 
+// Emits a counter sample with n named series. Series names must outlive the trace
+void TraceCounter(
+    LuneDurationEventInfo *info, uint64_t id, uint32_t n, const char *const *series, const int64_t *values);
+
 #define TRACE_ASYNC_START(category, name, id)                                                  \
 	TRACESECTION(::lune::details::LuneDurationEventInfo LUNE_CONCAT(trace_evt_, __LINE__)) = { \
 	    0xFEEFF00F, name, category};                                                           \
@@ -152,6 +157,10 @@ void TraceObjEnd(LuneDurationEventInfo *info, uint64_t id);
 	TRACESECTION(::lune::details::LuneDurationEventInfo LUNE_CONCAT(trace_evt_, __LINE__)) = { \
 	    0xFEEFF00F, name, category};                                                           \
 	::lune::details::TraceAsyncEnd(&LUNE_CONCAT(trace_evt_, __LINE__), reinterpret_cast<uint64_t>(id));
+#define TRACE_COUNTER(category, name, id, n, series, values)                                   \
+	TRACESECTION(::lune::details::LuneDurationEventInfo LUNE_CONCAT(trace_evt_, __LINE__)) = { \
+	    0xFEEFF00F, name, category};                                                           \
+	::lune::details::TraceCounter(&LUNE_CONCAT(trace_evt_, __LINE__), (uint64_t)(id), n, series, values);
 
 #define TRACE_INSTANT_THREAD(category, name)
 #define TRACE_INSTANT_PROCESS(category, name)
@@ -109,10 +109,11 @@ std::string *BinToChromiumJson(EventsChunk *chunk)
 			{
 				for(uint32_t j = 0; j < ((e.flags >> 8) & 0xFF); j++) {
 					auto& n = chunk->entries[i + j + 1];
-					wr.printf("\"%s\":%lld,", (const char*)n.info, (int64_t)n.ts);
+					wr.printf("%s\"%s\":%lld", j ? "," : "", (const char*)n.info, (int64_t)n.ts);
 				}
 			}
 			wr.printf("}},\n");
+			break;
 		default:
 			LUNE_BP();
 		}
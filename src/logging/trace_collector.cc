@@ -20,22 +20,29 @@ TraceCollector::~TraceCollector()
 	Flush();
 }
 
-EventsChunk::Entry &TraceCollector::EnsureChunk()
+EventsChunk::Entry *TraceCollector::EnsureChunkEntries(uint32_t n)
 {
 	if(!current_chunk_) {
 		current_chunk_ = aggregator_->AllocateChunk();
+		current_chunk_->valid_entries = 0;
+		current_chunk_->tid = tid_;
+		current_chunk_->pid = pid_;
 		if(first_chunk_) {
 			first_chunk_ = false;
 			WriteThreadMeta();
 		}
-	} else if(current_chunk_->allocated_entries == current_chunk_->valid_entries) {
+	} else if(current_chunk_->allocated_entries - current_chunk_->valid_entries < n) {
 		current_chunk_->tid = tid_;
 		current_chunk_->pid = pid_;
 		aggregator_->CompleteChunk(current_chunk_);
 		current_chunk_ = aggregator_->AllocateChunk();
 		current_chunk_->valid_entries = 0;
+		current_chunk_->tid = tid_;
+		current_chunk_->pid = pid_;
 	}
-	return current_chunk_->entries[current_chunk_->valid_entries++];
+	auto e = &current_chunk_->entries[current_chunk_->valid_entries];
+	current_chunk_->valid_entries += n;
+	return e;
 }
 
 void TraceCollector::WriteThreadMeta()
@@ -124,6 +131,20 @@ void TraceCollector::ObjDel(details::LuneDurationEventInfo *info, uint64_t id, u
 	e.flags = CHUNK_OBJ_DESTROY | (id << 16);
 }
 
+void TraceCollector::Counter(details::LuneDurationEventInfo *info, uint64_t id, uint64_t ts, uint32_t n,
+    const char *const *series, const int64_t *values)
+{
+	auto e = EnsureChunkEntries(n + 1);
+	e[0].ts = ts;
+	e[0].info = info;
+	e[0].flags = CHUNK_COUNTER | CHUNK_HAS_DATA | (n << 8) | (id << 16);
+	for(uint32_t i = 0; i < n; i++) {
+		e[i + 1].ts = (uint64_t)values[i];
+		e[i + 1].info = (details::LuneDurationEventInfo *)series[i];
+		e[i + 1].flags = 0;
+	}
+}
+
 TraceAggregator::TraceAggregator(TraceSink *sink) : sink_(sink) {}
 
 EventsChunk *TraceAggregator::AllocateChunk()
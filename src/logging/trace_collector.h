@@ -91,10 +91,16 @@ public:
 	void ObjNew(details::LuneDurationEventInfo *info, uint64_t id, uint64_t start);
 	void ObjDel(details::LuneDurationEventInfo *info, uint64_t id, uint64_t start);
 
+	// Series names are stored by pointer, one data entry per series
+	void Counter(details::LuneDurationEventInfo *info, uint64_t id, uint64_t ts, uint32_t n,
+	    const char *const *series, const int64_t *values);
+
 private:
 	void WriteThreadMeta();
 
-	EventsChunk::Entry &EnsureChunk();
+	EventsChunk::Entry &EnsureChunk() { return *EnsureChunkEntries(1); }
+	// Returns n contiguous entries in the current chunk
+	EventsChunk::Entry *EnsureChunkEntries(uint32_t n);
 
 	EventsChunk *current_chunk_ = nullptr;
 	TraceAggregator *aggregator_;
@@ -13,4 +13,13 @@ void TraceFileSink::SinkData(std::string *data)
 	file_->BeginWrite(op);
 }
 
+void TraceFileSink::SinkChain(IoChain &&chain)
+{
+	while(!chain.empty()) {
+		auto op = AsyncOp::AllocForChain(chain.Split(IoChain::kMaxOpBytes));
+		op->offset = kAppendOffset;
+		file_->BeginWrite(op);
+	}
+}
+
 } // namespace lune
@@ -12,6 +12,7 @@ public:
 	~TraceFileSink() override;
 
 	void SinkData(std::string *data) override;
+	void SinkChain(IoChain &&chain) override;
 
 private:
 	RefPtr<IoFile> file_;
@@ -53,12 +53,12 @@ void TraceProcessor::OnConverted(Chunk *c)
 		flush_pending_list_.push_back(c);
 		return;
 	}
+	// Everything that is now in order goes to the sink as one vectored write
+	IoChain ready;
 	do {
 		next_flush_id_++;
-		if(sink_)
-			sink_->SinkData(c->data);
-		else
-			delete c->data;
+		if(c->data)
+			ready.Append(c->data);
 		if(chunk_return_)
 			chunk_return_->ReturnChunk(c->incoming);
 		else
@@ -71,11 +71,14 @@ void TraceProcessor::OnConverted(Chunk *c)
 				c = *it;
 				*it = flush_pending_list_.back();
 				flush_pending_list_.pop_back();
-				continue;
+				break;
 			}
 		}
 	} while(c);
 
+	if(sink_ && !ready.empty())
+		sink_->SinkChain(std::move(ready));
+
 	if(quit_when_flushed_ && sequence_ == next_flush_id_)
 		QuitOnFlushed();
 }
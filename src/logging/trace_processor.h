@@ -1,5 +1,6 @@
 #pragma once
 
+#include "io/chain.h"
 #include "sys/sync.h"
 #include "trace_collector.h"
 
@@ -14,6 +15,12 @@ class TraceProcessorSink
 public:
 	virtual ~TraceProcessorSink() = default;
 	virtual void SinkData(std::string *data) = 0;
+	// Several consecutive chunks at once, as segments of one chain
+	virtual void SinkChain(IoChain &&chain)
+	{
+		auto c = chain.Coalesce();
+		SinkData(new std::string((const char *)c, chain.size()));
+	}
 };
 
 class TraceProcessor : public TraceSink
@@ -213,12 +213,10 @@ bool chan_demand(LuaChannel *c, double to)
 	return false;
 }
 
-uint32_t chan_push(LuaChannel *c, const char *v, size_t l, double to)
+namespace {
+uint32_t PushLocked(LuaChannel *c, IoChain &&message, double to)
 {
-	void *p = malloc(l);
-	assert(p);
-	memcpy(p, v, l);
-	c->messages.emplace_back(LuaChannelMessage{p, l});
+	c->messages.emplace_back(LuaChannelMessage{std::move(message)});
 	uint32_t r = c->wr++;
 	c->wv.notify_all();
 
@@ -231,6 +229,35 @@ uint32_t chan_push(LuaChannel *c, const char *v, size_t l, double to)
 
 	return r;
 }
+} // namespace
+
+uint32_t chan_push(LuaChannel *c, const char *v, size_t l, double to)
+{
+	void *p = malloc(l);
+	assert(p);
+	memcpy(p, v, l);
+	IoChain message;
+	message.AppendMalloc(p, l);
+	return PushLocked(c, std::move(message), to);
+}
+
+uint32_t ChanPush(LuaChannel *c, IoChain message)
+{
+	std::unique_lock<CriticalSection> l(c->l);
+	return PushLocked(c, std::move(message), 0);
+}
+
+bool ChanPop(LuaChannel *c, IoChain *message)
+{
+	std::unique_lock<CriticalSection> l(c->l);
+	if(c->messages.empty())
+		return false;
+	*message = std::move(c->messages.front().data);
+	c->messages.pop_front();
+	c->rd++;
+	c->rv.notify_all();
+	return true;
+}
 
 uint32_t chan_get_count(LuaChannel *c)
 {
@@ -246,14 +273,16 @@ bool chan_has_read(LuaChannel *c, uint32_t id)
 
 const void *chan_peek_str(LuaChannel *c)
 {
-	return c->messages.front().mem;
+	// Messages pushed from native code may be in several pieces
+	return c->messages.front().data.Coalesce();
 }
 size_t chan_peek_sz(LuaChannel *c)
 {
-	return c->messages.front().sz;
+	return (size_t)c->messages.front().data.size();
 }
 void chan_read(LuaChannel *c)
 {
+	c->messages.pop_front();
 	c->rd++;
 	c->rv.notify_all();
 }
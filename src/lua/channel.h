@@ -5,14 +5,14 @@
 #include <atomic>
 #include <deque>
 
+#include "io/chain.h"
 #include "sys/sync.h"
 
 namespace lune {
 
 struct LuaChannelMessage
 {
-	void *mem;
-	size_t sz;
+	IoChain data;
 };
 
 struct LuaChannel
@@ -29,4 +29,10 @@ struct LuaChannel
 	std::atomic<uint32_t> refs;
 };
 
+// Native access to channels. Messages travel as chains, so large payloads are passed without copying.
+// Both take the channel lock
+uint32_t ChanPush(LuaChannel *c, IoChain message);
+// Removes and returns the front message, if any
+bool ChanPop(LuaChannel *c, IoChain *message);
+
 }
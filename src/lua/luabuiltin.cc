@@ -18,6 +18,23 @@ bool RegisterSetup(const char *text)
 		aggegate_init_code = new std::string(R"(
 local weakk = {__mode="k"}
 local internal = {blobmap=setmetatable({}, weakk)}
+
+-- C calls Lua back by posting a Callback event with an id from addCallback; the function runs once.
+-- runCallback is only handed to boot.lua, so sandboxed code can't fire other code's callbacks
+local callbacks, next_callback = {}, 1
+function internal.addCallback(fn)
+	local id = next_callback
+	next_callback = next_callback + 1
+	callbacks[id] = fn
+	return id
+end
+function internal.runCallback(id, ...)
+	local fn = callbacks[id]
+	if not fn then return false end
+	callbacks[id] = nil
+	fn(...)
+	return true
+end
 )");
 		aggegate_init_code->reserve(16384);
 	}
@@ -87,10 +104,12 @@ bool PrepareState(lua_State *L)
 	lua_setfield(L, -2, "debugBuild");
 #endif
 	lua_setglobal(L, "lune");
-	if(!aggegate_init_code)
+	if(!aggegate_init_code) {
+		lua_pushnil(L);
 		return true;
-	return !luaL_loadbuffer(L, aggegate_init_code->data(), aggegate_init_code->size(), "[lune INIT]") &&
-	       !lua_pcall(L, 0, 0, 0);
+	}
+	std::string code = *aggegate_init_code + "return internal.runCallback\n";
+	return !luaL_loadbuffer(L, code.data(), code.size(), "[lune INIT]") && !lua_pcall(L, 0, 1, 0);
 }
 
 }
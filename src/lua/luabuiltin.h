@@ -31,6 +31,7 @@ bool RegisterSetup(const char *text);
 
 bool RegisterGlobal(const char *path, int (*fn)(lua_State *));
 
+// Pushes the function that runs callbacks from internal.addCallback, or the error if it fails
 bool PrepareState(lua_State *L);
 
 } // namespace internal
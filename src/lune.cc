@@ -5,7 +5,9 @@
 
 #include "sys/thread.h"
 
+#include "io/blob_cache.h"
 #include "io/file.h"
+#include "io/watch.h"
 
 #include "clock.h"
 #include "event.h"
@@ -141,6 +143,12 @@ double g_TargetFrameTime = 1.0 / 60.0;
 
 RefPtr<Blob> g_updateSource;
 
+// Watches /data if lune.options.watch_files is set, queueing what changed for Lua to take
+std::unique_ptr<FileWatcher> g_fileWatcher;
+CriticalSection g_changedFilesLock;
+std::vector<std::string> g_changedFiles;
+std::vector<std::string> g_takenChangedFiles;
+
 PoolThreadCommon g_PoolCommon;
 TLS_DECL(PoolThreadInfo *) currentThreadInfo;
 
@@ -254,6 +262,32 @@ void LuneSysUpdate(double dt)
 	g_PoolCommon.frame_wait.signal_inc();
 }
 
+void OnFilesChanged(const std::vector<std::string> &paths)
+{
+	g_changedFilesLock.lock();
+	bool posted = !g_changedFiles.empty();
+	g_changedFiles.insert(g_changedFiles.end(), paths.begin(), paths.end());
+	g_changedFilesLock.unlock();
+	// One event drains everything queued before Lua gets to it
+	if(!posted)
+		PostEvent(LuneToLuaEv::FilesChanged);
+}
+
+// Takes the paths changed since the last call. lune_changedFile reads them until the next call
+int LuneTakeChangedFiles()
+{
+	g_changedFilesLock.lock();
+	g_takenChangedFiles.clear();
+	g_takenChangedFiles.swap(g_changedFiles);
+	g_changedFilesLock.unlock();
+	return (int)g_takenChangedFiles.size();
+}
+
+const char *LuneChangedFile(int i)
+{
+	return g_takenChangedFiles[i].c_str();
+}
+
 int LuneGlobalCEv(lua_State *L)
 {
 	return 0;
@@ -271,7 +305,7 @@ const void *LunePopEngineEvent()
 
 LUA_REGISTER_FFI_FNS("lune", "newFrame", &LuneNewFrame, "popEvents", &LunePopEvents, "firstFrame", &LuneFirstFrame,
     "sysUpdate", &LuneSysUpdate, "pushEvent", &PostEvent, "endFrame", &LuneEndFrame, "popEngineEvent",
-    &LunePopEngineEvent);
+    &LunePopEngineEvent, "takeChangedFiles", &LuneTakeChangedFiles, "changedFile", &LuneChangedFile);
 
 void AddCommandline(const std::vector<std::string_view> &args)
 {
@@ -288,10 +322,11 @@ int LuneGlobalLoadFile(lua_State *L)
 {
 	const char *filename = luaL_checkstring(L, 1);
 
-	auto file = safe_vfs.OpenFile(filename, file_flags::kReadOnly);
+	auto file = safe_vfs.OpenFile(filename, file_flags::kReadOnly | file_flags::kSequential);
 	if(!file)
 		return luaL_error(L, "Can't open config file %s!", filename);
 
+	// The parser reads straight out of the page cache
 	auto blob = file.MapToBlob();
 	if(!blob)
 		return luaL_error(L, "Can't map config file %s!", filename);
@@ -326,7 +361,7 @@ int LuneGlobalInit(lua_State *L)
 {
 	if(!internal::PrepareState(L))
 		return lua_error(L);
-	return 0;
+	return 1;
 }
 
 void SetGlobals(lua_State *L)
@@ -364,6 +399,7 @@ void SetGlobals(lua_State *L)
 	EV(Visible);
 	EV(Resized);
 	EV(EndFrame);
+	EV(FilesChanged);
 #undef EV
 	lua_pushinteger(L, (lua_Integer)LuneToLuaEv::UserUpdate), lua_setfield(L, -2, "Update");
 	lua_pushinteger(L, (lua_Integer)LuneToLuaEv::UserDraw), lua_setfield(L, -2, "Draw");
@@ -430,6 +466,7 @@ void PoolThreadMain(std::string *err, PoolThreadInfo *info)
 		const char *err = lua_tostring(L, -1);
 		abort();
 	}
+	lua_pop(L, 1);
 	if(luaL_loadbuffer(L, kJailSrc, sizeof(kJailSrc) - 1, "[lune jail.lua]") || lua_pcall(L, 0, 0, 0)) {
 		const char *err = lua_tostring(L, -1);
 		LOGF("Lua fail %s\n", err);
@@ -499,6 +536,18 @@ Action RunLune()
 	lua_getfield(L, -1, "options");
 	GetField(L, "identity", opts.app_name);
 	GetField(L, "local_save_dir", opts.use_writable_app_dir_if_possible);
+	int temp_ram_mb = 0;
+	GetField(L, "temp_ram_mb", temp_ram_mb);
+	if(temp_ram_mb > 0)
+		opts.temp_ram_budget = (uint64_t)temp_ram_mb << 20;
+	int blob_cache_mb = -1;
+	GetField(L, "blob_cache_mb", blob_cache_mb);
+	if(blob_cache_mb >= 0)
+		blob_cache.SetBudget((uint64_t)blob_cache_mb << 20);
+
+	// Debounce interval in milliseconds; unset or 0 doesn't watch
+	int watch_files_ms = 0;
+	GetField(L, "watch_files", watch_files_ms);
 
 	int n_threads = -1;
 	GetField(L, "worker_threads", n_threads);
@@ -547,6 +596,15 @@ Action RunLune()
 		return Action::Quit;
 	}
 
+	if(watch_files_ms > 0) {
+		g_fileWatcher = FileWatcher::Create(safe_vfs_impl, (uint32_t)watch_files_ms);
+		if(g_fileWatcher) {
+			g_fileWatcher->AddListener(&OnFilesChanged);
+			if(!g_fileWatcher->Watch("/data/"))
+				LOGW("Can't watch /data for changes");
+		}
+	}
+
 	struct WorkThread
 	{
 		std::unique_ptr<UserThread> t;
@@ -579,6 +637,9 @@ Action RunLune()
 
 	for(auto &t : work_threads) { t.t->thread()->Join(); }
 
+	g_fileWatcher = nullptr;
+	g_changedFiles.clear();
+
 	Action ret = Action::Quit;
 	if(lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "restart") == 0)
 		ret = Action::Restart;
@@ -603,6 +664,7 @@ int LuneMain()
 
 	while(RunLune() == Action::Restart)
 		;
+	ShutdownOsIo();
 	OPTICK_SHUTDOWN();
 
 	return 0;
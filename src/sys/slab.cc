@@ -0,0 +1,141 @@
+#include "slab.h"
+#include "logging.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+namespace lune {
+namespace {
+std::atomic<uint32_t> num_pools;
+SlabPool *pools[SlabPool::kMaxPools];
+
+TLS_DECL(SlabPool::ThreadCache) tls_caches[SlabPool::kMaxPools];
+
+// Counters are folded into the shared totals once a thread's local delta reaches this, so live/peak
+// are accurate to within kCounterBatch objects per thread
+constexpr int32_t kCounterBatch = 32;
+} // namespace
+
+SlabPool::SlabPool(const char *name, size_t object_size)
+    : size_((object_size + 15) & ~(size_t)15), name_(name), live_name_(name), peak_name_(name)
+{
+	live_name_.append(".live");
+	peak_name_.append(".peak");
+	index_ = num_pools.fetch_add(1, std::memory_order_acq_rel);
+	if(index_ < kMaxPools)
+		pools[index_] = this;
+	else
+		index_ = kMaxPools;
+}
+
+void *SlabPool::Alloc()
+{
+	if(!pooled()) {
+		RaisePeak(live_.fetch_add(1, std::memory_order_relaxed) + 1);
+		return malloc(size_);
+	}
+	auto &c = tls_caches[index_];
+	if(!c.head)
+		Refill(c);
+	FreeNode *n = c.head;
+	c.head = n->next;
+	c.count--;
+	if(++c.live_delta >= kCounterBatch)
+		PublishCounters(c);
+	return n;
+}
+
+void SlabPool::Free(void *p)
+{
+	if(!p)
+		return;
+	if(!pooled()) {
+		live_.fetch_sub(1, std::memory_order_relaxed);
+		free(p);
+		return;
+	}
+	auto &c = tls_caches[index_];
+	FreeNode *n = static_cast<FreeNode *>(p);
+	n->next = c.head;
+	c.head = n;
+	c.count++;
+	if(--c.live_delta <= -kCounterBatch)
+		PublishCounters(c);
+	if(c.count >= kMaxCached)
+		Drain(c, kBatch);
+}
+
+void SlabPool::Refill(ThreadCache &c)
+{
+	depot_lock_.lock();
+	if(!depot_.empty()) {
+		auto batch = depot_.back();
+		depot_.pop_back();
+		depot_lock_.unlock();
+		c.head = batch.first;
+		c.count = batch.second;
+		return;
+	}
+	depot_lock_.unlock();
+
+	uint8_t *slab = (uint8_t *)malloc(size_ * kObjectsPerSlab);
+	LUNE_ASSERT(slab);
+	for(uint32_t i = 0; i < kObjectsPerSlab; i++) {
+		FreeNode *n = (FreeNode *)(slab + i * size_);
+		n->next = (i + 1 < kObjectsPerSlab) ? (FreeNode *)(slab + (i + 1) * size_) : nullptr;
+	}
+	c.head = (FreeNode *)slab;
+	c.count = kObjectsPerSlab;
+}
+
+void SlabPool::Drain(ThreadCache &c, uint32_t n)
+{
+	if(!c.head)
+		return;
+	FreeNode *first = c.head;
+	FreeNode *last = first;
+	uint32_t taken = 1;
+	while(taken < n && last->next) {
+		last = last->next;
+		taken++;
+	}
+	c.head = last->next;
+	c.count -= taken;
+	last->next = nullptr;
+
+	std::unique_lock<CriticalSection> l(depot_lock_);
+	depot_.emplace_back(first, taken);
+}
+
+int64_t SlabPool::RaisePeak(int64_t live)
+{
+	int64_t peak = peak_.load(std::memory_order_relaxed);
+	while(live > peak && !peak_.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+		;
+	return live > peak ? live : peak;
+}
+
+void SlabPool::PublishCounters(ThreadCache &c)
+{
+	int64_t live = live_.fetch_add(c.live_delta, std::memory_order_relaxed) + c.live_delta;
+	c.live_delta = 0;
+	int64_t peak = RaisePeak(live);
+
+	const char *series[2] = {live_name_.c_str(), peak_name_.c_str()};
+	int64_t values[2] = {live, peak};
+	TRACE_COUNTER("mem", "SlabPool", index_, 2, series, values);
+}
+
+void SlabPool::ReleaseThreadCaches()
+{
+	uint32_t n = std::min(num_pools.load(std::memory_order_acquire), kMaxPools);
+	for(uint32_t i = 0; i < n; i++) {
+		auto &c = tls_caches[i];
+		if(c.live_delta)
+			pools[i]->PublishCounters(c);
+		while(c.head) pools[i]->Drain(c, kBatch);
+	}
+}
+
+} // namespace lune
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "config.h"
+#include "logging.h"
+#include "sys/sync.h"
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace lune {
+
+// A fixed-size object allocator for small, high-churn objects (AsyncOps, promises, IoBuffer wrappers).
+// Every thread keeps a short free list per pool, so allocation and free normally touch only
+// thread-local memory. Objects may be freed on any thread: the freeing thread's cache absorbs them,
+// and once a cache grows past kMaxCached a batch is handed to the pool's shared depot for other
+// threads to pick up. This keeps producer/consumer pairs (alloc on the caller, free on an I/O thread)
+// from growing without bound. Slab memory is never returned to the OS.
+// Each pool takes a slot in every thread's cache table. Pools created once the table is full allocate
+// from the heap instead, so a program with many pooled types still works, just more slowly.
+class SlabPool
+{
+public:
+	static constexpr uint32_t kObjectsPerSlab = 64;
+	static constexpr uint32_t kMaxCached = 128;
+	static constexpr uint32_t kBatch = 64;
+	static constexpr uint32_t kMaxPools = 64;
+
+	SlabPool(const char *name, size_t object_size);
+	~SlabPool() = default;
+
+	SlabPool(const SlabPool &) = delete;
+	void operator=(const SlabPool &) = delete;
+
+	void *Alloc();
+	void Free(void *p);
+
+	size_t object_size() const { return size_; }
+	const std::string &name() const { return name_; }
+	// False for pools past kMaxPools, which use the heap
+	bool pooled() const { return index_ < kMaxPools; }
+
+	int64_t live() const { return live_.load(std::memory_order_relaxed); }
+	int64_t peak() const { return peak_.load(std::memory_order_relaxed); }
+
+	// Returns the calling thread's cached objects to their depots. Called as threads exit
+	static void ReleaseThreadCaches();
+
+	struct FreeNode
+	{
+		FreeNode *next;
+	};
+	struct ThreadCache
+	{
+		FreeNode *head;
+		uint32_t count;
+		int32_t live_delta;
+	};
+
+private:
+	void Refill(ThreadCache &c);
+	void Drain(ThreadCache &c, uint32_t n);
+	void PublishCounters(ThreadCache &c);
+	// Returns the peak, having raised it to live if need be
+	int64_t RaisePeak(int64_t live);
+
+	size_t size_;
+	uint32_t index_;
+
+	CriticalSection depot_lock_;
+	std::vector<std::pair<FreeNode *, uint32_t>> depot_;
+
+	std::atomic<int64_t> live_ = 0;
+	std::atomic<int64_t> peak_ = 0;
+
+	std::string name_;
+	std::string live_name_;
+	std::string peak_name_;
+};
+
+namespace details {
+// T as the compiler spells it, e.g. lune::Promise<int>
+template<typename T>
+const char *TypeName()
+{
+	static const std::string name = [](std::string_view s) {
+#if _MSC_VER
+		size_t b = s.find("TypeName<");
+		if(b == s.npos)
+			return std::string(s);
+		s = s.substr(b + 9, s.rfind(">(void)") - b - 9);
+		for(std::string_view tag : {"class ", "struct "})
+			if(s.starts_with(tag))
+				s.remove_prefix(tag.size());
+#else
+		size_t b = s.find("T = ");
+		if(b == s.npos)
+			return std::string(s);
+		s = s.substr(b + 4, s.find_first_of(";]", b) - b - 4);
+#endif
+		return std::string(s);
+	}(LUNE_PRETTY_FUNCTION);
+	return name.c_str();
+}
+} // namespace details
+
+// One pool per type, named after it so each instantiation of a template shows up separately in traces.
+// The pool is created on first use
+template<typename T>
+inline SlabPool *SlabPoolFor()
+{
+	static SlabPool pool(details::TypeName<T>(), sizeof(T));
+	return &pool;
+}
+
+} // namespace lune
+
+// Place in a class body to allocate instances of that class from a SlabPool. Derived classes that
+// do not redeclare this fall back to the global heap, as their size does not match the pool
+#define LUNE_SLAB_ALLOCATED(T)                               \
+	static void *operator new(size_t sz)                     \
+	{                                                        \
+		if(sz != sizeof(T))                                  \
+			return ::operator new(sz);                       \
+		return ::lune::SlabPoolFor<T>()->Alloc();            \
+	}                                                        \
+	static void operator delete(void *p, size_t sz)          \
+	{                                                        \
+		if(sz != sizeof(T))                                  \
+			return ::operator delete(p);                     \
+		::lune::SlabPoolFor<T>()->Free(p);                   \
+	}                                                        \
+	static void *operator new(size_t, void *p) { return p; } \
+	static void operator delete(void *, void *) {}
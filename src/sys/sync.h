@@ -2,6 +2,8 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <stdint.h>
@@ -68,6 +70,17 @@ typedef std::condition_variable CondVar;
 typedef CondVarImpl CondVar;
 #endif
 
+// Waits until cv is notified or about timeout_us has passed, whichever CondVar is in use. Wakeups may be
+// early or spurious, so callers recheck their condition and the time
+inline void TimedWait(CondVar &cv, std::unique_lock<CriticalSection> &l, uint64_t timeout_us)
+{
+#if CONDVAR_IS_STDCONDVAR
+	cv.wait_for(l, std::chrono::microseconds(timeout_us));
+#else
+	cv.wait_direct(*l.mutex(), (uint32_t)std::min<uint64_t>((timeout_us + 999) / 1000, UINT32_MAX - 1));
+#endif
+}
+
 class OneShotEvent
 {
 public:
@@ -1,5 +1,13 @@
 #include "thread.h"
 #include "except.h"
+#include "refptr.h"
+#include "slab.h"
+#include "sync.h"
+
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <vector>
 
 namespace lune {
 
@@ -29,6 +37,7 @@ void OsThread::Start()
 		tls_CurrentThread = t.get();
 		OPTICK_THREAD(t->name_.c_str());
 		sys::TryCatch(t->thread_entry_);
+		SlabPool::ReleaseThreadCaches();
 		t->exited_ = true;
 	});
 	DoOsInit();
@@ -91,6 +100,120 @@ UserThread::UserThread(std::function<void()> fn, const std::string &name)
 
 UserThread::~UserThread() = default;
 
+namespace {
+// Runs posted tasks on a fixed set of threads, in no particular order
+class WorkerPool : public TaskRunner
+{
+public:
+	WorkerPool(const char *name, ThreadType type, uint32_t n)
+	{
+		for(uint32_t i = 0; i < n; i++)
+			threads_.emplace_back(OsThread::CreateRawThread(std::bind(&WorkerPool::ThreadMain, this), name, type));
+	}
+	~WorkerPool() override
+	{
+		{
+			std::unique_lock<CriticalSection> l(lock_);
+			stopping_ = true;
+		}
+		cv_.notify_all();
+		for(auto &t : threads_) t->Join();
+	}
+
+	void PostTask(std::function<void()> fn) override
+	{
+		{
+			std::unique_lock<CriticalSection> l(lock_);
+			queue_.push_back(std::move(fn));
+		}
+		cv_.notify_one();
+	}
+	void PostTask(void (*fn)(void *), void *context) override
+	{
+		PostTask([fn, context]() { fn(context); });
+	}
+
+	uint32_t concurrency() const override { return (uint32_t)threads_.size(); }
+
+private:
+	void ThreadMain()
+	{
+		OsThread::Current()->SetTaskRunner(this);
+		while(true) {
+			std::function<void()> fn;
+			{
+				std::unique_lock<CriticalSection> l(lock_);
+				while(queue_.empty() && !stopping_) cv_.wait(l);
+				if(queue_.empty())
+					return;
+				fn = std::move(queue_.front());
+				queue_.pop_front();
+			}
+			fn();
+		}
+	}
+
+	CriticalSection lock_;
+	CondVar cv_;
+	std::deque<std::function<void()>> queue_;
+	bool stopping_ = false;
+	std::vector<std::shared_ptr<OsThread>> threads_;
+};
+
+struct ParallelJob : public Refcounted
+{
+	ParallelJob(const std::function<void(uint32_t, size_t)> *fn, size_t n) : fn(fn), n(n) {}
+
+	void Run(uint32_t worker)
+	{
+		for(size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;) {
+			(*fn)(worker, i);
+			if(done.fetch_add(1, std::memory_order_acq_rel) + 1 == n)
+				all_done.signal();
+		}
+	}
+
+	// Only called for claimed indices, which ParallelFor waits for, so the caller's fn outlives every call
+	const std::function<void(uint32_t, size_t)> *fn;
+	size_t n;
+	std::atomic<size_t> next = 0;
+	std::atomic<size_t> done = 0;
+	OneShotEvent all_done;
+};
+} // namespace
+
+std::unique_ptr<TaskRunner> CreateWorkerPool(const char *name, uint32_t threads)
+{
+	return std::make_unique<WorkerPool>(name, ThreadType::POOL, std::max(1u, threads));
+}
+
+void ParallelFor(TaskRunner *pool, size_t n, const std::function<void(uint32_t worker, size_t i)> &fn)
+{
+	if(!n)
+		return;
+	RefPtr<ParallelJob> job = new ParallelJob(&fn, n);
+	// Helpers that start after the caller has taken every index find nothing left and return
+	auto helpers = (uint32_t)std::min<size_t>(n, ParallelWorkers(pool)) - 1;
+	for(uint32_t w = 1; w <= helpers; w++) pool->PostTask([job, w]() { job->Run(w); });
+	job->Run(0);
+	job->all_done.wait();
+}
+
+TaskRunner *GetPoolIo()
+{
+	// Blocking filesystem calls run here, so there are enough threads to keep a few slow ones in flight.
+	// Never destroyed, as tasks may still be queued at exit
+	static auto pool = new WorkerPool("IoPool", ThreadType::IO, 4);
+	return pool;
+}
+
+TaskRunner *GetPoolUser()
+{
+	// CPU-bound work, one thread per core. Never destroyed, for the same reason as the I/O pool
+	static auto pool = new WorkerPool("UserPool", ThreadType::POOL, std::max(1u, std::thread::hardware_concurrency()));
+	return pool;
+}
+
 namespace details {
 
 void InitMainThread()
@@ -3,9 +3,11 @@
 #include "config.h"
 #include "logging.h"
 
+#include <algorithm>
 #include <atomic>
 #include <functional>
 #include <list>
+#include <memory>
 #include <string>
 #include <mutex>
 #include <thread>
@@ -69,6 +71,9 @@ public:
 		return [this, fn = std::move(fn)](Args &&args...) { PostTask(std::bind(fn), args...); };
 	}
 
+	// How many tasks the runner can run at once
+	virtual uint32_t concurrency() const { return 1; }
+
 	static TaskRunner *Current();
 };
 
@@ -270,6 +275,20 @@ TaskRunner *GetPoolIo();
 TaskRunner *GetPoolUser();
 TaskRunner *GetPoolUserLongRunning();
 
+// A pool of its own, for work that must not compete with the shared pools or that needs a set number of
+// threads. Tasks still queued when it is destroyed are run first
+std::unique_ptr<TaskRunner> CreateWorkerPool(const char *name, uint32_t threads);
+
+// Runs fn(worker, i) for every i below n and returns once all have run. The calling thread takes indices
+// alongside up to concurrency() - 1 tasks posted to the pool, so this is safe to call from one of the
+// pool's own threads. Workers are numbered below ParallelWorkers(pool) and take one index at a time, so
+// state kept per worker needs no locking
+void ParallelFor(TaskRunner *pool, size_t n, const std::function<void(uint32_t worker, size_t i)> &fn);
+inline uint32_t ParallelWorkers(TaskRunner *pool)
+{
+	return std::max(1u, pool->concurrency());
+}
+
 namespace details {
 void InitMainThread();
 }
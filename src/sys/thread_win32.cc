@@ -239,9 +239,11 @@ int32_t Win32ErrorIoErr(DWORD err)
 	switch(err) {
 	case ERROR_HANDLE_EOF:
 		return io_err::kEOF;
+	case ERROR_OPERATION_ABORTED:
+		return io_err::kCancelled;
 	}
 	LUNE_BP();
-	return 0;
+	return io_err::FromOs(err);
 }
 } // namespace
 
@@ -1,5 +1,7 @@
 #include "compress.h"
 
+#include <algorithm>
+
 namespace lune {
 namespace details {
 CompressionAlgorithm *CompressZstd();
@@ -15,4 +17,33 @@ CompressionAlgorithm *CompressionAlgorithm::Get(CompressionAlgorithmType type)
 	}
 }
 
+bool StreamFile(File &in, OutputStream *out, size_t block_size)
+{
+	uint64_t pos = in.Tell();
+	uint64_t end = in.file()->GetFileSize();
+	auto read_next = [&]() -> RefPtr<Blob> {
+		if(pos >= end)
+			return nullptr;
+		uint64_t n = std::min<uint64_t>(block_size, end - pos);
+		auto b = in.ReadToFutureBlob(pos, n);
+		pos += n;
+		return b;
+	};
+	bool ok = true;
+	for(RefPtr<Blob> cur = read_next(); cur;) {
+		RefPtr<Blob> next = read_next();
+		cur->wait();
+		if(cur->errored()) {
+			ok = false;
+			if(next)
+				next->wait();
+			break;
+		}
+		out->Write(cur->GetData(), (uint32_t)cur->GetSize());
+		cur = std::move(next);
+	}
+	in.Seek(File::SeekFrom::Start, (int64_t)pos);
+	return ok;
+}
+
 }
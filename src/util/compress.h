@@ -1,6 +1,9 @@
 #pragma once
 
 #include "blob.h"
+#include "cancel.h"
+#include "io/chain.h"
+#include "io/file.h"
 #include "sys/thread.h"
 
 namespace lune {
@@ -13,12 +16,40 @@ enum class CompressionAlgorithmType
 // Compression and decompression using a single context is safe so long as the same task runner is
 // used for each call AND it is a single threaded task tunner
 
+// Compresses everything written to it as one frame, passing the output on to out a block at a time as
+// it is produced. Only the algorithm's window and one output block are held, however much is written.
+// Flush ends a block, so that everything written so far can be decompressed, and flushes out. Finish
+// ends the frame; a stream destroyed unfinished finishes it
+class CompressionStream : public SyncOutputStream
+{
+public:
+	// False if anything failed, in which case what reached out is unusable
+	virtual bool Finish() = 0;
+};
+
+// Decompresses frames written to it in pieces of any size, passing the output on to out a block at a
+// time as it is produced
+class DecompressionStream : public SyncOutputStream
+{
+public:
+	// Passes on the last of the output. False if the input was corrupt or ended partway into a frame
+	virtual bool Finish() = 0;
+};
+
 class CompressionContext
 {
 public:
 	virtual ~CompressionContext() = default;
 
-	virtual RefPtr<Blob> Compress(Blob *b, TaskRunner *runner = nullptr) = 0;
+	// If a cancellation token is given and is cancelled before the work starts, the result resolves as
+	// errored without doing the work
+	virtual RefPtr<Blob> Compress(Blob *b, TaskRunner *runner = nullptr, CancellationToken *cancel = nullptr) = 0;
+	// Compresses the chain as one frame, streaming straight from its segments, on the calling thread.
+	// The output is appended to out as a chain of blocks
+	virtual bool CompressChain(const IoChain &in, IoChain *out) = 0;
+	// The stream uses this context, which must not be used for anything else until it is destroyed.
+	// A nonzero size is the exact number of bytes that will be written, which is recorded in the frame
+	virtual std::unique_ptr<CompressionStream> CreateStream(OutputStream *out, uint64_t size = 0) = 0;
 };
 
 class DecompressionContext
@@ -26,7 +57,34 @@ class DecompressionContext
 public:
 	virtual ~DecompressionContext() = default;
 
-	virtual RefPtr<Blob> Decompress(Blob *b, TaskRunner *runner = nullptr) = 0;
+	// As Compress, a cancelled token resolves the result as errored without doing the work
+	virtual RefPtr<Blob> Decompress(Blob *b, TaskRunner *runner = nullptr, CancellationToken *cancel = nullptr) = 0;
+	// Decompresses the frames held in a chain, on the calling thread. Fails on corrupt or truncated
+	// input
+	virtual bool DecompressChain(const IoChain &in, IoChain *out) = 0;
+	// The stream uses this context, which must not be used for anything else until it is destroyed
+	virtual std::unique_ptr<DecompressionStream> CreateStream(OutputStream *out) = 0;
+};
+
+// Writes the rest of a file to out a block at a time, reading the next block while out takes the
+// current one, and leaves the file's position at the end. For piping files through the streams above
+// without holding either side in memory. False if a read failed
+bool StreamFile(File &in, OutputStream *out, size_t block_size = 1 << 20);
+
+// Random access into data written by CompressionAlgorithm::CompressSeekable
+class SeekableDecompressor
+{
+public:
+	virtual ~SeekableDecompressor() = default;
+
+	// Decompressed size
+	virtual uint64_t size() const = 0;
+	virtual uint32_t frame_count() const = 0;
+
+	// Decompresses n bytes from offset, decoding only the frames that cover them. The frames are decoded in
+	// parallel by the pool and the calling thread, which returns once all are done. False if the range runs
+	// past the end or a frame is corrupt
+	virtual bool Read(uint64_t offset, void *out, size_t n) = 0;
 };
 
 class CompressionAlgorithm
@@ -35,9 +93,26 @@ public:
 	static CompressionAlgorithm *Get(CompressionAlgorithmType type);
 
 
-	virtual std::unique_ptr<CompressionContext> CreateCompressor(Blob *dictionary = nullptr) = 0;
+	// A level of 0 uses the algorithm's default
+	virtual std::unique_ptr<CompressionContext> CreateCompressor(Blob *dictionary = nullptr, int level = 0) = 0;
 	virtual std::unique_ptr<DecompressionContext> CreateDecompressor(Blob *dictionary = nullptr) = 0;
 
+	// Trains a dictionary of at most max_size bytes from sample inputs, on the calling thread. Returns null
+	// if the algorithm has no dictionaries or there are too few samples to learn from
+	virtual RefPtr<Blob> TrainDictionary(const std::vector<Blob *> &samples, size_t max_size) { return nullptr; }
+
+	// Compresses b as independent frames of frame_size bytes, in parallel on pool (the user pool if null),
+	// followed by a seek table. Any decoder can still read the result whole. It resolves once b has and
+	// every frame is done. Null if the algorithm has no seekable format
+	virtual RefPtr<Blob> CompressSeekable(
+	    Blob *b, size_t frame_size = 1 << 20, int level = 0, TaskRunner *pool = nullptr)
+	{
+		return nullptr;
+	}
+	// Opens a resolved blob written by CompressSeekable, which it keeps alive. Null if it has no valid seek
+	// table
+	virtual std::unique_ptr<SeekableDecompressor> OpenSeekable(Blob *b, TaskRunner *pool = nullptr) { return nullptr; }
+
 protected:
 	virtual ~CompressionAlgorithm() = default;
 };
@@ -1,20 +1,193 @@
 #include "compress.h"
 
 #define ZSTD_STATIC_LINKING_ONLY
+#include "third_party/zstd/lib/zdict.h"
 #include "third_party/zstd/lib/zstd.h"
 
+#include <algorithm>
+#include <atomic>
+
 namespace lune {
 namespace details {
 namespace {
 
+// Output blocks for the chain APIs. A block is handed to the output chain once full
+class OutBlock
+{
+public:
+	~OutBlock() { Release(); }
+
+	ZSTD_outBuffer Get(IoChain *out, size_t size)
+	{
+		if(full()) {
+			Finish(out);
+			mem_ = malloc(size);
+			assert(mem_);
+			size_ = size;
+		}
+		return ZSTD_outBuffer{mem_, size_, used_};
+	}
+	void Advance(size_t pos) { used_ = pos; }
+	bool full() const { return used_ == size_; }
+
+	void Finish(IoChain *out)
+	{
+		if(mem_)
+			out->AppendMalloc(mem_, used_);
+		mem_ = nullptr;
+		size_ = used_ = 0;
+	}
+	void Release()
+	{
+		free(mem_);
+		mem_ = nullptr;
+		size_ = used_ = 0;
+	}
+
+private:
+	void *mem_ = nullptr;
+	size_t size_ = 0;
+	size_t used_ = 0;
+};
+
+class ZSTDCStream : public CompressionStream
+{
+public:
+	ZSTDCStream(ZSTD_CCtx *cctx, OutputStream *out, uint64_t size) : cctx_(cctx), out_(out)
+	{
+		ZSTD_CCtx_reset(cctx_, ZSTD_reset_session_only);
+		if(size)
+			ZSTD_CCtx_setPledgedSrcSize(cctx_, size);
+	}
+	~ZSTDCStream() override
+	{
+		Finish();
+	}
+
+	void Write(const void *data, uint32_t size) override
+	{
+		ZSTD_inBuffer in = {data, size, 0};
+		Run(&in, ZSTD_e_continue);
+	}
+	void Flush() override
+	{
+		ZSTD_inBuffer in = {nullptr, 0, 0};
+		Run(&in, ZSTD_e_flush);
+		Emit();
+		out_->Flush();
+	}
+	bool Finish() override
+	{
+		if(!finished_) {
+			ZSTD_inBuffer in = {nullptr, 0, 0};
+			Run(&in, ZSTD_e_end);
+			Emit();
+			finished_ = true;
+		}
+		return ok_;
+	}
+
+private:
+	// Returns once the input is consumed and, unless continuing, everything it produced is in blocks
+	void Run(ZSTD_inBuffer *in, ZSTD_EndDirective mode)
+	{
+		while(ok_ && !finished_) {
+			IoChain full;
+			ZSTD_outBuffer outb = block_.Get(&full, ZSTD_CStreamOutSize());
+			if(!full.empty())
+				out_->WriteChain(full);
+			size_t r = ZSTD_compressStream2(cctx_, &outb, in, mode);
+			block_.Advance(outb.pos);
+			if(ZSTD_isError(r))
+				ok_ = false;
+			else if(mode == ZSTD_e_continue ? in->pos == in->size : !r)
+				break;
+		}
+	}
+	void Emit()
+	{
+		IoChain c;
+		block_.Finish(&c);
+		if(!c.empty())
+			out_->WriteChain(c);
+	}
+
+	ZSTD_CCtx *cctx_;
+	OutputStream *out_;
+	OutBlock block_;
+	bool ok_ = true;
+	bool finished_ = false;
+};
+
+class ZSTDDStream : public DecompressionStream
+{
+public:
+	ZSTDDStream(ZSTD_DCtx *dctx, OutputStream *out) : dctx_(dctx), out_(out)
+	{
+		ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_only);
+	}
+	~ZSTDDStream() override
+	{
+		Finish();
+	}
+
+	void Write(const void *data, uint32_t size) override
+	{
+		ZSTD_inBuffer in = {data, size, 0};
+		fed_ |= size != 0;
+		// Also drain output that is still buffered once the input runs out. Input after the end of a
+		// frame starts the next one
+		while(ok_ && (in.pos < in.size || (r_ && block_.full()))) {
+			IoChain full;
+			ZSTD_outBuffer outb = block_.Get(&full, ZSTD_DStreamOutSize());
+			if(!full.empty())
+				out_->WriteChain(full);
+			r_ = ZSTD_decompressStream(dctx_, &outb, &in);
+			block_.Advance(outb.pos);
+			if(ZSTD_isError(r_))
+				ok_ = false;
+		}
+	}
+	void Flush() override
+	{
+		Emit();
+		out_->Flush();
+	}
+	bool Finish() override
+	{
+		Emit();
+		// A stream that was never written to holds no partial frame
+		return ok_ && (!r_ || !fed_);
+	}
+
+private:
+	void Emit()
+	{
+		IoChain c;
+		block_.Finish(&c);
+		if(!c.empty())
+			out_->WriteChain(c);
+	}
+
+	ZSTD_DCtx *dctx_;
+	OutputStream *out_;
+	OutBlock block_;
+	// What ZSTD_decompressStream last returned: 0 once a frame is complete and flushed
+	size_t r_ = 1;
+	bool ok_ = true;
+	// Set once any input has been written
+	bool fed_ = false;
+};
+
 class ZSTDCCTX : public CompressionContext
 {
 public:
-	ZSTDCCTX(Blob *dict) : dict_(dict), cctx_(ZSTD_createCCtx())
+	ZSTDCCTX(Blob *dict, int level) : dict_(dict), cctx_(ZSTD_createCCtx())
 	{
+		ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, level);
 		if(dict) {
 			auto data = dict->GetContents();
-			cdict_ = ZSTD_createCDict_byReference(data.first, data.second, 0);
+			cdict_ = ZSTD_createCDict_byReference(data.first, data.second, level);
 			ZSTD_CCtx_refCDict(cctx_, cdict_);
 		}
 	}
@@ -25,22 +198,62 @@ public:
 			ZSTD_freeCDict(cdict_);
 	}
 
-	RefPtr<Blob> Compress(Blob *b, TaskRunner *runner) final
+	RefPtr<Blob> Compress(Blob *b, TaskRunner *runner, CancellationToken *cancel) final
 	{
 		RefPtr<DynamicBlob> ret = new DynamicBlob();
 		b->AddRef();
 		ret->AddRef();
 		if(runner) {
-			runner->PostTask(std::bind(&ZSTDCCTX::DoCompress, this, b, ret.get()));
+			runner->PostTask(std::bind(&ZSTDCCTX::DoCompress, this, b, ret.get(), CancellationTokenPtr(cancel)));
 		} else {
-			DoCompress(b, ret);
+			DoCompress(b, ret, cancel);
 		}
 		return ret;
 	}
 
+	bool CompressChain(const IoChain &in, IoChain *out) final
+	{
+		ZSTD_CCtx_reset(cctx_, ZSTD_reset_session_only);
+		ZSTD_CCtx_setPledgedSrcSize(cctx_, in.size());
+		OutBlock block;
+		auto &segments = in.segments();
+		for(size_t i = 0;; i++) {
+			bool last = i >= segments.size();
+			ZSTD_inBuffer inb = {last ? nullptr : segments[i].data, last ? 0 : (size_t)segments[i].len, 0};
+			ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_continue;
+			for(;;) {
+				ZSTD_outBuffer outb = block.Get(out, ZSTD_CStreamOutSize());
+				size_t r = ZSTD_compressStream2(cctx_, &outb, &inb, mode);
+				block.Advance(outb.pos);
+				if(ZSTD_isError(r)) {
+					block.Release();
+					return false;
+				}
+				if(last ? !r : inb.pos == inb.size)
+					break;
+			}
+			if(last)
+				break;
+		}
+		block.Finish(out);
+		return true;
+	}
+
+	std::unique_ptr<CompressionStream> CreateStream(OutputStream *out, uint64_t size) final
+	{
+		return std::make_unique<ZSTDCStream>(cctx_, out, size);
+	}
+
 private:
-	void DoCompress(Blob *in, DynamicBlob *out)
+	void DoCompress(Blob *in, DynamicBlob *out, const CancellationTokenPtr &cancel)
 	{
+		if(cancel && cancel->IsCancelled()) {
+			cancel_stats::Avoided();
+			out->Resolved(true);
+			in->Release();
+			out->Release();
+			return;
+		}
 		auto src = in->GetContents();
 		auto bound = ZSTD_compressBound(src.second);
 		auto p = malloc(bound);
@@ -75,36 +288,83 @@ public:
 			ZSTD_freeDDict(ddict_);
 	}
 
-	RefPtr<Blob> Decompress(Blob *b, TaskRunner *runner) final
+	RefPtr<Blob> Decompress(Blob *b, TaskRunner *runner, CancellationToken *cancel) final
 	{
 		RefPtr<DynamicBlob> ret = new DynamicBlob();
 		b->AddRef();
 		ret->AddRef();
 		if(runner) {
-			runner->PostTask(std::bind(&ZSTDDCTX::DoDecompress, this, b, ret.get()));
+			runner->PostTask(std::bind(&ZSTDDCTX::DoDecompress, this, b, ret.get(), CancellationTokenPtr(cancel)));
 		} else {
-			DoDecompress(b, ret);
+			DoDecompress(b, ret, cancel);
 		}
 		return ret;
 	}
 
+	bool DecompressChain(const IoChain &in, IoChain *out) final
+	{
+		ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_only);
+		OutBlock block;
+		size_t r = 1;
+		for(auto &s : in.segments()) {
+			ZSTD_inBuffer inb = {s.data, (size_t)s.len, 0};
+			// Also drain output that is still buffered once the input runs out. Input after the end of a
+			// frame starts the next one, so every frame is decoded and trailing garbage is an error
+			while(inb.pos < inb.size || (r && block.full())) {
+				ZSTD_outBuffer outb = block.Get(out, ZSTD_DStreamOutSize());
+				r = ZSTD_decompressStream(dctx_, &outb, &inb);
+				block.Advance(outb.pos);
+				if(ZSTD_isError(r)) {
+					block.Release();
+					return false;
+				}
+			}
+		}
+		block.Finish(out);
+		return !r;
+	}
+
+	std::unique_ptr<DecompressionStream> CreateStream(OutputStream *out) final
+	{
+		return std::make_unique<ZSTDDStream>(dctx_, out);
+	}
+
 private:
-	void DoDecompress(Blob *in, DynamicBlob *out)
+	void DoDecompress(Blob *in, DynamicBlob *out, const CancellationTokenPtr &cancel)
 	{
+		if(cancel && cancel->IsCancelled()) {
+			cancel_stats::Avoided();
+			out->Resolved(true);
+			in->Release();
+			out->Release();
+			return;
+		}
 		auto src = in->GetContents();
 		auto bound = ZSTD_decompressBound(src.first, src.second);
 		if(bound == ZSTD_CONTENTSIZE_ERROR) {
 			out->Resolved(true);
 		} else {
-			auto p = malloc(bound);
+			auto p = malloc(bound ? bound : 1);
 			assert(p);
+			ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_only);
 			ZSTD_inBuffer inb = {src.first, src.second, 0};
 			ZSTD_outBuffer outb = {p, bound, 0};
-			auto sz = ZSTD_decompressStream(dctx_, &outb, &inb);
-			if(ZSTD_isError(sz)) {
+			// One call stops at the end of a frame, so this goes on until the input is used up, which also
+			// steps over skippable frames. The return value is 0 once the last frame is complete; anything
+			// else means the input was cut short. The decoded size is the output position
+			size_t r = 1;
+			while(inb.pos < inb.size) {
+				size_t before = inb.pos + outb.pos;
+				r = ZSTD_decompressStream(dctx_, &outb, &inb);
+				// bound covers every frame, so a call that moves nothing means the input is bad
+				if(ZSTD_isError(r) || inb.pos + outb.pos == before)
+					break;
+			}
+			if(ZSTD_isError(r) || r || inb.pos != inb.size) {
+				free(p);
 				out->Resolved(true);
 			} else {
-				out->Set(p, sz);
+				out->Set(p, outb.pos);
 			}
 		}
 
@@ -117,17 +377,226 @@ private:
 	ZSTD_DDict *ddict_ = nullptr;
 };
 
+// The seekable format of zstd's contrib/seekable_format: the frames back to back, then a skippable frame
+// holding the compressed and decompressed size of each, and a footer with the frame count
+constexpr uint32_t kSkippableMagic = 0x184D2A5E;
+constexpr uint32_t kSeekableMagic = 0x8F92EAB1;
+constexpr size_t kSeekFooterSize = 9;
+constexpr uint8_t kSeekChecksumFlag = 0x80;
+
+void Put32(uint8_t *p, uint32_t v)
+{
+	for(int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+uint32_t Get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Frames are compressed and decompressed on many threads at once, each with a context of its own
+ZSTD_CCtx *ThreadCCtx()
+{
+	thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> ctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+	return ctx.get();
+}
+ZSTD_DCtx *ThreadDCtx()
+{
+	thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> ctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+	return ctx.get();
+}
+
+class ZSTDSeekable : public SeekableDecompressor
+{
+public:
+	struct Frame
+	{
+		uint64_t offset;
+		uint64_t decompressed_offset;
+		uint32_t size;
+		uint32_t decompressed_size;
+	};
+
+	ZSTDSeekable(Blob *b, TaskRunner *pool, std::vector<Frame> frames, uint64_t size)
+	    : blob_(b), pool_(pool), frames_(std::move(frames)), size_(size)
+	{
+	}
+
+	uint64_t size() const final { return size_; }
+	uint32_t frame_count() const final { return (uint32_t)frames_.size(); }
+
+	bool Read(uint64_t offset, void *out, size_t n) final
+	{
+		if(offset > size_ || n > size_ - offset)
+			return false;
+		if(!n)
+			return true;
+		auto by_offset = [](uint64_t o, const Frame &f) { return o < f.decompressed_offset; };
+		size_t first = std::upper_bound(frames_.begin(), frames_.end(), offset, by_offset) - frames_.begin() - 1;
+		size_t last = std::upper_bound(frames_.begin(), frames_.end(), offset + n - 1, by_offset) - frames_.begin() - 1;
+		auto src = (const uint8_t *)blob_->GetData();
+		std::atomic<bool> ok = true;
+		ParallelFor(pool_, last - first + 1, [&](uint32_t, size_t i) {
+			auto &f = frames_[first + i];
+			uint64_t lo = std::max(offset, f.decompressed_offset);
+			uint64_t hi = std::min(offset + n, f.decompressed_offset + f.decompressed_size);
+			auto dst = (uint8_t *)out + (lo - offset);
+			// Frames wholly inside the range are decoded in place, the ends through a scratch buffer
+			bool whole = lo == f.decompressed_offset && hi - lo == f.decompressed_size;
+			thread_local std::vector<uint8_t> scratch;
+			if(!whole)
+				scratch.resize(f.decompressed_size);
+			void *to = whole ? dst : scratch.data();
+			size_t r = ZSTD_decompressDCtx(ThreadDCtx(), to, f.decompressed_size, src + f.offset, f.size);
+			if(ZSTD_isError(r) || r != f.decompressed_size) {
+				ok = false;
+				return;
+			}
+			if(!whole)
+				memcpy(dst, scratch.data() + (lo - f.decompressed_offset), hi - lo);
+		});
+		return ok;
+	}
+
+private:
+	RefPtr<Blob> blob_;
+	TaskRunner *pool_;
+	std::vector<Frame> frames_;
+	uint64_t size_;
+};
+
 class ZSTD : public CompressionAlgorithm
 {
 public:
-	std::unique_ptr<CompressionContext> CreateCompressor(Blob *dictionary) final
+	std::unique_ptr<CompressionContext> CreateCompressor(Blob *dictionary, int level) final
 	{
-		return std::make_unique<ZSTDCCTX>(dictionary);
+		return std::make_unique<ZSTDCCTX>(dictionary, level);
 	}
 	std::unique_ptr<DecompressionContext> CreateDecompressor(Blob *dictionary) final
 	{
 		return std::make_unique<ZSTDDCTX>(dictionary);
 	}
+
+	RefPtr<Blob> TrainDictionary(const std::vector<Blob *> &samples, size_t max_size) final
+	{
+		// The trainer wants the samples back to back
+		std::vector<uint8_t> buf;
+		std::vector<size_t> sizes;
+		for(auto b : samples) {
+			auto data = b->GetContents();
+			auto p = (const uint8_t *)data.first;
+			buf.insert(buf.end(), p, p + data.second);
+			sizes.push_back(data.second);
+		}
+		if(sizes.empty())
+			return nullptr;
+		void *p = malloc(max_size);
+		size_t n = ZDICT_trainFromBuffer(p, max_size, buf.data(), sizes.data(), (unsigned)sizes.size());
+		if(ZDICT_isError(n)) {
+			free(p);
+			return nullptr;
+		}
+		return new OwnedMemoryBlob(realloc(p, n), n);
+	}
+
+	RefPtr<Blob> CompressSeekable(Blob *b, size_t frame_size, int level, TaskRunner *pool) final
+	{
+		RefPtr<DynamicBlob> ret = new DynamicBlob();
+		if(!pool)
+			pool = GetPoolUser();
+		frame_size = std::clamp<size_t>(frame_size, 1, 1u << 30);
+		// The work runs on the pool, so the caller's thread is free as soon as it is queued
+		b->Then([ret, frame_size, level, pool](RefPtr<Blob> in, bool ok) {
+			if(!ok) {
+				ret->Resolved(true);
+				return;
+			}
+			pool->PostTask([ret, in, frame_size, level, pool]() {
+				DoCompressSeekable(in.get(), ret.get(), frame_size, level, pool);
+			});
+		});
+		return ret;
+	}
+
+	std::unique_ptr<SeekableDecompressor> OpenSeekable(Blob *b, TaskRunner *pool) final
+	{
+		auto data = b->GetContents();
+		auto p = (const uint8_t *)data.first;
+		size_t n = data.second;
+		if(n < kSeekFooterSize + 8 || Get32(p + n - 4) != kSeekableMagic)
+			return nullptr;
+		uint32_t count = Get32(p + n - kSeekFooterSize);
+		uint8_t descriptor = p[n - 5];
+		size_t entry = (descriptor & kSeekChecksumFlag) ? 12 : 8;
+		if((uint64_t)count * entry + kSeekFooterSize + 8 > n)
+			return nullptr;
+		size_t table = n - kSeekFooterSize - count * entry - 8;
+		if(Get32(p + table) != kSkippableMagic || Get32(p + table + 4) != count * entry + kSeekFooterSize)
+			return nullptr;
+		std::vector<ZSTDSeekable::Frame> frames(count);
+		uint64_t offset = 0;
+		uint64_t size = 0;
+		for(uint32_t i = 0; i < count; i++) {
+			auto e = p + table + 8 + i * entry;
+			frames[i] = {offset, size, Get32(e), Get32(e + 4)};
+			offset += frames[i].size;
+			size += frames[i].decompressed_size;
+		}
+		if(offset != table)
+			return nullptr;
+		return std::make_unique<ZSTDSeekable>(b, pool ? pool : GetPoolUser(), std::move(frames), size);
+	}
+
+private:
+	static void DoCompressSeekable(Blob *in, DynamicBlob *out, size_t frame_size, int level, TaskRunner *pool)
+	{
+		auto src = in->GetContents();
+		auto count = (uint32_t)((src.second + frame_size - 1) / frame_size);
+		std::vector<std::pair<void *, size_t>> frames(count);
+		std::atomic<bool> ok = true;
+		ParallelFor(pool, count, [&](uint32_t, size_t i) {
+			size_t len = std::min(frame_size, src.second - i * frame_size);
+			size_t bound = ZSTD_compressBound(len);
+			void *p = malloc(bound);
+			assert(p);
+			// Frames carry checksums so that Read can tell a corrupt one
+			auto cctx = ThreadCCtx();
+			ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+			ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+			ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+			size_t r = ZSTD_compress2(cctx, p, bound, (const uint8_t *)src.first + i * frame_size, len);
+			if(ZSTD_isError(r))
+				ok = false;
+			frames[i] = {p, ZSTD_isError(r) ? 0 : r};
+		});
+
+		size_t table = 8 + count * 8 + kSeekFooterSize;
+		size_t total = table;
+		for(auto &f : frames) total += f.second;
+		auto dst = (uint8_t *)(ok ? malloc(total) : nullptr);
+		auto q = dst;
+		for(uint32_t i = 0; i < count; i++) {
+			if(dst) {
+				memcpy(q, frames[i].first, frames[i].second);
+				q += frames[i].second;
+			}
+			free(frames[i].first);
+		}
+		if(!dst) {
+			out->Resolved(true);
+			return;
+		}
+		Put32(q, kSkippableMagic);
+		Put32(q + 4, (uint32_t)(table - 8));
+		q += 8;
+		for(uint32_t i = 0; i < count; i++, q += 8) {
+			Put32(q, (uint32_t)frames[i].second);
+			Put32(q + 4, (uint32_t)std::min(frame_size, src.second - i * frame_size));
+		}
+		Put32(q, count);
+		q[4] = 0;
+		Put32(q + 5, kSeekableMagic);
+		out->Set(dst, total);
+	}
 } zstd;
 
 }